@@ -68,6 +68,11 @@ void setup() {
     matrixClient.setMasterUserId(authorizedUserId);
     MatrixClient::logLevel = DEBUG;
 
+    MatrixSyncSchedule schedule;
+    schedule.enabled = true;
+    schedule.latencyTarget = 2000;  // Commands may wait up to 2 s while the room is quiet
+    matrixClient.setSyncSchedule(schedule);
+
     if (matrixClient.login(matrixUser, matrixPassword, defaultServerHost)) {
         logger(INFO, "Login successful!");
         if (matrixClient.sendDMToMaster("The client is now online.", "m.notice")) {
@@ -89,26 +94,31 @@ void loop() {
 
     std::vector<MatrixEvent> events = matrixClient.getRecentEvents();
     for (const MatrixEvent& event : events) {
+        const MatrixRoom* room = matrixClient.getRoom(event.room);
+        if (!room) {
+            continue;
+        }
+
         logger(INFO, "Event ID: " + event.eventId);
-        logger(INFO, "Event Type: " + event.eventType);
+        logger(INFO, "Event Type: " + String(matrixEventTypeName(event.eventType)));
         logger(INFO, "Sender: " + event.sender);
-        logger(INFO, "Room ID: " + event.roomId);
-        logger(INFO, "Room Name: " + event.roomName);
-        logger(INFO, "Room Topic: " + event.roomTopic);
-        logger(INFO, "Room Encryption: " + String(event.roomEncryption));
-        logger(INFO, "Message Type: " + event.messageType);
+        logger(INFO, "Room ID: " + room->roomId);
+        logger(INFO, "Room Name: " + room->name);
+        logger(INFO, "Room Topic: " + room->topic);
+        logger(INFO, "Room Encryption: " + String(room->encrypted));
+        logger(INFO, "Message Type: " + String(matrixMessageTypeName(event.messageType)));
         logger(INFO, "Message Content: " + event.messageContent);
         logger(INFO, "-------------------");
 
-        if (event.eventType == "invitation" && !event.roomEncryption && event.sender == authorizedUserId) {
-            matrixClient.joinRoom(event.roomId);
+        if (event.eventType == EVENT_INVITATION && !room->encrypted && event.sender == authorizedUserId) {
+            matrixClient.joinRoom(room->roomId);
         }
 
-        if (event.eventType == "message" && event.sender == authorizedUserId) {
-            matrixClient.sendReadReceipt(event.roomId, event.eventId);
-            matrixClient.sendMessageToRoom(event.roomId, "Unknown command");
+        if (event.eventType == EVENT_MESSAGE && event.sender == authorizedUserId) {
+            matrixClient.markRead(room->roomId, event.eventId);
+            matrixClient.sendMessageToRoom(room->roomId, "Unknown command");
         }
     }
 
-    delay(1000);  // Delay to simulate periodic checks
+    delay(matrixClient.getSyncDelay());  // Pause chosen by the sync schedule
 }
\ No newline at end of file
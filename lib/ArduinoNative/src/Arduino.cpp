@@ -0,0 +1,208 @@
+#include "Arduino.h"
+
+#include <chrono>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <mutex>
+#include <new>
+#include <random>
+#include <thread>
+
+static const auto startTime = std::chrono::steady_clock::now();
+
+unsigned long millis() {
+    return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long micros() {
+    return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield() {
+    std::this_thread::yield();
+}
+
+static std::mt19937& rng() {
+    static std::mt19937 engine(std::random_device{}());
+    return engine;
+}
+
+long random(long howbig) {
+    if (howbig <= 0) return 0;
+    return (long)(rng()() % (unsigned long)howbig);
+}
+
+long random(long howsmall, long howbig) {
+    if (howsmall >= howbig) return howsmall;
+    return howsmall + random(howbig - howsmall);
+}
+
+uint32_t esp_random() {
+    return (uint32_t)rng()();
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+    size_t n = 0;
+    while (size--) {
+        if (!write(*buffer++)) break;
+        n++;
+    }
+    return n;
+}
+
+size_t Print::printf(const char* format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (len < 0) return 0;
+    return write((const uint8_t*)buf, (size_t)len < sizeof(buf) ? (size_t)len : sizeof(buf) - 1);
+}
+
+int Stream::timedRead() {
+    unsigned long start = millis();
+    do {
+        int c = read();
+        if (c >= 0) return c;
+        yield();
+    } while (millis() - start < _timeout);
+    return -1;
+}
+
+size_t Stream::readBytes(char* buffer, size_t length) {
+    size_t count = 0;
+    while (count < length) {
+        int c = timedRead();
+        if (c < 0) break;
+        *buffer++ = (char)c;
+        count++;
+    }
+    return count;
+}
+
+String Stream::readString() {
+    String ret;
+    int c = timedRead();
+    while (c >= 0) {
+        ret += (char)c;
+        c = timedRead();
+    }
+    return ret;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+    return fwrite(&c, 1, 1, stdout);
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+    return fwrite(buffer, 1, size, stdout);
+}
+
+HardwareSerial Serial;
+EspClass ESP;
+
+// Allocation accounting. Every block carries a small header with its size so
+// that frees can be attributed; this lets benchmarks report heap churn the
+// same way the ESP32 heap tracer would.
+static NativeHeapStats heapStats = {0, 0, 0, 0, 0};
+static std::mutex heapStatsLock; // the sync task allocates concurrently
+
+struct alignas(std::max_align_t) AllocationHeader {
+    size_t size;
+};
+
+void* nativeMalloc(size_t size) {
+    AllocationHeader* header = (AllocationHeader*)malloc(sizeof(AllocationHeader) + size);
+    if (!header) return nullptr;
+    header->size = size;
+    std::lock_guard<std::mutex> lock(heapStatsLock);
+    heapStats.allocations++;
+    heapStats.bytesAllocated += size;
+    heapStats.bytesInUse += size;
+    if (heapStats.bytesInUse > heapStats.peakBytesInUse) heapStats.peakBytesInUse = heapStats.bytesInUse;
+    return header + 1;
+}
+
+void nativeFree(void* ptr) {
+    if (!ptr) return;
+    AllocationHeader* header = (AllocationHeader*)ptr - 1;
+    {
+        std::lock_guard<std::mutex> lock(heapStatsLock);
+        heapStats.frees++;
+        heapStats.bytesInUse -= header->size;
+    }
+    free(header);
+}
+
+void* nativeRealloc(void* ptr, size_t size) {
+    if (!ptr) return nativeMalloc(size);
+    AllocationHeader* header = (AllocationHeader*)ptr - 1;
+    if (header->size >= size) return ptr;
+    void* grown = nativeMalloc(size);
+    if (!grown) return nullptr;
+    memcpy(grown, ptr, header->size);
+    nativeFree(ptr);
+    return grown;
+}
+
+void* operator new(size_t size) {
+    void* p = nativeMalloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return nativeMalloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return nativeMalloc(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    nativeFree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    nativeFree(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    nativeFree(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    nativeFree(ptr);
+}
+
+NativeHeapStats nativeHeapStats() {
+    std::lock_guard<std::mutex> lock(heapStatsLock);
+    return heapStats;
+}
+
+void nativeResetHeapPeak() {
+    std::lock_guard<std::mutex> lock(heapStatsLock);
+    heapStats.peakBytesInUse = heapStats.bytesInUse;
+}
+
+uint32_t EspClass::getFreeHeap() {
+    NativeHeapStats stats = nativeHeapStats();
+    return stats.bytesInUse >= heapSize ? 0 : heapSize - (uint32_t)stats.bytesInUse;
+}
+
+uint32_t EspClass::getMinFreeHeap() {
+    NativeHeapStats stats = nativeHeapStats();
+    return stats.peakBytesInUse >= heapSize ? 0 : heapSize - (uint32_t)stats.peakBytesInUse;
+}
@@ -0,0 +1,64 @@
+// Minimal Arduino core replacement for building MatrixClient on a host machine.
+#ifndef ARDUINO_NATIVE_ARDUINO_H
+#define ARDUINO_NATIVE_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+long random(long howbig);
+long random(long howsmall, long howbig);
+uint32_t esp_random();
+
+class HardwareSerial : public Stream {
+public:
+    void begin(unsigned long baud) { (void)baud; }
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t* buffer, size_t size) override;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+    uint64_t getEfuseMac() { return efuseMac; }
+    uint32_t getFreeHeap();
+    uint32_t getMinFreeHeap();
+    uint32_t getHeapSize() { return heapSize; }
+
+    // Host-only knobs so tests can emulate a particular device.
+    uint64_t efuseMac = 0x0000A1B2C3D4E5F6ULL;
+    uint32_t heapSize = 320 * 1024;
+};
+
+extern EspClass ESP;
+
+// Heap accounting hooks fed by the host allocator, see Arduino.cpp.
+struct NativeHeapStats {
+    size_t allocations;
+    size_t frees;
+    size_t bytesAllocated;
+    size_t bytesInUse;
+    size_t peakBytesInUse;
+};
+
+void* nativeMalloc(size_t size);
+void* nativeRealloc(void* ptr, size_t size);
+void nativeFree(void* ptr);
+NativeHeapStats nativeHeapStats();
+void nativeResetHeapPeak();
+
+#endif // ARDUINO_NATIVE_ARDUINO_H
@@ -0,0 +1,24 @@
+// Host-side subset of the Arduino Client interface.
+#ifndef ARDUINO_NATIVE_CLIENT_H
+#define ARDUINO_NATIVE_CLIENT_H
+
+#include "Stream.h"
+
+class Client : public Stream {
+public:
+    virtual int connect(const char* host, uint16_t port) = 0;
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buf, size_t size) = 0;
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int read(uint8_t* buf, size_t size) = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+    virtual void stop() = 0;
+    virtual uint8_t connected() = 0;
+    virtual operator bool() = 0;
+
+    using Print::write;
+};
+
+#endif // ARDUINO_NATIVE_CLIENT_H
@@ -0,0 +1,170 @@
+#include "MockClient.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+#include "Arduino.h"
+
+static const char* reasonPhrase(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 206: return "Partial Content";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 429: return "Too Many Requests";
+        case 500: return "Internal Server Error";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        default: return "Status";
+    }
+}
+
+std::string MockClient::response(int status, const std::string& body, const std::string& extraHeaders) {
+    char statusLine[64];
+    snprintf(statusLine, sizeof(statusLine), "HTTP/1.1 %d %s\r\n", status, reasonPhrase(status));
+    std::string raw = statusLine;
+    raw += "Content-Type: application/json\r\n";
+    raw += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    raw += extraHeaders;
+    raw += "\r\n";
+    raw += body;
+    return raw;
+}
+
+std::string MockClient::chunkedResponse(int status, const std::string& body, size_t chunkSize,
+                                        const std::string& extraHeaders) {
+    char statusLine[64];
+    snprintf(statusLine, sizeof(statusLine), "HTTP/1.1 %d %s\r\n", status, reasonPhrase(status));
+    std::string raw = statusLine;
+    raw += "Content-Type: application/json\r\n";
+    raw += "Transfer-Encoding: chunked\r\n";
+    raw += extraHeaders;
+    raw += "\r\n";
+    for (size_t offset = 0; offset < body.size(); offset += chunkSize) {
+        size_t length = body.size() - offset < chunkSize ? body.size() - offset : chunkSize;
+        char size[16];
+        snprintf(size, sizeof(size), "%zx\r\n", length);
+        raw += size;
+        raw.append(body, offset, length);
+        raw += "\r\n";
+    }
+    raw += "0\r\n\r\n";
+    return raw;
+}
+
+int MockClient::connect(const char* host, uint16_t port) {
+    (void)host;
+    (void)port;
+    if (refuseConnect) return 0;
+    counters.connects++;
+    open = true;
+    tx.clear();
+    rx.clear();
+    rxPos = 0;
+    return 1;
+}
+
+size_t MockClient::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+size_t MockClient::write(const uint8_t* buf, size_t size) {
+    if (!open) return 0;
+    counters.writeCalls++;
+    counters.bytesWritten += size;
+    tx.append((const char*)buf, size);
+    parseRequests();
+    return size;
+}
+
+// Splits the transmitted bytes into complete requests and queues one
+// response for each of them, in order, which also covers pipelining.
+void MockClient::parseRequests() {
+    while (true) {
+        size_t headerEnd = tx.find("\r\n\r\n");
+        if (headerEnd == std::string::npos) return;
+        size_t bodyLength = 0;
+        std::string headers = tx.substr(0, headerEnd);
+        for (size_t pos = 0; pos < headers.size();) {
+            size_t eol = headers.find("\r\n", pos);
+            if (eol == std::string::npos) eol = headers.size();
+            std::string line = headers.substr(pos, eol - pos);
+            if (strncasecmp(line.c_str(), "Content-Length:", 15) == 0) {
+                bodyLength = strtoul(line.c_str() + 15, nullptr, 10);
+            }
+            pos = eol + 2;
+        }
+        size_t total = headerEnd + 4 + bodyLength;
+        if (tx.size() < total) return;
+
+        std::string request = tx.substr(0, total);
+        tx.erase(0, total);
+        requests.push_back(request);
+        counters.requests++;
+
+        std::string reply;
+        if (responder) {
+            reply = responder(request);
+        } else if (!responses.empty()) {
+            reply = responses.front();
+            responses.pop_front();
+        }
+        if (rxPos == rx.size()) {
+            rx.clear();
+            rxPos = 0;
+        }
+        rx += reply;
+        readyAt = millis() + firstByteDelay;
+    }
+}
+
+size_t MockClient::visible() {
+    if (millis() < readyAt) return 0;
+    size_t pending = rx.size() - rxPos;
+    if (deliveryChunk && pending > deliveryChunk) return deliveryChunk;
+    return pending;
+}
+
+int MockClient::available() {
+    return (int)visible();
+}
+
+int MockClient::read() {
+    if (!visible()) return -1;
+    counters.bytesRead++;
+    unsigned char c = (unsigned char)rx[rxPos++];
+    if (closeAfterResponse && rxPos == rx.size()) open = false;
+    return c;
+}
+
+int MockClient::read(uint8_t* buf, size_t size) {
+    size_t count = visible();
+    if (count == 0) return -1;
+    if (count > size) count = size;
+    memcpy(buf, rx.data() + rxPos, count);
+    rxPos += count;
+    counters.bytesRead += count;
+    if (closeAfterResponse && rxPos == rx.size()) open = false;
+    return (int)count;
+}
+
+int MockClient::peek() {
+    if (!visible()) return -1;
+    return (unsigned char)rx[rxPos];
+}
+
+void MockClient::stop() {
+    if (open) counters.stops++;
+    open = false;
+    rx.clear();
+    rxPos = 0;
+    tx.clear();
+}
+
+uint8_t MockClient::connected() {
+    return open || rxPos < rx.size();
+}
@@ -0,0 +1,77 @@
+// Scriptable in-memory Client for exercising MatrixClient without a network.
+#ifndef ARDUINO_NATIVE_MOCK_CLIENT_H
+#define ARDUINO_NATIVE_MOCK_CLIENT_H
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Client.h"
+
+class MockClient : public Client {
+public:
+    // Produces the raw response (status line, headers and body) for a request.
+    using Responder = std::function<std::string(const std::string& request)>;
+
+    struct Stats {
+        unsigned long connects = 0;
+        unsigned long stops = 0;
+        unsigned long writeCalls = 0;
+        unsigned long requests = 0;
+        size_t bytesWritten = 0;
+        size_t bytesRead = 0;
+    };
+
+    // Builds a complete HTTP/1.1 response with a Content-Length header.
+    static std::string response(int status, const std::string& body,
+                                const std::string& extraHeaders = "");
+    // Same as response() but the body is sent with chunked transfer encoding.
+    static std::string chunkedResponse(int status, const std::string& body, size_t chunkSize,
+                                       const std::string& extraHeaders = "");
+
+    void queueResponse(const std::string& raw) { responses.push_back(raw); }
+    void setResponder(Responder handler) { responder = handler; }
+
+    // Server behaviour knobs
+    bool refuseConnect = false;
+    bool closeAfterResponse = false; // emulates a server without keep-alive
+    size_t deliveryChunk = 0;        // caps bytes visible per available() call, 0 = everything
+    unsigned long firstByteDelay = 0;  // ms before a response becomes readable
+
+    const Stats& stats() const { return counters; }
+    void resetStats() { counters = Stats(); }
+    const std::vector<std::string>& requestLog() const { return requests; }
+    void clearRequestLog() { requests.clear(); }
+    void serverClose() { open = false; rx.clear(); }
+
+    int connect(const char* host, uint16_t port) override;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t* buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t* buf, size_t size) override;
+    int peek() override;
+    void flush() override {}
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override { return connected(); }
+
+    using Print::write;
+
+private:
+    void parseRequests();
+    size_t visible();
+
+    std::deque<std::string> responses;
+    Responder responder;
+    std::string tx;
+    std::string rx;
+    size_t rxPos = 0;
+    unsigned long readyAt = 0;
+    bool open = false;
+    Stats counters;
+    std::vector<std::string> requests;
+};
+
+#endif // ARDUINO_NATIVE_MOCK_CLIENT_H
@@ -0,0 +1,32 @@
+// Host-side subset of the Arduino Print class.
+#ifndef ARDUINO_NATIVE_PRINT_H
+#define ARDUINO_NATIVE_PRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "WString.h"
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    size_t write(const char* str) { return str ? write((const uint8_t*)str, strlen(str)) : 0; }
+    size_t write(const char* buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+    virtual void flush() {}
+
+    size_t print(const String& s) { return write((const uint8_t*)s.c_str(), s.length()); }
+    size_t print(const char* s) { return write(s); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int n) { return print(String(n)); }
+    size_t print(unsigned int n) { return print(String(n)); }
+    size_t print(long n) { return print(String(n)); }
+    size_t print(unsigned long n) { return print(String(n)); }
+    size_t print(double n) { return print(String(n)); }
+    size_t println() { return write("\r\n"); }
+    template <typename T> size_t println(const T& value) { size_t n = print(value); return n + println(); }
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+#endif // ARDUINO_NATIVE_PRINT_H
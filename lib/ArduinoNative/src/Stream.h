@@ -0,0 +1,25 @@
+// Host-side subset of the Arduino Stream class.
+#ifndef ARDUINO_NATIVE_STREAM_H
+#define ARDUINO_NATIVE_STREAM_H
+
+#include "Print.h"
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+    unsigned long getTimeout() const { return _timeout; }
+
+    virtual size_t readBytes(char* buffer, size_t length);
+    size_t readBytes(uint8_t* buffer, size_t length) { return readBytes((char*)buffer, length); }
+    String readString();
+
+protected:
+    int timedRead();
+    unsigned long _timeout = 1000;
+};
+
+#endif // ARDUINO_NATIVE_STREAM_H
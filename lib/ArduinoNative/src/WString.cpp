@@ -0,0 +1,371 @@
+#include "WString.h"
+#include "Arduino.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+String::String(const char* cstr) {
+    if (cstr) copy(cstr, strlen(cstr));
+}
+
+String::String(const char* cstr, unsigned int length) {
+    if (cstr) copy(cstr, length);
+}
+
+String::String(const String& str) {
+    *this = str;
+}
+
+String::String(String&& rval) {
+    *this = static_cast<String&&>(rval);
+}
+
+String::String(char c) {
+    char buf[2] = {c, 0};
+    copy(buf, c ? 1 : 0);
+}
+
+static void formatNumber(String& out, unsigned long long value, bool negative, unsigned char base) {
+    char buf[66];
+    char* p = buf + sizeof(buf) - 1;
+    *p = 0;
+    if (base < 2) base = 10;
+    do {
+        unsigned digit = (unsigned)(value % base);
+        *--p = (char)(digit < 10 ? '0' + digit : 'a' + digit - 10);
+        value /= base;
+    } while (value);
+    if (negative) *--p = '-';
+    out = p;
+}
+
+String::String(unsigned char value, unsigned char base) {
+    formatNumber(*this, value, false, base);
+}
+
+String::String(int value, unsigned char base) {
+    bool negative = value < 0 && base == 10;
+    formatNumber(*this, negative ? -(long long)value : (unsigned int)value, negative, base);
+}
+
+String::String(unsigned int value, unsigned char base) {
+    formatNumber(*this, value, false, base);
+}
+
+String::String(long value, unsigned char base) {
+    bool negative = value < 0 && base == 10;
+    formatNumber(*this, negative ? -(long long)value : (unsigned long)value, negative, base);
+}
+
+String::String(unsigned long value, unsigned char base) {
+    formatNumber(*this, value, false, base);
+}
+
+String::String(long long value, unsigned char base) {
+    bool negative = value < 0 && base == 10;
+    formatNumber(*this, negative ? 0ULL - (unsigned long long)value : (unsigned long long)value, negative, base);
+}
+
+String::String(unsigned long long value, unsigned char base) {
+    formatNumber(*this, value, false, base);
+}
+
+String::String(float value, unsigned int decimalPlaces) {
+    char buf[48];
+    snprintf(buf, sizeof(buf), "%.*f", decimalPlaces, (double)value);
+    copy(buf, strlen(buf));
+}
+
+String::String(double value, unsigned int decimalPlaces) {
+    char buf[48];
+    snprintf(buf, sizeof(buf), "%.*f", decimalPlaces, value);
+    copy(buf, strlen(buf));
+}
+
+String::~String() {
+    nativeFree(buffer);
+}
+
+bool String::reserve(unsigned int size) {
+    if (buffer && capacity >= size) return true;
+    if (changeBuffer(size)) {
+        if (len == 0) buffer[0] = 0;
+        return true;
+    }
+    return false;
+}
+
+bool String::changeBuffer(unsigned int maxStrLen) {
+    char* newBuffer = (char*)nativeRealloc(buffer, maxStrLen + 1);
+    if (!newBuffer) return false;
+    buffer = newBuffer;
+    capacity = maxStrLen;
+    return true;
+}
+
+String& String::copy(const char* cstr, unsigned int length) {
+    if (!reserve(length)) {
+        clear();
+        return *this;
+    }
+    len = length;
+    memmove(buffer, cstr, length);
+    buffer[len] = 0;
+    return *this;
+}
+
+String& String::operator=(const String& rhs) {
+    if (this == &rhs) return *this;
+    if (rhs.buffer) copy(rhs.buffer, rhs.len);
+    else clear();
+    return *this;
+}
+
+String& String::operator=(const char* cstr) {
+    if (cstr) copy(cstr, strlen(cstr));
+    else clear();
+    return *this;
+}
+
+String& String::operator=(String&& rval) {
+    if (this != &rval) {
+        nativeFree(buffer);
+        buffer = rval.buffer;
+        capacity = rval.capacity;
+        len = rval.len;
+        rval.buffer = nullptr;
+        rval.capacity = 0;
+        rval.len = 0;
+    }
+    return *this;
+}
+
+bool String::concat(const char* cstr, unsigned int length) {
+    if (!cstr) return false;
+    if (length == 0) return true;
+    unsigned int newLen = len + length;
+    if (!reserve(newLen)) return false;
+    memmove(buffer + len, cstr, length);
+    len = newLen;
+    buffer[len] = 0;
+    return true;
+}
+
+bool String::concat(const String& str) {
+    if (&str == this) {
+        String copyOfSelf(str);
+        return concat(copyOfSelf.c_str(), copyOfSelf.len);
+    }
+    return concat(str.c_str(), str.len);
+}
+
+bool String::concat(const char* cstr) {
+    return cstr ? concat(cstr, strlen(cstr)) : false;
+}
+
+bool String::concat(char c) {
+    return concat(&c, 1);
+}
+
+bool String::concat(unsigned char num) { return concat(String(num)); }
+bool String::concat(int num) { return concat(String(num)); }
+bool String::concat(unsigned int num) { return concat(String(num)); }
+bool String::concat(long num) { return concat(String(num)); }
+bool String::concat(unsigned long num) { return concat(String(num)); }
+bool String::concat(long long num) { return concat(String(num)); }
+bool String::concat(unsigned long long num) { return concat(String(num)); }
+bool String::concat(float num) { return concat(String(num)); }
+bool String::concat(double num) { return concat(String(num)); }
+
+StringSumHelper& operator+(const StringSumHelper& lhs, const String& rhs) {
+    StringSumHelper& a = const_cast<StringSumHelper&>(lhs);
+    a.concat(rhs);
+    return a;
+}
+
+StringSumHelper& operator+(const StringSumHelper& lhs, const char* cstr) {
+    StringSumHelper& a = const_cast<StringSumHelper&>(lhs);
+    a.concat(cstr);
+    return a;
+}
+
+#define STRING_SUM_OPERATOR(T)                                              \
+    StringSumHelper& operator+(const StringSumHelper& lhs, T num) {         \
+        StringSumHelper& a = const_cast<StringSumHelper&>(lhs);             \
+        a.concat(num);                                                      \
+        return a;                                                           \
+    }
+STRING_SUM_OPERATOR(char)
+STRING_SUM_OPERATOR(unsigned char)
+STRING_SUM_OPERATOR(int)
+STRING_SUM_OPERATOR(unsigned int)
+STRING_SUM_OPERATOR(long)
+STRING_SUM_OPERATOR(unsigned long)
+STRING_SUM_OPERATOR(long long)
+STRING_SUM_OPERATOR(unsigned long long)
+STRING_SUM_OPERATOR(float)
+STRING_SUM_OPERATOR(double)
+
+int String::compareTo(const String& s) const {
+    return strcmp(c_str(), s.c_str());
+}
+
+bool String::equals(const String& s) const {
+    return len == s.len && compareTo(s) == 0;
+}
+
+bool String::equals(const char* cstr) const {
+    if (!cstr) return len == 0;
+    return strcmp(c_str(), cstr) == 0;
+}
+
+bool String::equalsIgnoreCase(const String& s) const {
+    if (len != s.len) return false;
+    for (unsigned int i = 0; i < len; i++) {
+        if (tolower((unsigned char)buffer[i]) != tolower((unsigned char)s.buffer[i])) return false;
+    }
+    return true;
+}
+
+bool String::startsWith(const String& prefix) const {
+    return len >= prefix.len && startsWith(prefix, 0);
+}
+
+bool String::startsWith(const String& prefix, unsigned int offset) const {
+    if (offset > len || prefix.len > len - offset) return false;
+    return strncmp(c_str() + offset, prefix.c_str(), prefix.len) == 0;
+}
+
+bool String::endsWith(const String& suffix) const {
+    if (len < suffix.len) return false;
+    return strcmp(c_str() + len - suffix.len, suffix.c_str()) == 0;
+}
+
+char String::charAt(unsigned int index) const {
+    return operator[](index);
+}
+
+void String::setCharAt(unsigned int index, char c) {
+    if (index < len) buffer[index] = c;
+}
+
+char String::operator[](unsigned int index) const {
+    return index < len ? buffer[index] : 0;
+}
+
+char& String::operator[](unsigned int index) {
+    static char dummy;
+    if (index >= len) {
+        dummy = 0;
+        return dummy;
+    }
+    return buffer[index];
+}
+
+int String::indexOf(char ch) const {
+    return indexOf(ch, 0);
+}
+
+int String::indexOf(char ch, unsigned int fromIndex) const {
+    if (fromIndex >= len) return -1;
+    const char* found = (const char*)memchr(buffer + fromIndex, ch, len - fromIndex);
+    return found ? (int)(found - buffer) : -1;
+}
+
+int String::indexOf(const String& str) const {
+    return indexOf(str, 0);
+}
+
+int String::indexOf(const String& str, unsigned int fromIndex) const {
+    if (fromIndex >= len) return -1;
+    const char* found = strstr(buffer + fromIndex, str.c_str());
+    return found ? (int)(found - buffer) : -1;
+}
+
+int String::lastIndexOf(char ch) const {
+    return len ? lastIndexOf(ch, len - 1) : -1;
+}
+
+int String::lastIndexOf(char ch, unsigned int fromIndex) const {
+    if (fromIndex >= len) return -1;
+    for (int i = (int)fromIndex; i >= 0; i--) {
+        if (buffer[i] == ch) return i;
+    }
+    return -1;
+}
+
+int String::lastIndexOf(const String& str) const {
+    if (str.len == 0 || str.len > len) return -1;
+    for (int i = (int)(len - str.len); i >= 0; i--) {
+        if (strncmp(buffer + i, str.c_str(), str.len) == 0) return i;
+    }
+    return -1;
+}
+
+String String::substring(unsigned int left, unsigned int right) const {
+    if (left > right) {
+        unsigned int temp = right;
+        right = left;
+        left = temp;
+    }
+    if (left >= len) return String();
+    if (right > len) right = len;
+    return String(buffer + left, right - left);
+}
+
+void String::replace(const String& find, const String& replace) {
+    if (len == 0 || find.len == 0) return;
+    String result;
+    unsigned int i = 0;
+    while (i < len) {
+        if (i + find.len <= len && strncmp(buffer + i, find.c_str(), find.len) == 0) {
+            result.concat(replace);
+            i += find.len;
+        } else {
+            result.concat(buffer[i]);
+            i++;
+        }
+    }
+    *this = static_cast<String&&>(result);
+}
+
+void String::remove(unsigned int index) {
+    remove(index, (unsigned int)-1);
+}
+
+void String::remove(unsigned int index, unsigned int count) {
+    if (index >= len || count == 0) return;
+    if (count > len - index) count = len - index;
+    memmove(buffer + index, buffer + index + count, len - index - count);
+    len -= count;
+    buffer[len] = 0;
+}
+
+void String::toLowerCase() {
+    for (unsigned int i = 0; i < len; i++) buffer[i] = (char)tolower((unsigned char)buffer[i]);
+}
+
+void String::toUpperCase() {
+    for (unsigned int i = 0; i < len; i++) buffer[i] = (char)toupper((unsigned char)buffer[i]);
+}
+
+void String::trim() {
+    if (len == 0) return;
+    unsigned int begin = 0;
+    while (begin < len && isspace((unsigned char)buffer[begin])) begin++;
+    unsigned int end = len;
+    while (end > begin && isspace((unsigned char)buffer[end - 1])) end--;
+    len = end - begin;
+    if (begin > 0) memmove(buffer, buffer + begin, len);
+    buffer[len] = 0;
+}
+
+long String::toInt() const {
+    return buffer ? atol(buffer) : 0;
+}
+
+double String::toDouble() const {
+    return buffer ? atof(buffer) : 0;
+}
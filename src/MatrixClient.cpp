@@ -1,569 +1,2803 @@
 #include "MatrixClient.h"
-#include <WiFiClientSecure.h>
-
-#define ZERO_COPY(STR)    ((char*)STR.c_str())
+#include "MatrixInflate.h"
+
+#include <algorithm>
+#include <stdarg.h>
+#ifdef ESP_PLATFORM
+#if __has_include(<esp_random.h>)
+#include <esp_random.h> // ESP-IDF 4.3 and later
+#else
+#include <esp_system.h>
+#endif
+#endif
+
+
+// The level is checked before the message is built, so suppressed messages
+// cost nothing, and levels above MATRIX_LOG_LEVEL are removed by the compiler.
+#define MATRIX_LOG(level, message)             \
+    do {                                       \
+        if (MatrixClient::logEnabled(level)) { \
+            logger(level, message);            \
+        }                                      \
+    } while (0)
+
+#define MATRIX_LOGF(level, ...)                \
+    do {                                       \
+        if (MatrixClient::logEnabled(level)) { \
+            logFormatted(level, __VA_ARGS__);  \
+        }                                      \
+    } while (0)
 
 LogLevel MatrixClient::logLevel = INFO; // Set default log level
 
+static const char* const messageTypeNames[] = {
+    "", "m.text", "m.notice", "m.emote", "m.image", "m.file", "m.audio", "m.video", "m.location"
+};
+
+static const char* const endpointNames[] = {
+    "login", "refresh", "sync", "send", "upload", "download", "other"
+};
+
+// Room the parsed response of each endpoint needs, from the shape of what the
+// server answers. Bodies are parsed in place, so their strings take no room of
+// their own. Any endpoint may answer with an error object instead.
+static constexpr size_t ERROR_CAPACITY = JSON_OBJECT_SIZE(4); // errcode, error, retry_after_ms, soft_logout
+static constexpr size_t MEDIA_EVENT_CAPACITY = JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(5); // msgtype, body, url, info: mimetype, size, w, h, duration
+
+static constexpr size_t responseCapacity(size_t shape) {
+    return shape > ERROR_CAPACITY ? shape : ERROR_CAPACITY;
+}
+
+static constexpr size_t DISCOVERY_CAPACITY = responseCapacity(JSON_OBJECT_SIZE(4) + 4 * JSON_OBJECT_SIZE(2)); // m.homeserver and friends, each with a base_url
+static constexpr size_t LOGIN_CAPACITY = responseCapacity(JSON_OBJECT_SIZE(7) + JSON_OBJECT_SIZE(2) + 2 * JSON_OBJECT_SIZE(1)); // Tokens, IDs, expiry and well_known
+static constexpr size_t REFRESH_CAPACITY = responseCapacity(JSON_OBJECT_SIZE(3));
+static constexpr size_t FILTER_CAPACITY = responseCapacity(JSON_OBJECT_SIZE(1));
+static constexpr size_t CREATE_ROOM_CAPACITY = responseCapacity(JSON_OBJECT_SIZE(2));
+static constexpr size_t SEND_CAPACITY = responseCapacity(JSON_OBJECT_SIZE(3)); // Filtered by buildSendFilter()
+static constexpr size_t UPLOAD_CAPACITY = responseCapacity(JSON_OBJECT_SIZE(1));
+static constexpr size_t DIRECT_CAPACITY = responseCapacity(JSON_OBJECT_SIZE(8) + 8 * JSON_ARRAY_SIZE(4) + JSON_ARRAY_SIZE(1)); // m.direct of 8 users with 4 rooms each, and the room we add
+static const size_t MAX_TIMELINE_GAPS = 8; // The oldest gap is given up beyond this
+static const char* const BACKFILL_FILTER = "%7B%22types%22%3A%5B%22m.room.message%22%5D%7D"; // {"types":["m.room.message"]}, URL-encoded
+
+static constexpr size_t POOL_DOCUMENT_CAPACITY = std::max({DISCOVERY_CAPACITY, LOGIN_CAPACITY, REFRESH_CAPACITY, FILTER_CAPACITY, CREATE_ROOM_CAPACITY, SEND_CAPACITY, UPLOAD_CAPACITY, DIRECT_CAPACITY});
+
+const char* matrixEventTypeName(MatrixEventType type) {
+    return type == EVENT_INVITATION ? "invitation" : "message";
+}
+
+const char* matrixMessageTypeName(MatrixMessageType type) {
+    if (type >= MESSAGE_OTHER) {
+        return "other";
+    }
+    return messageTypeNames[type];
+}
+
+const char* matrixEndpointName(MatrixEndpoint endpoint) {
+    return endpoint < ENDPOINT_COUNT ? endpointNames[endpoint] : endpointNames[ENDPOINT_OTHER];
+}
+
+// Sync, upload and download know their endpoint; everything else goes
+// through exchangeHTTP() and is told apart by its path.
+static MatrixEndpoint endpointOf(const String& url) {
+    const char* path = strstr(url.c_str(), "/_matrix/client/");
+    if (!path) {
+        return ENDPOINT_OTHER;
+    }
+    if (strstr(path, "/send/")) {
+        return ENDPOINT_SEND;
+    }
+    if (strstr(path, "/login")) {
+        return ENDPOINT_LOGIN;
+    }
+    if (strstr(path, "/refresh")) {
+        return ENDPOINT_REFRESH;
+    }
+    return ENDPOINT_OTHER;
+}
+
+// Samples of the free heap between the steps of a request miss its low
+// point, e.g. during the TLS handshake. ESP.getMinFreeHeap() has it whenever
+// the request took the heap to a new low since boot, the case that matters.
+static void startHeapMetrics(MatrixRequestMetrics& metrics) {
+    metrics.minFreeHeap = ESP.getFreeHeap();
+    metrics.minFreeHeapBefore = ESP.getMinFreeHeap();
+}
+
+static void sampleHeapMetrics(MatrixRequestMetrics& metrics) {
+    uint32_t freeHeap = ESP.getFreeHeap();
+    uint32_t lowest = ESP.getMinFreeHeap();
+    if (lowest < metrics.minFreeHeapBefore && lowest < freeHeap) {
+        freeHeap = lowest;
+    }
+    if (freeHeap < metrics.minFreeHeap) {
+        metrics.minFreeHeap = freeHeap;
+    }
+}
+
+MatrixMessageType matrixMessageType(const char* msgtype) {
+    if (!msgtype || !*msgtype) {
+        return MESSAGE_NONE;
+    }
+    for (int type = MESSAGE_TEXT; type < MESSAGE_OTHER; type++) {
+        if (strcmp(msgtype, messageTypeNames[type]) == 0) {
+            return (MatrixMessageType)type;
+        }
+    }
+    return MESSAGE_OTHER;
+}
+
+// Seconds since the epoch, or 0 while the clock has not been set (by NTP or
+// configTime()); anything before 2020 counts as not set.
+static int64_t wallClock() {
+    time_t now = time(nullptr);
+    return now > 1577836800 ? (int64_t)now : 0;
+}
+
+static String urlEncode(const String& value) {
+    const char* hex = "0123456789ABCDEF";
+    String encoded;
+    encoded.reserve(value.length());
+    for (unsigned int i = 0; i < value.length(); i++) {
+        char c = value[i];
+        if (isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            encoded += c;
+        } else {
+            encoded += '%';
+            encoded += hex[(c >> 4) & 0x0F];
+            encoded += hex[c & 0x0F];
+        }
+    }
+    return encoded;
+}
+
+// Derived from the ESP32's MAC address, so it stays the same across restarts.
+static String macDeviceId() {
+    uint64_t mac = ESP.getEfuseMac();
+    char deviceId[13];
+    snprintf(deviceId, sizeof(deviceId), "%04X%08X", (uint16_t)(mac >> 32), (uint32_t)mac);
+    return deviceId;
+}
+
+// The counter starts over with every boot; the random nonce keeps the IDs
+// of one boot apart from those of the previous ones.
+static String makeTransactionPrefix() {
+    char prefix[24];
+    snprintf(prefix, sizeof(prefix), "%s.%08lx.", macDeviceId().c_str(), (unsigned long)esp_random());
+    return prefix;
+}
+
 MatrixClient::MatrixClient(Client& client, MatrixClient::LoggerFunction logger)
-    : client(&client), logger(logger ? logger : MatrixClient::defaultLoggerFunction) {
+    : ownConnection(new HTTPConnection(client)), connection(*ownConnection), syncConnection(&connection), logger(logger ? logger : MatrixClient::defaultLoggerFunction),
+      requestMutex(ownRequestMutex), ownJsonPool(new MatrixJsonPool(POOL_DOCUMENT_CAPACITY)), jsonPool(*ownJsonPool), syncDocument(ownSyncDocument) {
+    transactionPrefix = makeTransactionPrefix();
+}
+
+MatrixClient::MatrixClient(Client& client, Client& syncClient, MatrixClient::LoggerFunction logger)
+    : ownConnection(new HTTPConnection(client)), connection(*ownConnection), ownSyncConnection(new HTTPConnection(syncClient)), logger(logger ? logger : MatrixClient::defaultLoggerFunction),
+      requestMutex(ownRequestMutex), ownJsonPool(new MatrixJsonPool(POOL_DOCUMENT_CAPACITY)), jsonPool(*ownJsonPool), syncDocument(ownSyncDocument) {
+    syncConnection = ownSyncConnection.get();
+    transactionPrefix = makeTransactionPrefix();
+}
+
+MatrixClient::MatrixClient(HTTPConnection& connection, HTTPConnection& syncConnection, std::recursive_mutex& requestMutex, String& linkHost, MatrixJsonPool& jsonPool,
+                           std::unique_ptr<DynamicJsonDocument>& syncDocument, MatrixClient::LoggerFunction logger)
+    : connection(connection), syncConnection(&syncConnection), logger(logger ? logger : MatrixClient::defaultLoggerFunction),
+      requestMutex(requestMutex), pooled(true), linkHost(&linkHost), jsonPool(jsonPool), syncDocument(syncDocument) {
+    transactionPrefix = makeTransactionPrefix();
+}
+
+size_t MatrixClient::jsonDocumentCapacity() {
+    return POOL_DOCUMENT_CAPACITY;
+}
+
+MatrixClient::~MatrixClient() {
+    stopSyncTask();
 }
 
 bool MatrixClient::discoverServer(const String& matrixUser) {
     int colonIndex = matrixUser.indexOf(':');
     if (colonIndex == -1) {
-        logger(ERROR, "Invalid Matrix ID");
+        MATRIX_LOG(ERROR, "Invalid Matrix ID");
         return false;
     }
 
     String hostname = matrixUser.substring(colonIndex + 1);
     String url = "https://" + hostname + "/.well-known/matrix/client";
 
-    String responseBody = performHTTPRequest(url, "GET", "", false);
-
-    DynamicJsonDocument doc(maxMessageLength);
-    DeserializationError error = deserializeJson(doc, ZERO_COPY(responseBody));
+    MatrixJsonDocument doc(jsonPool, DISCOVERY_CAPACITY, maxMessageLength);
+    DeserializationError error = performJsonRequest(url, "GET", "", doc, false);
     if (!error) {
         if (doc.containsKey("m.homeserver") && doc["m.homeserver"].containsKey("base_url")) {
             homeserverUrl = doc["m.homeserver"]["base_url"].as<String>();
-            logger(DEBUG, "Discovered server URL: " + homeserverUrl);
+            MATRIX_LOGF(DEBUG, "Discovered server URL: %s", homeserverUrl.c_str());
             return true;
         } else {
-            logger(ERROR, "No m.homeserver or base_url found in response");
+            MATRIX_LOG(ERROR, "No m.homeserver or base_url found in response");
         }
     } else {
-        logger(ERROR, "deserializeJson() failed: ");
-        logger(ERROR, error.c_str());
-        logger(ERROR, "responseBody: " + responseBody);
+        MATRIX_LOGF(ERROR, "deserializeJson() failed: %s, responseBody: %s", error.c_str(), doc.body());
     }
 
     return false;
 }
 
 bool MatrixClient::login(const String& matrixUser, const String& matrixPassword, const String& defaultServerHost) {
+    if (restoreSession(matrixUser)) {
+        if (!claimLinkHost()) {
+            std::lock_guard<std::recursive_mutex> lock(requestMutex);
+            accessToken = "";
+            return false;
+        }
+        MATRIX_LOGF(INFO, "Resumed the stored session of %s", userId.c_str());
+        return true;
+    }
+
     if (!discoverServer(matrixUser)) {
         homeserverUrl = "https://" + defaultServerHost;
-        logger(INFO, "Using default server URL: " + homeserverUrl);
+        MATRIX_LOGF(INFO, "Using default server URL: %s", homeserverUrl.c_str());
+    }
+    if (!claimLinkHost()) {
+        return false;
     }
 
-    // Generate unique device ID using the ESP32's MAC address
-    uint64_t mac = ESP.getEfuseMac();
-    char device_id[13];
-    snprintf(device_id, sizeof(device_id), "%04X%08X", (uint16_t)(mac >> 32), (uint32_t)mac);
-
-    DynamicJsonDocument id(maxMessageLength);
-    id["type"] = "m.id.user";
-    id["user"] = matrixUser;
-
-    DynamicJsonDocument req(maxMessageLength);
+    // Strings are stored as pointers, they outlive the document
+    String deviceId = macDeviceId();
+    StaticJsonDocument<JSON_OBJECT_SIZE(5) + JSON_OBJECT_SIZE(2)> req;
     req["type"] = "m.login.password";
-    req["identifier"] = id;
-    req["password"] = matrixPassword;
-    req["device_id"] = device_id;
+    JsonObject id = req.createNestedObject("identifier");
+    id["type"] = "m.id.user";
+    id["user"] = matrixUser.c_str();
+    req["password"] = matrixPassword.c_str();
+    req["device_id"] = deviceId.c_str();
     req["refresh_token"] = true;
 
     String payload;
     serializeJson(req, payload);
 
-    String responseBody = performHTTPRequest(homeserverUrl + "/_matrix/client/v3/login", "POST", payload, false);
-
-    DynamicJsonDocument doc(maxMessageLength);
-    DeserializationError error = deserializeJson(doc, ZERO_COPY(responseBody));
+    MatrixJsonDocument doc(jsonPool, LOGIN_CAPACITY, maxMessageLength);
+    DeserializationError error = performJsonRequest(homeserverUrl + "/_matrix/client/v3/login", "POST", payload, doc, false);
     if (!error) {
         if (doc.containsKey("access_token")) {
+            std::lock_guard<std::recursive_mutex> lock(requestMutex);
             accessToken = doc["access_token"].as<String>();
+            userId = doc["user_id"] | matrixUser.c_str();
+            loginUser = matrixUser;
+            syncFilterId = "";
+            inlineSyncFilter = false;
             if (doc.containsKey("refresh_token")) {
                 refreshToken = doc["refresh_token"].as<String>();
-                logger(DEBUG, "Got the refresh token: " + refreshToken);
+                MATRIX_LOGF(DEBUG, "Got the refresh token: %s", refreshToken.c_str());
             }
-            if (doc.containsKey("expires_in_ms")) {
+            tokenExpires = doc.containsKey("expires_in_ms");
+            if (tokenExpires) {
                 tokenExpiryTime = millis() + doc["expires_in_ms"].as<unsigned long>();
-                logger(DEBUG, "Access token expires in: " + String(doc["expires_in_ms"].as<unsigned long>()) + " ms");
+                MATRIX_LOGF(DEBUG, "Access token expires in: %lu ms", doc["expires_in_ms"].as<unsigned long>());
             }
-            logger(DEBUG, "Got the access token: " + accessToken);
+            MATRIX_LOGF(DEBUG, "Got the access token: %s", accessToken.c_str());
+            saveSession();
             return true;
         } else {
-            logger(ERROR, "No access token found in response");
+            MATRIX_LOG(ERROR, "No access token found in response");
         }
     } else {
-        logger(ERROR, "deserializeJson() failed: ");
-        logger(ERROR, error.c_str());
-        logger(ERROR, "responseBody: " + responseBody);
+        MATRIX_LOGF(ERROR, "deserializeJson() failed: %s, responseBody: %s", error.c_str(), doc.body());
     }
 
     return false;
 }
 
+// The accounts of a MatrixClientPool that share connections have to be on
+// the same homeserver, the first one to log in decides which; any other
+// would make each turn of the link reconnect, and the clients may only be
+// set up for one host.
+bool MatrixClient::claimLinkHost() {
+    if (!linkHost) {
+        return true;
+    }
+    const char* start = strstr(homeserverUrl.c_str(), "://");
+    start = start ? start + 3 : homeserverUrl.c_str();
+    const char* end = strchr(start, '/');
+    String host;
+    host.concat(start, end ? end - start : strlen(start));
+
+    std::lock_guard<std::recursive_mutex> lock(requestMutex);
+    if (linkHost->isEmpty()) {
+        *linkHost = host;
+    }
+    if (*linkHost != host) {
+        MATRIX_LOGF(ERROR, "Homeserver %s differs from %s of the accounts sharing these connections, add the account with clients of its own", host.c_str(), linkHost->c_str());
+        return false;
+    }
+    return true;
+}
+
 bool MatrixClient::sync() {
+    if (!syncPending && !beginSync()) {
+        return false;
+    }
+
+    SyncStatus status;
+    while ((status = poll()) == SYNC_PENDING) {
+        delay(1);
+    }
+    return status == SYNC_COMPLETED;
+}
+
+// Sends the sync request and returns without waiting for the answer, which
+// is picked up by poll(). With a single client, any other request cancels the
+// outstanding sync, so it has to be started again afterwards.
+bool MatrixClient::beginSync() {
+    std::lock_guard<std::recursive_mutex> lock(requestMutex);
+    if (syncPending) {
+        return true;
+    }
+
     if (!ensureAccessToken()) {
-        logger(ERROR, "Cannot sync: failed to ensure access token");
+        MATRIX_LOG(ERROR, "Cannot sync: failed to ensure access token");
         return false;
     }
 
-    String url = homeserverUrl + "/_matrix/client/v3/sync";
-    if (!syncToken.isEmpty()) {
-        url += "?since=" + syncToken;
-        if (syncTimeout > 0) {
-            url += "&timeout=" + String(syncTimeout);
+    syncConfig.sliding = slidingSync.enabled;
+    syncConfig.timelineLimit = slidingSync.enabled ? slidingSync.timelineLimit : syncFilter.timelineLimit;
+    syncConfig.backfillGaps = backfillGaps;
+    syncConfig.userId = userId;
+    {
+        std::lock_guard<std::mutex> lock(eventMutex);
+        syncConfig.masterUserId = masterUserId;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(markerMutex);
+        bool due = !readMarkers.empty() && millis() - readMarkersSince >= readMarkerDelay;
+        lock.unlock();
+        if (due) {
+            flushReadMarkers();
         }
     }
 
-    String responseBody = performHTTPRequest(url, "GET", "");
+    if (syncConfig.backfillGaps) {
+        backfillTimeline(backfillPagesPerSync);
+    }
 
-    if (!extractNextBatch(responseBody)) {
-        logger(DEBUG, "Next batch not found - sync");
+    if (!syncConfig.sliding && syncFilter.enabled && syncFilterId.isEmpty() && !inlineSyncFilter && !uploadSyncFilter()) {
+        MATRIX_LOG(INFO, "Sync filter could not be uploaded, sending it with every request instead");
+        inlineSyncFilter = true;
     }
 
-    DynamicJsonDocument doc(maxMessageLength * 2);  // Increased size to handle larger sync responses
-    DeserializationError error = deserializeJson(doc, ZERO_COPY(responseBody));
-    if (!error) {
-        if (!syncToken.isEmpty()) { // don't process the initial sync
-            // Process events
-            JsonObject rooms = doc["rooms"].as<JsonObject>();
-            JsonObject join = rooms["join"].as<JsonObject>();
-            JsonObject invite = rooms["invite"].as<JsonObject>();
-
-            for (JsonPair kv : join) {
-                String roomId = kv.key().c_str();
-                JsonObject room = kv.value().as<JsonObject>();
-                JsonArray events = room["timeline"]["events"].as<JsonArray>();
-                for (JsonObject event : events) {
-                    if (event["type"] == "m.room.message") {
-                        MatrixEvent matrixEvent;
-                        matrixEvent.eventId = event["event_id"].as<String>();
-                        matrixEvent.eventType = "message";
-                        matrixEvent.sender = event["sender"].as<String>();
-                        matrixEvent.roomId = roomId;
-                        matrixEvent.roomName = room["name"] | "";
-                        matrixEvent.roomTopic = room["topic"] | "";
-                        matrixEvent.roomEncryption = room.containsKey("encrypted");
-                        matrixEvent.messageType = event["content"]["msgtype"].as<String>();
-                        matrixEvent.messageContent = event["content"]["body"].as<String>();
-
-                        storeEvent(matrixEvent);
-                    }
-                }
-            }
+    if (eventOverflowPolicy == EVENTS_BACKPRESSURE) {
+        std::lock_guard<std::mutex> lock(eventMutex);
+        size_t needed = std::min((size_t)syncConfig.timelineLimit, eventBuffer.capacity());
+        if (eventBuffer.available() < needed) {
+            MATRIX_LOG(DEBUG, "Event buffer full, sync deferred until events are consumed");
+            return false;
+        }
+    }
 
-            for (JsonPair kv : invite) {
-                String roomId = kv.key().c_str();
-                JsonObject room = kv.value().as<JsonObject>();
-                JsonArray events = room["invite_state"]["events"].as<JsonArray>();
-                MatrixEvent matrixEvent;
-                matrixEvent.eventType = "invitation";
-                matrixEvent.roomId = roomId;
-                for (JsonObject event : events) {
-                    if (event["type"] == "m.room.name") {
-                        matrixEvent.roomName = event["content"]["name"].as<String>();
-                    }
-                    if (event["type"] == "m.room.topic") {
-                        matrixEvent.roomTopic = event["content"]["topic"].as<String>();
-                    }
-                    if (event["type"] == "m.room.encryption") {
-                        matrixEvent.roomEncryption = true;
-                    }
-                    if (event.containsKey("event_id")) {
-                        matrixEvent.eventId = event["event_id"].as<String>();
-                        matrixEvent.sender = event["sender"].as<String>();
-                    }
-                }
-                storeEvent(matrixEvent);
+    {
+        std::lock_guard<std::mutex> lock(eventMutex);
+        syncRequestTimeout = syncSchedule.enabled ? syncPlan.timeout : (unsigned long)(syncTimeout > 0 ? syncTimeout : 0);
+        syncRequestTimeout = std::min(syncRequestTimeout, syncTimeoutCap);
+    }
+
+    if (syncConfig.sliding) {
+        syncInitial = slidingPos.isEmpty();
+        syncUrl = homeserverUrl + "/_matrix/client/unstable/org.matrix.simplified_msc3575/sync";
+        if (!syncInitial) {
+            syncUrl += "?pos=" + urlEncode(slidingPos);
+            if (syncRequestTimeout > 0) {
+                syncUrl += "&timeout=" + String(syncRequestTimeout);
             }
         }
-
+        StaticJsonDocument<1024> request;
+        buildSlidingSyncRequest(request);
+        syncPayload = "";
+        serializeJson(request, syncPayload);
     } else {
-        logger(ERROR, "sync deserializeJson() failed: ");
-        logger(ERROR, error.c_str());
-        logger(ERROR, "sync responseBody: " + responseBody);
+        syncInitial = syncToken.isEmpty();
+        syncPayload = "";
+        syncUrl = homeserverUrl + "/_matrix/client/v3/sync?";
+        if (!syncFilterId.isEmpty() && !reducedTimelineLimit) {
+            syncUrl += "filter=" + urlEncode(syncFilterId) + "&";
+        } else if (syncFilter.enabled || reducedTimelineLimit) {
+            StaticJsonDocument<1024> definition;
+            buildFilterDefinition(definition);
+            if (reducedTimelineLimit) {
+                definition["room"]["timeline"]["limit"] = effectiveTimelineLimit(syncFilter.timelineLimit);
+            }
+            String inlineFilter;
+            serializeJson(definition, inlineFilter);
+            syncUrl += "filter=" + urlEncode(inlineFilter) + "&";
+        }
+        if (!syncInitial) {
+            syncUrl += "since=" + syncToken;
+            if (syncRequestTimeout > 0) {
+                syncUrl += "&timeout=" + String(syncRequestTimeout);
+            }
+        }
     }
 
+    syncMetrics = MatrixRequestMetrics();
+    syncMetrics.endpoint = ENDPOINT_SYNC;
+    startHeapMetrics(syncMetrics);
+    syncStartedAt = millis();
+    if (!writeHTTPRequest(*syncConnection, syncUrl, syncPayload.isEmpty() ? "GET" : "POST", syncPayload, true, acceptEncodingHeader())) {
+        MATRIX_LOG(ERROR, "Sync request failed");
+        recordSyncFailure();
+        return false;
+    }
+    syncPending = true;
+    syncRetried = false;
     return true;
 }
 
-bool MatrixClient::refreshAccessToken() {
-    DynamicJsonDocument req(maxMessageLength);
-    req["refresh_token"] = refreshToken;
+// Never waits for the server. Once the response starts arriving it is read
+// and parsed in one go, which only takes as long as the transfer itself.
+SyncStatus MatrixClient::poll() {
+    if (!syncPending) {
+        return SYNC_IDLE;
+    }
 
-    String payload;
-    serializeJson(req, payload);
+    std::unique_lock<std::recursive_mutex> lock(requestMutex, std::defer_lock);
+    if (syncConnection == &connection) {
+        lock.lock();
+    }
 
-    String responseBody = performHTTPRequest(homeserverUrl + "/_matrix/client/v3/refresh", "POST", payload);
-    DynamicJsonDocument doc(maxMessageLength);
-    DeserializationError error = deserializeJson(doc, ZERO_COPY(responseBody));
-    if (!error) {
-        if (doc.containsKey("access_token")) {
-            accessToken = doc["access_token"].as<String>();
-            logger(DEBUG, "Got the access token: " + accessToken);
-            if (doc.containsKey("refresh_token")) {
-                refreshToken = doc["refresh_token"].as<String>();
-                logger(DEBUG, "Got the refresh token: " + refreshToken);
-                if (doc.containsKey("expires_in_ms")) {
-                    tokenExpiryTime = millis() + doc["expires_in_ms"].as<unsigned long>();
-                    logger(DEBUG, "Access token refreshed. New expiry in: " + String(doc["expires_in_ms"].as<unsigned long>()) + " ms");
-                }
-                return true;
+    if (syncConnection->available() == 0) {
+        if (!syncConnection->client().connected()) {
+            return retrySync("Sync connection closed by the server");
+        }
+        if (millis() - syncStartedAt > syncRequestTimeout + waitForResponse) {
+            MATRIX_LOG(ERROR, "Sync timed out");
+            recordSyncFailure();
+            cancelSync();
+            return SYNC_FAILED;
+        }
+        return SYNC_PENDING;
+    }
 
-            }
-        } else {
-            logger(ERROR, "No access token found in response");
-            logger(ERROR, responseBody);
-            logger(ERROR, "You should log in again!");
+    HTTPResponse response;
+    if (!syncConnection->readResponseHeaders(response, waitForResponse)) {
+        if (response.statusCode == 0) {
+            return retrySync("No response to the sync request");
         }
-    } else {
-        logger(ERROR, "refresh deserializeJson() failed: ");
-        logger(ERROR, error.c_str());
-        return false;
+        MATRIX_LOG(ERROR, "Sync response headers incomplete");
+        recordSyncFailure();
+        cancelSync();
+        return SYNC_FAILED;
     }
-    return false;
-}
 
-bool MatrixClient::ensureAccessToken() {
-    if (millis() >= tokenExpiryTime - 10000) {
-        logger(INFO, "Access token expired, refreshing...");
-        return refreshAccessToken();
+    syncPending = false;
+    unsigned long receivedBefore = receivedEvents;
+    bool finished = finishSync(response);
+    scheduleNextSync(finished, receivedEvents != receivedBefore);
+    if (!finished) {
+        return SYNC_FAILED;
     }
-    return true;
+    // The sync token changes with every sync; it is only written out now and
+    // then to spare the flash
+    if (sessionStore && millis() - sessionSavedAt >= sessionSaveInterval) {
+        saveSession();
+    }
+    return SYNC_COMPLETED;
 }
 
-void MatrixClient::setMasterUserId(const String& userId) {
-    masterUserId = userId;
+bool MatrixClient::isSyncPending() const {
+    return syncPending;
 }
 
-bool MatrixClient::sendDMToMaster(const String& message, const String& msgType) {
-    if (masterUserId.isEmpty()) {
-        logger(ERROR, "Master user has not been set yet");
-        return false;
-    }
-
-    if (!createRoom(masterUserId, masterRoomId)) {
-        logger(ERROR, "Failed to create master room");
-        return false;
-    } else {
-        return sendMessageToRoom(masterRoomId, message, msgType);
-    }
+bool MatrixClient::isLoggedIn() const {
+    std::lock_guard<std::recursive_mutex> lock(requestMutex);
+    return !accessToken.isEmpty();
 }
 
-bool MatrixClient::createRoom(const String& userId, String& roomId) {
-    if (!ensureAccessToken()) {
-        logger(ERROR, "Cannot create room: failed to ensure access token");
-        return false;
+// A kept-alive connection may have been dropped by the server just as the
+// request went out; that case gets one more attempt on a fresh connection.
+SyncStatus MatrixClient::retrySync(const String& reason) {
+    bool reused = syncConnection->isReused();
+    cancelSync();
+    if (!reused || syncRetried) {
+        MATRIX_LOG(ERROR, reason);
+        recordSyncFailure();
+        return SYNC_FAILED;
     }
 
-    StaticJsonDocument<256> req;
-    req["invite"] = JsonArray();
-    req["invite"].add(userId);
-    req["is_direct"] = true;
-    req["preset"] = "trusted_private_chat";
-
-    String payload;
-    serializeJson(req, payload);
+    MATRIX_LOGF(DEBUG, "%s, reconnecting", reason.c_str());
+    std::lock_guard<std::recursive_mutex> lock(requestMutex); // for the access token
+    if (!writeHTTPRequest(*syncConnection, syncUrl, syncPayload.isEmpty() ? "GET" : "POST", syncPayload, true, acceptEncodingHeader())) {
+        MATRIX_LOG(ERROR, "Sync request failed");
+        recordSyncFailure();
+        return SYNC_FAILED;
+    }
+    syncPending = true;
+    syncRetried = true;
+    syncStartedAt = millis();
+    return SYNC_PENDING;
+}
 
-    String responseBody = performHTTPRequest(homeserverUrl + "/_matrix/client/v3/createRoom", "POST", payload);
+void MatrixClient::recordSyncFailure() {
+    readTransportMetrics(syncMetrics, *syncConnection, HTTPResponse());
+    recordMetrics(syncMetrics);
+    scheduleNextSync(false, false);
+}
 
-    DynamicJsonDocument doc(maxMessageLength);
-    DeserializationError error = deserializeJson(doc, ZERO_COPY(responseBody));
+// Events bring the short long-poll back and end the pause. Every quiet sync
+// doubles both, up to the timeout ceiling and the latency target. A sync that
+// fails after being held for at least half its timeout was most likely cut off
+// by a NAT or the mobile network, which drop connections that stay silent for
+// too long, so the ceiling drops to half that timeout; after 4 quiet syncs
+// at the ceiling it is raised again by half.
+void MatrixClient::scheduleNextSync(bool succeeded, bool eventsReceived) {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    if (!syncSchedule.enabled) {
+        return;
+    }
 
-    if (!error) {
-        if (doc.containsKey("room_id")) {
-            roomId = doc["room_id"].as<String>();
-            logger(DEBUG, "Room created: " + roomId);
-            return true;
-        } else {
-            logger(ERROR, "No room_id found in response");
+    MatrixSyncPlan previous = syncPlan;
+    unsigned long activeTimeout = syncSchedule.activeTimeout;
+    if (!succeeded) {
+        if (millis() - syncStartedAt >= syncRequestTimeout / 2 && syncRequestTimeout > activeTimeout) {
+            syncPlan.timeoutCeiling = std::max(activeTimeout, syncRequestTimeout / 2);
+            syncPlan.timeout = std::min(syncPlan.timeout, syncPlan.timeoutCeiling);
+            ceilingHolds = 0;
         }
+    } else if (eventsReceived) {
+        syncPlan.timeout = activeTimeout;
+        syncPlan.pause = 0;
+        syncPlan.quietSyncs = 0;
     } else {
-        logger(ERROR, "createRoom deserializeJson() failed: ");
-        logger(ERROR, error.c_str());
-        logger(ERROR, responseBody);
+        syncPlan.quietSyncs++;
+        if (syncPlan.timeout >= syncPlan.timeoutCeiling && syncPlan.timeoutCeiling < syncSchedule.idleTimeout && ++ceilingHolds >= 4) {
+            syncPlan.timeoutCeiling = std::min(syncSchedule.idleTimeout, syncPlan.timeoutCeiling + syncPlan.timeoutCeiling / 2);
+            ceilingHolds = 0;
+        }
+        syncPlan.timeout = std::min(syncPlan.timeoutCeiling, std::max(activeTimeout, syncPlan.timeout * 2));
+        syncPlan.pause = std::min(syncSchedule.latencyTarget, syncPlan.pause ? syncPlan.pause * 2 : syncSchedule.latencyTarget / 8);
     }
+    syncPlan.requestsPerHour = 3600000UL / std::max(1UL, syncPlan.timeout + syncPlan.pause);
 
-    return false;
+    if (syncPlan.timeout != previous.timeout || syncPlan.pause != previous.pause || syncPlan.timeoutCeiling != previous.timeoutCeiling) {
+        MATRIX_LOGF(DEBUG, "Sync schedule: %lu ms long-poll (ceiling %lu ms), %lu requests an hour while idle, new events may wait %lu ms",
+                    syncPlan.timeout, syncPlan.timeoutCeiling, syncPlan.requestsPerHour, syncPlan.pause);
+    }
 }
 
-bool MatrixClient::sendMessageToRoom(const String& roomId, const String& message, const String& msgType) {
-    if (!ensureAccessToken()) {
-        logger(ERROR, "Cannot send message: failed to ensure access token");
-        return false;
-    }
+void MatrixClient::setSyncSchedule(const MatrixSyncSchedule& schedule) {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    syncSchedule = schedule;
+    syncPlan = MatrixSyncPlan();
+    syncPlan.timeout = schedule.activeTimeout;
+    syncPlan.timeoutCeiling = std::max(schedule.activeTimeout, schedule.idleTimeout);
+    syncPlan.requestsPerHour = 3600000UL / std::max(1UL, syncPlan.timeout);
+    ceilingHolds = 0;
+}
 
-    StaticJsonDocument<256> req;
-    req["msgtype"] = msgType;
-    req["body"] = message;
+const MatrixSyncSchedule& MatrixClient::getSyncSchedule() const {
+    return syncSchedule;
+}
 
-    String payload;
-    serializeJson(req, payload);
+MatrixSyncPlan MatrixClient::getSyncPlan() {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    return syncPlan;
+}
 
-    String url = homeserverUrl + "/_matrix/client/v3/rooms/" + roomId + "/send/m.room.message/" + String(millis());
-    String responseBody = performHTTPRequest(url, "PUT", payload);
+unsigned long MatrixClient::getSyncDelay() {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    return syncSchedule.enabled ? syncPlan.pause : 0;
+}
 
-    DynamicJsonDocument doc(maxMessageLength);
-    DeserializationError error = deserializeJson(doc, ZERO_COPY(responseBody));
+void MatrixClient::cancelSync() {
+    syncPending = false;
+    syncConnection->close();
+}
 
-    if (!error) {
-        if (doc.containsKey("event_id")) {
-            logger(INFO, "Message sent to room: " + roomId);
-            return true;
-        } else {
-            logger(ERROR, "No event_id found in response");
-            logger(ERROR, responseBody);
-        }
+bool MatrixClient::finishSync(const HTTPResponse& response) {
+    // The body is parsed straight from the connection; the filter makes sure
+    // only the fields turned into MatrixEvents are ever stored in memory.
+    HTTPBodyStream body(*syncConnection, response);
+    body.setTimeout(waitForResponse);
+    HTTPInflateStream decoded(body, *syncConnection, response);
+    decoded.setTimeout(waitForResponse);
+
+    StaticJsonDocument<1024> filter;
+    if (syncConfig.sliding) {
+        buildSlidingSyncFilter(filter, syncInitial);
     } else {
-        logger(ERROR, "sendMessageToRoom deserializeJson() failed: ");
-        logger(ERROR, error.c_str());
-        logger(ERROR, responseBody);
+        buildSyncFilter(filter, syncInitial);
     }
 
-    return false;
-}
+    JsonDocument& doc = reuseSyncDocument();
+    unsigned long parseStart = micros();
+    DeserializationError error = deserializeJson(doc, decoded, DeserializationOption::Filter(filter));
+    bool complete = decoded.drain();
+    syncMetrics.bodyTime = micros() - parseStart;
+    syncMetrics.parseTime = syncMetrics.bodyTime;
+    syncMetrics.documentUsage = doc.memoryUsage();
+    readTransportMetrics(syncMetrics, *syncConnection, response);
+    if (error || !complete) {
+        syncMetrics.statusCode = 0;
+    }
+    syncConnection->release(!error && complete, response.keepAlive);
+    recordMetrics(syncMetrics);
 
-bool MatrixClient::joinRoom(const String& roomId) {
-    if (!ensureAccessToken()) {
-        logger(ERROR, "Cannot join room: failed to ensure access token");
+    if (response.statusCode == 401) {
+        MATRIX_LOG(ERROR, "Access token rejected by the server, log in again");
+        invalidateSession();
         return false;
     }
-    String url = homeserverUrl + "/_matrix/client/v3/join/" + roomId;
-    String responseBody = performHTTPRequest(url, "POST", "");
-    return true;
-}
 
-bool MatrixClient::sendReadReceipt(const String& roomId, const String& eventId) {
-    if (!ensureAccessToken()) {
-        logger(ERROR, "Cannot send read receipt: failed to ensure access token");
+    if (error == DeserializationError::NoMemory) {
+        handleSyncOverflow(doc.capacity());
         return false;
     }
-    String url = homeserverUrl + "/_matrix/client/v3/rooms/" + roomId + "/receipt/m.read/" + eventId;
-    String responseBody = performHTTPRequest(url, "POST", "");
-    return true;
-}
-
-bool MatrixClient::sendMediaToRoom(const String& roomId, const String& fileName, const String& contentType, const uint8_t* fileData, size_t fileSize) {
-    String mediaUrl = uploadMedia(fileName, contentType, fileData, fileSize);
-    if (mediaUrl.isEmpty()) {
-        logger(ERROR, "Media upload failed");
+    if (error) {
+        if (decoded.isCompressed() && decoded.hasFailed() && !body.hasFailed()) {
+            MATRIX_LOG(ERROR, "Compressed sync response could not be decoded");
+        }
+        MATRIX_LOGF(ERROR, "sync deserializeJson() failed: %s, response status: %d", error.c_str(), response.statusCode);
         return false;
     }
 
-    logger(DEBUG, "Media uploaded. URL: " + mediaUrl);
-
-    StaticJsonDocument<256> req;
-    req["msgtype"] = "m.image";
-    req["body"] = fileName;
-    req["url"] = mediaUrl;
+    MATRIX_LOGF(DEBUG, "Sync response of %lu bytes (%lu on the wire) filtered down to %u bytes", decoded.bytesRead(), body.bytesRead(), (unsigned)doc.memoryUsage());
 
-    String payload;
-    serializeJson(req, payload);
+    if (syncConfig.sliding && doc["errcode"] == "M_UNKNOWN_POS") {
+        // The server dropped the sliding sync connection, start over
+        MATRIX_LOG(INFO, "Sliding sync position expired, starting a new connection");
+        std::lock_guard<std::mutex> lock(eventMutex);
+        slidingPos = "";
+        return false;
+    }
 
-    String url = homeserverUrl + "/_matrix/client/v3/rooms/" + roomId + "/send/m.room.message/" + String(millis());
-    String responseBody = performHTTPRequest(url, "PUT", payload);
+    const char* nextToken = doc[syncConfig.sliding ? "pos" : "next_batch"];
+    if (!nextToken) {
+        MATRIX_LOGF(ERROR, "No sync token in the response, status: %d", response.statusCode);
+        return false;
+    }
 
-    DynamicJsonDocument doc(maxMessageLength);
-    DeserializationError error = deserializeJson(doc, ZERO_COPY(responseBody));
+    if (reducedTimelineLimit) {
+        MATRIX_LOG(INFO, "Sync response fits again, back to the configured timeline limit");
+        reducedTimelineLimit = 0;
+    }
 
-    if (!error) {
-        if (doc.containsKey("event_id")) {
-            logger(DEBUG, "Media sent to room: " + roomId + ", " + mediaUrl);
-            return true;
-        } else {
-            logger(ERROR, "No event_id found in response");
-            logger(ERROR, responseBody);
+    std::lock_guard<std::mutex> lock(eventMutex);
+    unsigned long droppedBefore = droppedEvents;
+    bool processed;
+    if (syncConfig.sliding) {
+        processed = processSlidingSync(doc);
+        if (processed) {
+            slidingPos = nextToken;
         }
     } else {
-        logger(ERROR, "sendMediaToRoom deserializeJson() failed: ");
-        logger(ERROR, error.c_str());
-        logger(ERROR, responseBody);
+        processed = processSync(doc); // Timeline gaps start at the previous token
+        if (processed) {
+            syncToken = nextToken;
+        }
     }
 
-    return false;
-}
-
-String MatrixClient::uploadMedia(const String& fileName, const String& contentType, const uint8_t* fileData, size_t fileSize) {
-    if (!ensureAccessToken()) {
-        logger(ERROR, "Cannot upload media: failed to ensure access token");
-        return "";
+    if (!processed) {
+        MATRIX_LOG(DEBUG, "Event buffer full, the rest of the sync is fetched again once events are consumed");
     }
-
-    String url = homeserverUrl + "/_matrix/media/v3/upload?filename=" + fileName;
-
-    String host;
-    String path;
-    const int httpsPort = 443;
-
-    // Parse URL
-    int index = url.indexOf("://");
-    if (index == -1) {
-        logger(ERROR, "Invalid URL");
-        return "";
+    if (droppedEvents != droppedBefore) {
+        MATRIX_LOGF(ERROR, "Event buffer full, %lu events dropped", droppedEvents - droppedBefore);
     }
 
-    String remainder = url.substring(index + 3);
+    return true;
+}
 
-    index = remainder.indexOf('/');
-    if (index == -1) {
-        logger(ERROR, "Invalid URL");
-        return "";
+// Kept from one sync to the next. Also used by backfillTimeline(), which only
+// runs while no sync is outstanding.
+JsonDocument& MatrixClient::reuseSyncDocument() {
+    size_t capacity = std::max((size_t)syncDocumentSize, syncCapacity);
+    if (!syncDocument || syncDocument->capacity() < capacity) {
+        syncDocument.reset(); // the old one goes first, both may not fit at once
+        syncDocument.reset(new DynamicJsonDocument(capacity));
     }
-    host = remainder.substring(0, index);
-    path = remainder.substring(index);
+    return *syncDocument;
+}
 
-    if (!client->connect(host.c_str(), httpsPort)) {
-        logger(ERROR, "Connection to " + host + " failed");
-        return "";
+// A response that does not fit leaves the sync token where it was, so the
+// next sync would fail the same way. It gets a document twice as large, up
+// to maxSyncDocumentSize, and after that half as many events per room; rooms
+// cut short come back limited and can be filled in with backfillGaps.
+void MatrixClient::handleSyncOverflow(size_t capacity) {
+    syncOverflows++;
+    int timelineLimit = effectiveTimelineLimit(syncConfig.timelineLimit);
+    if (capacity < (size_t)maxSyncDocumentSize) {
+        syncCapacity = std::min(capacity * 2, (size_t)maxSyncDocumentSize);
+        MATRIX_LOGF(INFO, "Sync response did not fit into %u bytes, trying again with %u", (unsigned)capacity, (unsigned)syncCapacity);
+    } else if (timelineLimit > 1) {
+        reducedTimelineLimit = timelineLimit / 2;
+        MATRIX_LOGF(INFO, "Sync response did not fit into %u bytes, trying again with %d events per room", (unsigned)capacity, reducedTimelineLimit);
+    } else {
+        MATRIX_LOGF(ERROR, "Sync response does not fit into %u bytes even with one event per room, raise maxSyncDocumentSize", (unsigned)capacity);
     }
+}
 
-    client->println("POST " + path + " HTTP/1.1");
-    client->println("Host: " + host);
-    client->println("Authorization: Bearer " + accessToken);
-    client->println("Content-Type: " + contentType);
-    client->println("Content-Length: " + String(fileSize));
-    client->println();
+int MatrixClient::effectiveTimelineLimit(int configured) const {
+    return reducedTimelineLimit && reducedTimelineLimit < configured ? reducedTimelineLimit : configured;
+}
 
-    size_t bufferSize = 1024;
-    for (size_t n = 0; n < fileSize; n += bufferSize) {
-      size_t remaining = fileSize - n;
-      size_t chunkSize = remaining < bufferSize ? remaining : bufferSize;
-      client->write(fileData + n, chunkSize);
+// Must be called with eventMutex held. Room state is taken from every sync,
+// the initial one included; only the events of the initial sync are skipped.
+// Returns false when the event buffer filled up under EVENTS_BACKPRESSURE;
+// the sync token then stays where it was and the events already stored are
+// recognised as duplicates when the response comes again.
+bool MatrixClient::processSync(JsonDocument& doc) {
+    JsonObject roomUpdates = doc["rooms"].as<JsonObject>();
+    for (JsonPair kv : roomUpdates["join"].as<JsonObject>()) {
+        MatrixRoomHandle handle = internRoom(kv.key().c_str());
+        if (handle == INVALID_ROOM) {
+            continue;
+        }
+        JsonObject room = kv.value().as<JsonObject>();
+        rooms[handle].membership = MEMBERSHIP_JOINED;
+        rooms[handle].memberCount = room["summary"]["m.joined_member_count"] | rooms[handle].memberCount;
+        for (JsonObject event : room["state"]["events"].as<JsonArray>()) {
+            applyStateEvent(rooms[handle], event);
+        }
+        JsonObject timeline = room["timeline"].as<JsonObject>();
+        const char* prevBatch = timeline["prev_batch"];
+        if (syncConfig.backfillGaps && !syncInitial && (timeline["limited"] | false) && prevBatch) {
+            addTimelineGap(handle, prevBatch);
+        }
+        if (!processTimeline(handle, timeline["events"].as<JsonArray>(), 0)) {
+            return false;
+        }
     }
 
-    String responseBody, headers;
-    readHTTPResponse(responseBody, headers);
-    client->stop();
-
-    logger(DEBUG, "Media upload response: " + responseBody);
+    for (JsonPair kv : roomUpdates["invite"].as<JsonObject>()) {
+        MatrixRoomHandle handle = internRoom(kv.key().c_str());
+        if (handle != INVALID_ROOM && !processInvite(handle, kv.value()["invite_state"]["events"].as<JsonArray>())) {
+            return false;
+        }
+    }
 
-    // Parse the response to get the media URL
-    DynamicJsonDocument doc(maxMessageLength);
-    DeserializationError error = deserializeJson(doc, ZERO_COPY(responseBody));
-    if (!error) {
-        if (doc.containsKey("content_uri")) {
-            return doc["content_uri"].as<String>();
-        } else {
-            logger(ERROR, "No content_uri found in response");
+    for (JsonPair kv : roomUpdates["leave"].as<JsonObject>()) {
+        MatrixRoomHandle handle = internRoom(kv.key().c_str());
+        if (handle != INVALID_ROOM) {
+            rooms[handle].membership = MEMBERSHIP_LEFT;
         }
-    } else {
-        logger(ERROR, "uploadMedia deserializeJson() failed: ");
-        logger(ERROR, error.c_str());
-        logger(ERROR, responseBody);
     }
 
-    return "";
+    for (JsonObject event : doc["account_data"]["events"].as<JsonArray>()) {
+        if (event["type"] == "m.direct" && !syncConfig.masterUserId.isEmpty()) {
+            adoptDirectRoom(event["content"][syncConfig.masterUserId].as<JsonArray>());
+        }
+    }
+    return true;
 }
 
-String MatrixClient::performHTTPRequest(const String& url, const String& method, const String& payload, bool useAuth) {
-    String host;
-    String path;
-    const int httpsPort = 443;
+// Must be called with eventMutex held. Invited rooms come with their stripped
+// state, all others are joined unless their state says otherwise. A room
+// that enters the window brings older events along; only the last num_live
+// of its timeline are new. Returns false like processSync().
+bool MatrixClient::processSlidingSync(JsonDocument& doc) {
+    for (JsonPair kv : doc["rooms"].as<JsonObject>()) {
+        MatrixRoomHandle handle = internRoom(kv.key().c_str());
+        if (handle == INVALID_ROOM) {
+            continue;
+        }
+        JsonObject room = kv.value().as<JsonObject>();
+        if (room.containsKey("invite_state")) {
+            if (!processInvite(handle, room["invite_state"].as<JsonArray>())) {
+                return false;
+            }
+            continue;
+        }
 
-    // Parse URL
-    int index = url.indexOf("://");
-    if (index == -1) {
-        logger(ERROR, "Invalid URL");
-        return "";
+        rooms[handle].membership = MEMBERSHIP_JOINED;
+        rooms[handle].memberCount = room["joined_count"] | rooms[handle].memberCount;
+        for (JsonObject event : room["required_state"].as<JsonArray>()) {
+            applyStateEvent(rooms[handle], event);
+        }
+        JsonArray timeline = room["timeline"].as<JsonArray>();
+        size_t live = (room["initial"] | false) ? (room["num_live"] | 0) : timeline.size();
+        if (!processTimeline(handle, timeline, live < timeline.size() ? timeline.size() - live : 0)) {
+            return false;
+        }
     }
 
-    String remainder = url.substring(index + 3);
-
-    index = remainder.indexOf('/');
-    if (index == -1) {
-        logger(ERROR, "Invalid URL");
-        return "";
+    for (JsonObject event : doc["extensions"]["account_data"]["global"].as<JsonArray>()) {
+        if (event["type"] == "m.direct" && !syncConfig.masterUserId.isEmpty()) {
+            adoptDirectRoom(event["content"][syncConfig.masterUserId].as<JsonArray>());
+        }
     }
-    host = remainder.substring(0, index);
-    path = remainder.substring(index);
-
-    if (!client->connect(host.c_str(), httpsPort)) {
-        logger(ERROR, "Connection to " + host + " failed");
-        return "";
+    return true;
+}
+
+// Must be called with eventMutex held. Messages before firstLive only
+// update the room state. An ID is only remembered once its event is stored,
+// so a dropped event is still taken when it arrives again. Returns false
+// when the buffer is full under EVENTS_BACKPRESSURE.
+bool MatrixClient::processTimeline(MatrixRoomHandle handle, JsonArray events, size_t firstLive) {
+    size_t index = 0;
+    for (JsonObject event : events) {
+        bool live = index++ >= firstLive;
+        if (event.containsKey("state_key")) {
+            applyStateEvent(rooms[handle], event);
+        } else if (event["type"] == "m.room.message" && !syncInitial && live) {
+            const char* eventId = event["event_id"] | "";
+            if (recentEventIds.contains(eventId)) {
+                duplicateEvents++;
+                continue;
+            }
+            MatrixEvent* matrixEvent = storeEvent();
+            if (!matrixEvent) {
+                if (eventOverflowPolicy == EVENTS_BACKPRESSURE) {
+                    return false;
+                }
+                continue;
+            }
+            recentEventIds.insert(eventId);
+            matrixEvent->eventId = eventId;
+            matrixEvent->eventType = EVENT_MESSAGE;
+            matrixEvent->sender = event["sender"] | "";
+            matrixEvent->room = handle;
+            matrixEvent->messageType = matrixMessageType(event["content"]["msgtype"]);
+            matrixEvent->messageContent = event["content"]["body"] | "";
+        }
+    }
+    return true;
+}
+
+// Must be called with eventMutex held. Returns false like processTimeline().
+bool MatrixClient::processInvite(MatrixRoomHandle handle, JsonArray events) {
+    MatrixRoom& invitedRoom = rooms[handle];
+    invitedRoom.membership = MEMBERSHIP_INVITED;
+    for (JsonObject event : events) {
+        applyStateEvent(invitedRoom, event);
+    }
+    if (syncInitial) {
+        return true;
+    }
+    for (JsonObject event : events) {
+        if (recentEventIds.contains(event["event_id"] | "")) {
+            duplicateEvents++;
+            return true;
+        }
+    }
+
+    MatrixEvent* matrixEvent = storeEvent();
+    if (!matrixEvent) {
+        return eventOverflowPolicy != EVENTS_BACKPRESSURE;
+    }
+    matrixEvent->eventType = EVENT_INVITATION;
+    matrixEvent->room = handle;
+    for (JsonObject event : events) {
+        if (event.containsKey("event_id")) {
+            recentEventIds.insert(event["event_id"] | "");
+            matrixEvent->eventId = event["event_id"] | "";
+            matrixEvent->sender = event["sender"] | "";
+        } else if (matrixEvent->sender.isEmpty() && event["type"] == "m.room.member" && event["state_key"] == syncConfig.userId) {
+            // Stripped state carries no event ids, the inviter is on our member event
+            matrixEvent->sender = event["sender"] | "";
+        }
+    }
+    return true;
+}
+
+// Must be called with eventMutex held, before syncToken moves on: the gap
+// begins where the previous sync ended. A sync fetched again after the event
+// buffer filled up reports the same gap a second time.
+void MatrixClient::addTimelineGap(MatrixRoomHandle handle, const char* prevBatch) {
+    for (const TimelineGap& gap : timelineGaps) {
+        if (gap.room == handle && gap.to == prevBatch) {
+            return;
+        }
+    }
+    if (timelineGaps.size() >= MAX_TIMELINE_GAPS) {
+        MATRIX_LOGF(ERROR, "Too many timeline gaps, missed messages of %s are not fetched", rooms[timelineGaps.front().room].roomId.c_str());
+        timelineGaps.pop_front();
+    }
+    timelineGaps.push_back({handle, syncToken, prevBatch});
+    MATRIX_LOGF(DEBUG, "Timeline of %s is limited, messages before %s are missing", rooms[handle].roomId.c_str(), prevBatch);
+}
+
+// Fills the oldest gap forward from its start with at most `pages` requests
+// to /messages, so the missing messages arrive in order, though after the live
+// ones of the sync that found the gap. A gap that is not closed yet continues
+// before the next sync. Pages are parsed from the connection like a sync
+// response, into the sync document, which is free while no sync is
+// outstanding.
+void MatrixClient::backfillTimeline(int pages) {
+    StaticJsonDocument<256> filter;
+    filter["end"] = true;
+    JsonObject eventFilter = filter.createNestedArray("chunk").createNestedObject();
+    eventFilter["type"] = true;
+    eventFilter["event_id"] = true;
+    eventFilter["sender"] = true;
+    eventFilter["content"]["msgtype"] = true;
+    eventFilter["content"]["body"] = true;
+
+    for (int page = 0; page < pages; page++) {
+        MatrixRoomHandle handle;
+        String from;
+        String url;
+        {
+            std::lock_guard<std::mutex> lock(eventMutex);
+            size_t limit = backfillPageSize > 0 ? backfillPageSize : 1;
+            if (timelineGaps.empty() || (eventOverflowPolicy == EVENTS_BACKPRESSURE && eventBuffer.available() < std::min(limit, eventBuffer.capacity()))) {
+                return;
+            }
+            const TimelineGap& gap = timelineGaps.front();
+            handle = gap.room;
+            from = gap.from;
+            url = homeserverUrl + "/_matrix/client/v3/rooms/" + rooms[handle].roomId + "/messages?dir=f&from=" + urlEncode(gap.from) + "&to=" + urlEncode(gap.to) +
+                  "&limit=" + String((unsigned long)limit) + "&filter=" + BACKFILL_FILTER;
+        }
+
+        MatrixRequestMetrics metrics;
+        metrics.endpoint = ENDPOINT_OTHER;
+        startHeapMetrics(metrics);
+        std::lock_guard<std::recursive_mutex> lock(requestMutex);
+        claimConnection();
+        HTTPResponse response;
+        if (!sendHTTPRequest(connection, url, "GET", "", true, response, acceptEncodingHeader())) {
+            response.statusCode = 0;
+            readTransportMetrics(metrics, connection, response);
+            recordMetrics(metrics);
+            return;
+        }
+
+        HTTPBodyStream body(connection, response);
+        body.setTimeout(waitForResponse);
+        HTTPInflateStream decoded(body, connection, response);
+        decoded.setTimeout(waitForResponse);
+        JsonDocument& doc = reuseSyncDocument();
+        unsigned long parseStart = micros();
+        DeserializationError error = deserializeJson(doc, decoded, DeserializationOption::Filter(filter));
+        bool complete = decoded.drain();
+        metrics.bodyTime = micros() - parseStart;
+        metrics.parseTime = metrics.bodyTime;
+        metrics.documentUsage = doc.memoryUsage();
+        readTransportMetrics(metrics, connection, response);
+        if (error || !complete) {
+            metrics.statusCode = 0;
+        }
+        connection.release(!error && complete, response.keepAlive);
+        recordMetrics(metrics);
+
+        std::lock_guard<std::mutex> eventLock(eventMutex);
+        bool current = !timelineGaps.empty() && timelineGaps.front().from == from;
+        if (!response.isSuccess() || error) {
+            MATRIX_LOGF(ERROR, "Backfill of %s failed with status %d", rooms[handle].roomId.c_str(), response.statusCode);
+            if (current && response.statusCode >= 400 && response.statusCode < 500 && response.statusCode != 429) {
+                timelineGaps.pop_front(); // Asking again would not help
+            }
+            return;
+        }
+
+        JsonArray chunk = doc["chunk"].as<JsonArray>();
+        if (!processTimeline(handle, chunk, 0)) {
+            return; // The page is fetched again once events are consumed
+        }
+        const char* end = doc["end"];
+        if (!current) {
+            continue;
+        }
+        if (!end || chunk.size() == 0) {
+            MATRIX_LOGF(DEBUG, "Timeline gap of %s filled", rooms[handle].roomId.c_str());
+            timelineGaps.pop_front();
+        } else {
+            timelineGaps.front().from = end;
+        }
+    }
+}
+
+// Runs blocking syncs on a thread of its own, so the sync connection never
+// holds up the caller. Requests from other threads go out on the main
+// connection in the meantime.
+bool MatrixClient::startSyncTask() {
+    if (pooled) {
+        MATRIX_LOG(ERROR, "Accounts of a MatrixClientPool are synced by its loop()");
+        return false;
+    }
+    if (syncConnection == &connection) {
+        MATRIX_LOG(ERROR, "The sync task needs a second client for the sync connection");
+        return false;
+    }
+    if (syncTaskRunning) {
+        return true;
+    }
+
+#ifdef ESP_PLATFORM
+    esp_pthread_cfg_t config = esp_pthread_get_default_config();
+    config.stack_size = syncTaskStackSize;
+    esp_pthread_set_cfg(&config);
+#endif
+    syncTaskRunning = true;
+    syncTask = std::thread(&MatrixClient::syncTaskLoop, this);
+    return true;
+}
+
+// Returns once the sync in progress, if any, has finished.
+void MatrixClient::stopSyncTask() {
+    syncTaskRunning = false;
+    if (syncTask.joinable()) {
+        syncTask.join();
+    }
+}
+
+void MatrixClient::syncTaskLoop() {
+    while (syncTaskRunning) {
+        if (!sync()) {
+            delay(waitForResponse); // don't hammer a server that is unreachable
+            continue;
+        }
+        // The pause of the sync schedule, cut short by stopSyncTask()
+        unsigned long pause = getSyncDelay();
+        unsigned long pauseStart = millis();
+        while (syncTaskRunning && millis() - pauseStart < pause) {
+            delay(10);
+        }
+    }
+}
+
+void MatrixClient::buildSyncFilter(JsonDocument& filter, bool initialSync) {
+    filter["next_batch"] = true;
+
+    JsonObject rooms = filter.createNestedObject("rooms");
+
+    JsonObject joinedRoom = rooms.createNestedObject("join").createNestedObject("*");
+    joinedRoom.createNestedObject("summary")["m.joined_member_count"] = true;
+    addStateFilter(joinedRoom.createNestedObject("state").createNestedArray("events").createNestedObject());
+
+    JsonObject timeline = joinedRoom.createNestedObject("timeline");
+    if (syncConfig.backfillGaps && !initialSync) {
+        timeline["limited"] = true;
+        timeline["prev_batch"] = true;
+    }
+    JsonObject joinedEvent = timeline.createNestedArray("events").createNestedObject();
+    addStateFilter(joinedEvent);
+    if (!initialSync) {
+        // Events of the initial sync are skipped, only room state is kept
+        joinedEvent["event_id"] = true;
+        joinedEvent["sender"] = true;
+        joinedEvent["content"]["msgtype"] = true;
+        joinedEvent["content"]["body"] = true;
+    }
+
+    JsonObject invitedEvent = rooms.createNestedObject("invite").createNestedObject("*")
+        .createNestedObject("invite_state").createNestedArray("events").createNestedObject();
+    addStateFilter(invitedEvent);
+    invitedEvent["event_id"] = true;
+    invitedEvent["sender"] = true;
+
+    // Only the room IDs of rooms we left
+    rooms.createNestedObject("leave").createNestedObject("*");
+
+    if (!syncConfig.masterUserId.isEmpty()) {
+        // From m.direct, only the DM rooms shared with the master user
+        JsonObject accountEvent = filter.createNestedObject("account_data").createNestedArray("events").createNestedObject();
+        accountEvent["type"] = true;
+        accountEvent.createNestedObject("content")[syncConfig.masterUserId] = true;
+    }
+}
+
+void MatrixClient::buildSlidingSyncFilter(JsonDocument& filter, bool initialSync) {
+    filter["pos"] = true;
+    filter["errcode"] = true;
+
+    JsonObject room = filter.createNestedObject("rooms").createNestedObject("*");
+    room["initial"] = true;
+    room["num_live"] = true;
+    room["joined_count"] = true;
+    addStateFilter(room.createNestedArray("required_state").createNestedObject());
+
+    JsonObject timelineEvent = room.createNestedArray("timeline").createNestedObject();
+    addStateFilter(timelineEvent);
+    if (!initialSync) {
+        timelineEvent["event_id"] = true;
+        timelineEvent["sender"] = true;
+        timelineEvent["content"]["msgtype"] = true;
+        timelineEvent["content"]["body"] = true;
+    }
+
+    JsonObject invitedEvent = room.createNestedArray("invite_state").createNestedObject();
+    addStateFilter(invitedEvent);
+    invitedEvent["event_id"] = true;
+    invitedEvent["sender"] = true;
+
+    if (!syncConfig.masterUserId.isEmpty()) {
+        JsonObject accountEvent = filter.createNestedObject("extensions").createNestedObject("account_data")
+            .createNestedArray("global").createNestedObject();
+        accountEvent["type"] = true;
+        accountEvent.createNestedObject("content")[syncConfig.masterUserId] = true;
+    }
+}
+
+// One list covering the most recently active rooms, ranges are inclusive.
+void MatrixClient::buildSlidingSyncRequest(JsonDocument& request) {
+    JsonObject list = request.createNestedObject("lists").createNestedObject("window");
+    JsonArray range = list.createNestedArray("ranges").createNestedArray();
+    range.add(0);
+    range.add(slidingSync.windowSize > 0 ? slidingSync.windowSize - 1 : 0);
+    list["timeline_limit"] = effectiveTimelineLimit(slidingSync.timelineLimit);
+    JsonArray requiredState = list.createNestedArray("required_state");
+    for (const String& type : slidingSync.requiredState) {
+        JsonArray state = requiredState.createNestedArray();
+        state.add(type);
+        state.add(type == "m.room.member" ? "$ME" : "");
+    }
+    if (!syncConfig.masterUserId.isEmpty()) {
+        request.createNestedObject("extensions").createNestedObject("account_data")["enabled"] = true;
+    }
+}
+
+void MatrixClient::addStateFilter(JsonObject event) {
+    event["type"] = true;
+    event["state_key"] = true;
+    JsonObject content = event.createNestedObject("content");
+    content["name"] = true;
+    content["topic"] = true;
+    content["membership"] = true;
+}
+
+void MatrixClient::buildFilterDefinition(JsonDocument& definition) {
+    if (!syncFilter.eventFields.empty()) {
+        JsonArray fields = definition.createNestedArray("event_fields");
+        for (const String& field : syncFilter.eventFields) {
+            fields.add(field);
+        }
+    }
+    definition.createNestedObject("presence").createNestedArray("not_types").add("*");
+    definition.createNestedObject("account_data").createNestedArray("types").add("m.direct");
+
+    JsonObject room = definition.createNestedObject("room");
+    room["include_leave"] = false;
+
+    // State changes arrive in the timeline as well
+    JsonObject timeline = room.createNestedObject("timeline");
+    JsonArray timelineTypes = timeline.createNestedArray("types");
+    for (const String& type : syncFilter.timelineTypes) {
+        timelineTypes.add(type);
+    }
+    for (const String& type : syncFilter.stateTypes) {
+        timelineTypes.add(type);
+    }
+    timeline["limit"] = syncFilter.timelineLimit;
+
+    JsonObject state = room.createNestedObject("state");
+    if (syncFilter.stateTypes.empty()) {
+        state.createNestedArray("not_types").add("*");
+    } else {
+        JsonArray stateTypes = state.createNestedArray("types");
+        for (const String& type : syncFilter.stateTypes) {
+            stateTypes.add(type);
+        }
+        state["lazy_load_members"] = true;
+    }
+
+    room.createNestedObject("ephemeral").createNestedArray("not_types").add("*");
+    room.createNestedObject("account_data").createNestedArray("not_types").add("*");
+}
+
+bool MatrixClient::uploadSyncFilter() {
+    if (userId.isEmpty()) {
+        return false;
+    }
+
+    StaticJsonDocument<1024> definition;
+    buildFilterDefinition(definition);
+
+    String payload;
+    serializeJson(definition, payload);
+
+    MatrixJsonDocument doc(jsonPool, FILTER_CAPACITY, maxMessageLength);
+    DeserializationError error = performJsonRequest(homeserverUrl + "/_matrix/client/v3/user/" + userId + "/filter", "POST", payload, doc);
+    if (!error) {
+        if (doc.containsKey("filter_id")) {
+            syncFilterId = doc["filter_id"].as<String>();
+            MATRIX_LOGF(DEBUG, "Sync filter uploaded: %s", syncFilterId.c_str());
+            return true;
+        } else {
+            MATRIX_LOG(ERROR, "No filter_id found in response");
+            MATRIX_LOG(ERROR, doc.body());
+        }
+    } else {
+        MATRIX_LOGF(ERROR, "uploadSyncFilter deserializeJson() failed: %s", error.c_str());
+    }
+    return false;
+}
+
+void MatrixClient::setSyncFilter(const MatrixSyncFilter& filter) {
+    std::lock_guard<std::recursive_mutex> lock(requestMutex);
+    syncFilter = filter;
+    syncFilterId = ""; // upload the new definition on the next sync
+    inlineSyncFilter = false;
+}
+
+const MatrixSyncFilter& MatrixClient::getSyncFilter() const {
+    return syncFilter;
+}
+
+void MatrixClient::setSlidingSync(const MatrixSlidingSync& config) {
+    std::lock_guard<std::recursive_mutex> requestLock(requestMutex);
+    std::lock_guard<std::mutex> lock(eventMutex);
+    slidingSync = config;
+    slidingPos = ""; // a new window needs a new connection
+}
+
+const MatrixSlidingSync& MatrixClient::getSlidingSync() const {
+    return slidingSync;
+}
+
+String MatrixClient::getSyncFilterId() const {
+    return syncFilterId;
+}
+
+// Must be called with requestMutex held, as the tokens are read by requests
+// from other threads.
+bool MatrixClient::refreshAccessToken() {
+    StaticJsonDocument<JSON_OBJECT_SIZE(1)> req;
+    req["refresh_token"] = refreshToken.c_str();
+
+    String payload;
+    serializeJson(req, payload);
+
+    MatrixJsonDocument doc(jsonPool, REFRESH_CAPACITY, maxMessageLength);
+    DeserializationError error = performJsonRequest(homeserverUrl + "/_matrix/client/v3/refresh", "POST", payload, doc);
+    if (!error) {
+        if (doc.containsKey("access_token")) {
+            accessToken = doc["access_token"].as<String>();
+            MATRIX_LOGF(DEBUG, "Got the access token: %s", accessToken.c_str());
+            if (doc.containsKey("refresh_token")) {
+                refreshToken = doc["refresh_token"].as<String>();
+                MATRIX_LOGF(DEBUG, "Got the refresh token: %s", refreshToken.c_str());
+                tokenExpires = doc.containsKey("expires_in_ms");
+                if (tokenExpires) {
+                    tokenExpiryTime = millis() + doc["expires_in_ms"].as<unsigned long>();
+                    MATRIX_LOGF(DEBUG, "Access token refreshed. New expiry in: %lu ms", doc["expires_in_ms"].as<unsigned long>());
+                }
+                saveSession();
+                return true;
+
+            }
+        } else {
+            MATRIX_LOG(ERROR, "No access token found in response");
+            MATRIX_LOG(ERROR, doc.body());
+            MATRIX_LOG(ERROR, "You should log in again!");
+        }
+    } else {
+        MATRIX_LOGF(ERROR, "refresh deserializeJson() failed: %s", error.c_str());
+        return false;
+    }
+    return false;
+}
+
+// A refresh token can be used only once. When the sync task and the
+// application find the token expired at the same time, the second one waits
+// here for the refresh of the first and then finds a fresh token.
+bool MatrixClient::ensureAccessToken() {
+    std::lock_guard<std::recursive_mutex> lock(requestMutex);
+    if (tokenExpires && (long)(millis() - tokenExpiryTime) >= -10000) {
+        MATRIX_LOG(INFO, "Access token expired, refreshing...");
+        return refreshAccessToken();
+    }
+    return true;
+}
+
+void MatrixClient::setSessionStore(MatrixSessionStore* store) {
+    sessionStore = store;
+}
+
+// Call before deep sleep or a restart to store the latest sync token.
+bool MatrixClient::saveSession() {
+    std::lock_guard<std::recursive_mutex> lock(requestMutex);
+    if (!sessionStore || accessToken.isEmpty()) {
+        return false;
+    }
+
+    MatrixSession session;
+    session.loginUser = loginUser;
+    session.homeserverUrl = homeserverUrl;
+    session.userId = userId;
+    session.accessToken = accessToken;
+    session.refreshToken = refreshToken;
+    if (tokenExpires) {
+        // Stored as wall-clock time, millis() starts over after a restart.
+        // Without a clock the token is taken as expired and refreshed on resume.
+        int64_t now = wallClock();
+        long remaining = (long)(tokenExpiryTime - millis());
+        session.tokenExpiresAt = now ? now + (remaining > 0 ? remaining / 1000 : 0) : 1;
+    }
+    session.syncFilterId = syncFilterId;
+    {
+        std::lock_guard<std::mutex> eventLock(eventMutex);
+        session.syncToken = syncToken;
+        session.masterRoomId = masterRoomId;
+    }
+
+    sessionSavedAt = millis();
+    if (!sessionStore->save(session)) {
+        MATRIX_LOG(ERROR, "Failed to save the session");
+        return false;
+    }
+    return true;
+}
+
+bool MatrixClient::restoreSession(const String& matrixUser) {
+    MatrixSession session;
+    if (!sessionStore || !sessionStore->load(session) || session.loginUser != matrixUser) {
+        return false;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(requestMutex);
+    loginUser = session.loginUser;
+    homeserverUrl = session.homeserverUrl;
+    userId = session.userId;
+    accessToken = session.accessToken;
+    refreshToken = session.refreshToken;
+    syncFilterId = session.syncFilterId;
+    inlineSyncFilter = false;
+    tokenExpires = session.tokenExpiresAt != 0;
+    if (tokenExpires) {
+        int64_t now = wallClock();
+        int64_t remaining = now && session.tokenExpiresAt > now ? (session.tokenExpiresAt - now) * 1000 : 0;
+        tokenExpiryTime = millis() + (unsigned long)(remaining < 0x7FFFFFFF ? remaining : 0x7FFFFFFF);
+    }
+    {
+        std::lock_guard<std::mutex> lock(eventMutex);
+        syncToken = session.syncToken;
+        masterRoomId = session.masterRoomId;
+        timelineGaps.clear();
+    }
+    sessionSavedAt = millis();
+    return true;
+}
+
+void MatrixClient::invalidateSession() {
+    std::lock_guard<std::recursive_mutex> lock(requestMutex);
+    accessToken = "";
+    tokenExpires = false;
+    if (sessionStore) {
+        sessionStore->clear();
+    }
+}
+
+void MatrixClient::logFormatted(LogLevel level, const char* format, ...) {
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (length < (int)sizeof(message)) {
+        logger(level, String(message));
+        return;
+    }
+
+    // Response bodies do not fit on the stack; they are cut if the heap has no room either
+    std::unique_ptr<char[]> longMessage(new (std::nothrow) char[length + 1]);
+    if (!longMessage) {
+        logger(level, String(message));
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(longMessage.get(), length + 1, format, args);
+    va_end(args);
+    logger(level, String(longMessage.get()));
+}
+
+void MatrixClient::setMasterUserId(const String& userId) {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    if (userId != masterUserId) {
+        masterRoomId = "";
+    }
+    masterUserId = userId;
+}
+
+bool MatrixClient::sendDMToMaster(const String& message, const String& msgType) {
+    String master;
+    {
+        std::lock_guard<std::mutex> lock(eventMutex);
+        master = masterUserId;
+    }
+    if (master.isEmpty()) {
+        MATRIX_LOG(ERROR, "Master user has not been set yet");
+        return false;
+    }
+
+    String roomId = getMasterRoomId();
+    if (roomId.isEmpty()) {
+        if (!resolveMasterRoom(master, roomId)) {
+            MATRIX_LOG(ERROR, "Failed to create master room");
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(eventMutex);
+            masterRoomId = roomId;
+        }
+        saveSession();
+    }
+    return sendMessageToRoom(roomId, message, msgType);
+}
+
+// The cached DM room, unless we have left it since.
+String MatrixClient::getMasterRoomId() {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    if (!masterRoomId.isEmpty()) {
+        const MatrixRoom* room = getRoom(findRoom(masterRoomId));
+        if (room && room->membership == MEMBERSHIP_LEFT) {
+            MATRIX_LOGF(INFO, "Left the master room %s", masterRoomId.c_str());
+            masterRoomId = "";
+        }
+    }
+    return masterRoomId;
+}
+
+// Looks the DM room up in the m.direct account data and only creates one
+// when there is none yet. A new room is added to m.direct so that it is found
+// again after a restart.
+bool MatrixClient::resolveMasterRoom(const String& master, String& roomId) {
+    String url = homeserverUrl + "/_matrix/client/v3/user/" + userId + "/account_data/m.direct";
+    HTTPResponse response;
+    MatrixJsonDocument direct(jsonPool, DIRECT_CAPACITY, maxMessageLength);
+    DeserializationError error = performJsonRequest(url, "GET", "", direct, true, &response);
+
+    // A 404 means there is no m.direct yet, which is as good as an empty one
+    bool complete = response.statusCode == 404 || (response.isSuccess() && !error && direct.is<JsonObject>() && !direct.overflowed());
+    if (!response.isSuccess()) {
+        direct.clear();
+    }
+
+    if (complete) {
+        std::lock_guard<std::mutex> lock(eventMutex);
+        adoptDirectRoom(direct[master].as<JsonArray>());
+        if (!masterRoomId.isEmpty()) {
+            roomId = masterRoomId;
+            return true;
+        }
+    }
+
+    if (!createRoom(master, roomId)) {
+        return false;
+    }
+
+    if (!complete) {
+        // Writing back an incomplete m.direct would lose its other entries
+        MATRIX_LOG(ERROR, "Could not read m.direct, the new DM room is not recorded there");
+        return true;
+    }
+    if (!direct[master.c_str()].add(roomId.c_str())) {
+        MATRIX_LOG(ERROR, "m.direct is too large to add the new DM room, it is not recorded there");
+        return true;
+    }
+    String payload;
+    serializeJson(direct, payload);
+    performHTTPRequest(url, "PUT", payload);
+    return true;
+}
+
+// Must be called with eventMutex held. Takes the most recent DM room with the
+// master user that we have not left, if no DM room is known yet.
+void MatrixClient::adoptDirectRoom(JsonArray roomIds) {
+    if (!masterRoomId.isEmpty()) {
+        return;
+    }
+    for (size_t i = roomIds.size(); i > 0; i--) {
+        const char* roomId = roomIds[i - 1] | "";
+        const MatrixRoom* room = getRoom(findRoom(roomId));
+        if (*roomId && (!room || room->membership != MEMBERSHIP_LEFT)) {
+            masterRoomId = roomId;
+            MATRIX_LOGF(DEBUG, "DM room with the master user: %s", masterRoomId.c_str());
+            return;
+        }
+    }
+}
+
+bool MatrixClient::createRoom(const String& userId, String& roomId) {
+    if (!ensureAccessToken()) {
+        MATRIX_LOG(ERROR, "Cannot create room: failed to ensure access token");
+        return false;
+    }
+
+    StaticJsonDocument<256> req;
+    req["invite"] = JsonArray();
+    req["invite"].add(userId);
+    req["is_direct"] = true;
+    req["preset"] = "trusted_private_chat";
+
+    String payload;
+    serializeJson(req, payload);
+
+    MatrixJsonDocument doc(jsonPool, CREATE_ROOM_CAPACITY, maxMessageLength);
+    DeserializationError error = performJsonRequest(homeserverUrl + "/_matrix/client/v3/createRoom", "POST", payload, doc);
+
+    if (!error) {
+        if (doc.containsKey("room_id")) {
+            roomId = doc["room_id"].as<String>();
+            MATRIX_LOGF(DEBUG, "Room created: %s", roomId.c_str());
+            return true;
+        } else {
+            MATRIX_LOG(ERROR, "No room_id found in response");
+        }
+    } else {
+        MATRIX_LOGF(ERROR, "createRoom deserializeJson() failed: %s, responseBody: %s", error.c_str(), doc.body());
+    }
+
+    return false;
+}
+
+bool MatrixClient::sendMessageToRoom(const String& roomId, const String& message, const String& msgType, const String& transactionId) {
+    if (!ensureAccessToken()) {
+        MATRIX_LOG(ERROR, "Cannot send message: failed to ensure access token");
+        return false;
+    }
+
+    // Strings are stored as pointers, so the body can be of any length
+    StaticJsonDocument<JSON_OBJECT_SIZE(2)> req;
+    req["msgtype"] = msgType.c_str();
+    req["body"] = message.c_str();
+    if (req.overflowed()) {
+        MATRIX_LOG(ERROR, "Message does not fit into its JSON document");
+        return false;
+    }
+
+    String payload;
+    serializeJson(req, payload);
+
+    if (!sendRoomMessage(roomId, payload, transactionId)) {
+        return false;
+    }
+    MATRIX_LOGF(INFO, "Message sent to room: %s", roomId.c_str());
+    return true;
+}
+
+String MatrixClient::newTransactionId() {
+    return transactionPrefix + String((unsigned long)++transactionCounter);
+}
+
+// The server answers a transaction ID it has seen before with the event it
+// created back then, so sending again after an error never posts twice.
+bool MatrixClient::sendRoomMessage(const String& roomId, const String& payload, const String& transactionId) {
+    String url = homeserverUrl + "/_matrix/client/v3/rooms/" + roomId + "/send/m.room.message/" + urlEncode(transactionId.isEmpty() ? newTransactionId() : transactionId);
+    MatrixJsonDocument doc(jsonPool, SEND_CAPACITY, maxMessageLength);
+    DeserializationError error = performJsonRequest(url, "PUT", payload, doc);
+
+    if (error) {
+        MATRIX_LOGF(ERROR, "Sending to %s failed, deserializeJson(): %s, responseBody: %s", roomId.c_str(), error.c_str(), doc.body());
+        return false;
+    }
+    if (!doc.containsKey("event_id")) {
+        MATRIX_LOG(ERROR, "No event_id found in response");
+        MATRIX_LOG(ERROR, doc.body());
+        return false;
+    }
+    return true;
+}
+
+bool MatrixClient::joinRoom(const String& roomId) {
+    if (!ensureAccessToken()) {
+        MATRIX_LOG(ERROR, "Cannot join room: failed to ensure access token");
+        return false;
+    }
+    String url = homeserverUrl + "/_matrix/client/v3/join/" + roomId;
+    String responseBody = performHTTPRequest(url, "POST", "");
+    return true;
+}
+
+// Replaces the pending marker of the room; a receipt for an event implies
+// all events before it were read.
+void MatrixClient::markRead(const String& roomId, const String& eventId) {
+    std::lock_guard<std::mutex> lock(markerMutex);
+    if (readMarkers.empty()) {
+        readMarkersSince = millis();
+    }
+    for (ReadMarker& marker : readMarkers) {
+        if (marker.roomId == roomId) {
+            marker.eventId = eventId;
+            return;
+        }
+    }
+    readMarkers.push_back({roomId, eventId});
+}
+
+// One request per room sets both the fully read marker and the read receipt.
+// A marker that fails stays pending, unless a newer one replaced it in the
+// meantime.
+size_t MatrixClient::flushReadMarkers() {
+    std::vector<ReadMarker> pending;
+    {
+        std::lock_guard<std::mutex> lock(markerMutex);
+        pending.swap(readMarkers);
+    }
+    if (pending.empty()) {
+        return 0;
+    }
+
+    std::vector<ReadMarker> failed;
+    if (!ensureAccessToken()) {
+        MATRIX_LOG(ERROR, "Cannot send read markers: failed to ensure access token");
+        failed.swap(pending);
+    }
+    for (const ReadMarker& marker : pending) {
+        StaticJsonDocument<JSON_OBJECT_SIZE(2)> req;
+        req["m.fully_read"] = marker.eventId.c_str();
+        req["m.read"] = marker.eventId.c_str();
+        String payload;
+        serializeJson(req, payload);
+
+        HTTPResponse response;
+        MatrixJsonDocument doc(jsonPool, ERROR_CAPACITY, maxMessageLength);
+        performJsonRequest(homeserverUrl + "/_matrix/client/v3/rooms/" + marker.roomId + "/read_markers", "POST", payload, doc, true, &response);
+        if (response.isSuccess()) {
+            continue;
+        }
+        MATRIX_LOGF(ERROR, "Read marker for %s failed with status %d", marker.roomId.c_str(), response.statusCode);
+        if (response.statusCode == 0 || response.statusCode == 429 || response.statusCode >= 500) {
+            failed.push_back(marker);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(markerMutex);
+    for (const ReadMarker& marker : failed) {
+        bool replaced = false;
+        for (const ReadMarker& newer : readMarkers) {
+            replaced = replaced || newer.roomId == marker.roomId;
+        }
+        if (!replaced) {
+            if (readMarkers.empty()) {
+                readMarkersSince = millis();
+            }
+            readMarkers.push_back(marker);
+        }
+    }
+    return readMarkers.size();
+}
+
+bool MatrixClient::sendReadReceipt(const String& roomId, const String& eventId) {
+    if (!ensureAccessToken()) {
+        MATRIX_LOG(ERROR, "Cannot send read receipt: failed to ensure access token");
+        return false;
+    }
+    String url = homeserverUrl + "/_matrix/client/v3/rooms/" + roomId + "/receipt/m.read/" + eventId;
+    String responseBody = performHTTPRequest(url, "POST", "");
+    return true;
+}
+
+bool MatrixClient::sendMediaToRoom(const String& roomId, const String& fileName, const String& contentType, const uint8_t* fileData, size_t fileSize, const MatrixMediaInfo& info, const String& transactionId) {
+    return postMedia(roomId, fileName, contentType, uploadMedia(fileName, contentType, fileData, fileSize), fileSize, info, transactionId);
+}
+
+bool MatrixClient::sendMediaToRoom(const String& roomId, const String& fileName, const String& contentType, Stream& source, size_t fileSize, const MatrixMediaInfo& info, const String& transactionId) {
+    MediaReader reader = [&source](uint8_t* buffer, size_t length) {
+        return source.readBytes(buffer, length);
+    };
+    return sendMediaToRoom(roomId, fileName, contentType, reader, fileSize, info, transactionId);
+}
+
+bool MatrixClient::sendMediaToRoom(const String& roomId, const String& fileName, const String& contentType, MediaReader reader, size_t fileSize, const MatrixMediaInfo& info, const String& transactionId) {
+    return postMedia(roomId, fileName, contentType, uploadMedia(fileName, contentType, reader, fileSize), fileSize, info, transactionId);
+}
+
+bool MatrixClient::postMedia(const String& roomId, const String& fileName, const String& contentType, const String& mediaUrl, size_t fileSize, const MatrixMediaInfo& info, const String& transactionId) {
+    if (mediaUrl.isEmpty()) {
+        MATRIX_LOG(ERROR, "Media upload failed");
+        return false;
+    }
+
+    MATRIX_LOGF(DEBUG, "Media uploaded. URL: %s", mediaUrl.c_str());
+
+    StaticJsonDocument<MEDIA_EVENT_CAPACITY> req;
+    buildMediaEvent(req, fileName, contentType, mediaUrl, fileSize, info);
+    if (req.overflowed()) {
+        MATRIX_LOG(ERROR, "Media event does not fit into its JSON document");
+        return false;
+    }
+
+    String payload;
+    serializeJson(req, payload);
+
+    if (!sendRoomMessage(roomId, payload, transactionId)) {
+        return false;
+    }
+    MATRIX_LOGF(DEBUG, "Media sent to room: %s, %s", roomId.c_str(), mediaUrl.c_str());
+    return true;
+}
+
+uint32_t MatrixClient::queueMessage(const String& roomId, const String& message, const String& msgType) {
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    if (coalesceMessages && !outbox.empty()) {
+        // Bursts to the same room go out as one event, one line per message
+        OutboundMessage& last = outbox.back();
+        if (last.kind == OUTBOUND_MESSAGE && !last.inFlight && last.roomId == roomId && last.msgType == msgType &&
+            (int)(last.body.length() + message.length()) < maxMessageLength) {
+            last.body += "\n" + message;
+            last.ids.push_back(nextMessageId);
+            return nextMessageId++;
+        }
+    }
+
+    OutboundMessage item;
+    item.kind = OUTBOUND_MESSAGE;
+    item.roomId = roomId;
+    item.msgType = msgType;
+    item.body = message;
+    return enqueue(item);
+}
+
+uint32_t MatrixClient::queueMedia(const String& roomId, const String& fileName, const String& contentType, const uint8_t* fileData, size_t fileSize, const MatrixMediaInfo& info) {
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    OutboundMessage item;
+    item.kind = OUTBOUND_MEDIA;
+    item.roomId = roomId;
+    item.msgType = contentType;
+    item.body = fileName;
+    item.fileData = fileData;
+    item.fileSize = fileSize;
+    item.mediaInfo = info;
+    return enqueue(item);
+}
+
+uint32_t MatrixClient::queueReadReceipt(const String& roomId, const String& eventId) {
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    // Only the latest receipt of a room matters, it replaces a queued one
+    for (OutboundMessage& queued : outbox) {
+        if (queued.kind == OUTBOUND_RECEIPT && !queued.inFlight && queued.roomId == roomId) {
+            queued.body = eventId;
+            queued.ids.push_back(nextMessageId);
+            return nextMessageId++;
+        }
+    }
+
+    OutboundMessage item;
+    item.kind = OUTBOUND_RECEIPT;
+    item.roomId = roomId;
+    item.body = eventId;
+    return enqueue(item);
+}
+
+// Returns 0 when the queue is full; nothing already queued is ever dropped
+// to make room.
+uint32_t MatrixClient::enqueue(OutboundMessage& item) {
+    if ((int)outbox.size() >= maxQueuedMessages) {
+        MATRIX_LOGF(ERROR, "Outbound queue is full, message to %s not queued", item.roomId.c_str());
+        return 0;
+    }
+    item.transactionId = newTransactionId();
+    item.ids.push_back(nextMessageId);
+    outbox.push_back(item);
+    return nextMessageId++;
+}
+
+void MatrixClient::setSendCallback(SendCallback callback) {
+    sendCallback = callback;
+}
+
+size_t MatrixClient::queuedMessages() {
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    return outbox.size();
+}
+
+// Sends queued messages in order over the main connection until the queue is
+// empty or the message at its head has to wait for a retry. Up to
+// pipelineDepth messages go out together, see sendPipelined(). Returns the
+// number of messages still queued. Only one thread drains the queue at a
+// time; a call while another one is sending returns right away, so a message
+// is never sent twice at once.
+size_t MatrixClient::processQueue() {
+    std::unique_lock<std::mutex> draining(queueMutex, std::try_to_lock);
+    if (!draining.owns_lock()) {
+        return queuedMessages();
+    }
+    while (true) {
+        std::vector<OutboundMessage*> batch;
+        {
+            std::lock_guard<std::mutex> lock(outboxMutex);
+            if (outbox.empty()) {
+                return 0;
+            }
+            if ((long)(millis() - outbox.front().notBefore) < 0) {
+                return outbox.size();
+            }
+            // Media goes alone, its upload is a request of its own
+            for (OutboundMessage& queued : outbox) {
+                if ((int)batch.size() >= pipelineDepth && !batch.empty()) {
+                    break;
+                }
+                if (!batch.empty() && (queued.kind == OUTBOUND_MEDIA || batch[0]->kind == OUTBOUND_MEDIA || (long)(millis() - queued.notBefore) < 0)) {
+                    break;
+                }
+                queued.inFlight = true;
+                batch.push_back(&queued);
+            }
+        }
+
+        std::vector<OutboundOutcome> outcomes(batch.size());
+        if (batch.size() == 1) {
+            outcomes[0].result = sendOutbound(*batch[0], outcomes[0].retryAfter, outcomes[0].eventId);
+        } else {
+            sendPipelined(batch, outcomes);
+        }
+
+        // Messages that are done leave the queue, even when one before them
+        // has to be retried
+        std::vector<std::pair<std::vector<uint32_t>, SendStatus>> finished;
+        std::vector<String> eventIds;
+        bool waiting = false;
+        {
+            std::lock_guard<std::mutex> lock(outboxMutex);
+            for (size_t i = 0; i < batch.size(); i++) {
+                OutboundMessage* item = batch[i];
+                const OutboundOutcome& outcome = outcomes[i];
+                item->inFlight = false;
+                SendStatus status = SEND_DELIVERED;
+                if (outcome.result == OUTBOUND_RETRY) {
+                    if (outcome.retryAfter > 0) {
+                        // Rate limited; waiting as told does not use up a retry
+                        item->notBefore = millis() + outcome.retryAfter;
+                        MATRIX_LOGF(INFO, "Rate limited, retrying in %lu ms", outcome.retryAfter);
+                        waiting = true;
+                        continue;
+                    }
+                    if (item->attempts < maxSendRetries) {
+                        unsigned long backoff = sendRetryDelay << item->attempts;
+                        item->attempts++;
+                        item->notBefore = millis() + (backoff < 60000 ? backoff : 60000);
+                        MATRIX_LOGF(INFO, "Sending to %s failed, retry %d in %lu ms", item->roomId.c_str(), item->attempts, backoff);
+                        waiting = true;
+                        continue;
+                    }
+                    MATRIX_LOGF(ERROR, "Giving up on message to %s after %d attempts", item->roomId.c_str(), item->attempts + 1);
+                    status = SEND_GAVE_UP;
+                } else if (outcome.result == OUTBOUND_REJECTED) {
+                    status = SEND_REJECTED;
+                }
+                finished.emplace_back(std::move(item->ids), status);
+                eventIds.push_back(outcome.eventId);
+                item->ids.clear(); // marks it for removal
+            }
+            auto batchEnd = outbox.begin() + batch.size();
+            outbox.erase(std::remove_if(outbox.begin(), batchEnd, [](const OutboundMessage& item) { return item.ids.empty(); }), batchEnd);
+        }
+
+        if (sendCallback) {
+            for (size_t i = 0; i < finished.size(); i++) {
+                for (uint32_t id : finished[i].first) {
+                    sendCallback(id, finished[i].second, eventIds[i]);
+                }
+            }
+        }
+        if (waiting) {
+            return queuedMessages();
+        }
     }
+}
 
-    // Create HTTP request
-    client->print(method + " " + path + " HTTP/1.1\r\n");
-    client->print("Host: " + host + "\r\n");
-    client->print("User-Agent: ESP32\r\n");
-    client->print("Content-Type: application/json\r\n");
-    if (useAuth) {
-        client->print("Authorization: Bearer " + accessToken + "\r\n");
+static void buildSendFilter(JsonDocument& filter) {
+    filter["event_id"] = true;
+    filter["errcode"] = true;
+    filter["retry_after_ms"] = true;
+}
+
+MatrixClient::OutboundResult MatrixClient::sendOutbound(OutboundMessage& item, unsigned long& retryAfter, String& eventId) {
+    if (!ensureAccessToken()) {
+        MATRIX_LOG(ERROR, "Cannot send queued message: failed to ensure access token");
+        return OUTBOUND_RETRY;
     }
-    if (method != "GET") {
-        client->print("Content-Length: " + String(payload.length()) + "\r\n");
+
+    String url;
+    String payload;
+    if (!buildOutbound(item, url, payload)) {
+        return item.kind == OUTBOUND_MEDIA && item.contentUri.isEmpty() ? OUTBOUND_RETRY : OUTBOUND_REJECTED;
     }
-    client->print("\r\n");
-    if (method != "GET") {
-        client->print(payload);
+
+    StaticJsonDocument<256> filter;
+    buildSendFilter(filter);
+    MatrixJsonDocument doc(jsonPool, SEND_CAPACITY, maxMessageLength);
+    HTTPResponse response;
+    performJsonRequest(url, item.kind == OUTBOUND_RECEIPT ? "POST" : "PUT", payload, doc, true, &response, &filter);
+    return readOutboundResult(item, response, doc, doc.body(), retryAfter, eventId);
+}
+
+// Returns false when the file of a media message could not be uploaded, or
+// when the event does not fit into its document.
+bool MatrixClient::buildOutbound(OutboundMessage& item, String& url, String& payload) {
+    if (item.kind == OUTBOUND_RECEIPT) {
+        url = homeserverUrl + "/_matrix/client/v3/rooms/" + item.roomId + "/receipt/m.read/" + item.body;
+        payload = "{}";
+        return true;
     }
 
-    String responseBody, headers;
-    readHTTPResponse(responseBody, headers);
-    client->stop();
+    StaticJsonDocument<MEDIA_EVENT_CAPACITY> req;
+    if (item.kind == OUTBOUND_MEDIA) {
+        // The upload is kept when only sending the event fails
+        if (item.contentUri.isEmpty()) {
+            item.contentUri = uploadMedia(item.body, item.msgType, item.fileData, item.fileSize);
+            if (item.contentUri.isEmpty()) {
+                return false;
+            }
+        }
+        buildMediaEvent(req, item.body, item.msgType, item.contentUri, item.fileSize, item.mediaInfo);
+    } else {
+        req["msgtype"] = item.msgType.c_str();
+        req["body"] = item.body.c_str();
+    }
+    if (req.overflowed()) {
+        MATRIX_LOGF(ERROR, "Queued message to %s does not fit into its JSON document", item.roomId.c_str());
+        return false;
+    }
+    serializeJson(req, payload);
+    url = homeserverUrl + "/_matrix/client/v3/rooms/" + item.roomId + "/send/m.room.message/" + item.transactionId;
+    return true;
+}
 
-    logger(DEBUG, "HTTP " + method + " request to " + url + " completed with response: " + responseBody);
+MatrixClient::OutboundResult MatrixClient::readOutboundResult(const OutboundMessage& item, const HTTPResponse& response, JsonDocument& doc, const char* responseBody, unsigned long& retryAfter, String& eventId) {
+    if (response.statusCode == 0) {
+        return OUTBOUND_RETRY;
+    }
+    if (response.isSuccess()) {
+        eventId = doc["event_id"] | "";
+        return OUTBOUND_DELIVERED;
+    }
+    if (response.statusCode == 429 || doc["errcode"] == "M_LIMIT_EXCEEDED") {
+        retryAfter = doc["retry_after_ms"] | (response.retryAfter > 0 ? response.retryAfter : sendRetryDelay);
+        return OUTBOUND_RETRY;
+    }
+    if (response.statusCode >= 500) {
+        return OUTBOUND_RETRY;
+    }
 
-    return responseBody;
+    MATRIX_LOGF(ERROR, "Message to %s rejected with status %d: %s", item.roomId.c_str(), response.statusCode, responseBody);
+    return OUTBOUND_REJECTED;
 }
 
-bool MatrixClient::readHTTPResponse(String &body, String &headers) {
-    int ch_count = 0;
-    unsigned long now = millis();
-    bool finishedHeaders = false;
-    bool currentLineIsBlank = true;
-    bool responseReceived = false;
-
-    while (millis() - now < syncTimeout + waitForResponse) {
-        while (client->available()) {
-            responseReceived = true;
-            char c = client->read();
-            if (!finishedHeaders) {
-                if (currentLineIsBlank && c == '\n') {
-                    finishedHeaders = true;
-                } else {
-                    headers += c;
-                }
+// Writes the requests of the batch back to back, in as few socket writes as
+// the request buffer allows, and then reads the responses in the same order.
+// Messages whose response does not arrive are retried with their transaction
+// ID, so the server posts none of them twice. When one in the middle has to
+// be retried, the messages after it may end up in the room before it.
+void MatrixClient::sendPipelined(const std::vector<OutboundMessage*>& batch, std::vector<OutboundOutcome>& outcomes) {
+    if (!ensureAccessToken()) {
+        MATRIX_LOG(ERROR, "Cannot send queued messages: failed to ensure access token");
+        return;
+    }
+
+    // Messages that cannot be built are rejected, the others still go out
+    std::vector<OutboundMessage*> sendable;
+    std::vector<OutboundOutcome*> sendableOutcomes;
+    std::vector<String> urls;
+    std::vector<String> payloads;
+    for (size_t i = 0; i < batch.size(); i++) {
+        String url;
+        String payload;
+        if (!buildOutbound(*batch[i], url, payload)) {
+            outcomes[i].result = OUTBOUND_REJECTED;
+            continue;
+        }
+        sendable.push_back(batch[i]);
+        sendableOutcomes.push_back(&outcomes[i]);
+        urls.push_back(url);
+        payloads.push_back(payload);
+    }
+    if (sendable.empty()) {
+        return;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(requestMutex);
+    claimConnection();
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool written = true;
+        for (size_t i = 0; i < sendable.size() && written; i++) {
+            const char* method = sendable[i]->kind == OUTBOUND_RECEIPT ? "POST" : "PUT";
+            if (i == 0) {
+                written = writeHTTPHeaders(connection, urls[i], method, "application/json", payloads[i].length(), true, acceptEncodingHeader());
             } else {
-                if (ch_count < maxMessageLength) {
-                    body += c;
-                    ch_count++;
-                }
+                written = appendHTTPHeaders(connection, urls[i], method, "application/json", payloads[i].length(), true, acceptEncodingHeader());
+            }
+            if (written) {
+                connection.append(payloads[i]);
+            }
+        }
+        if (!written || !connection.flushRequest()) {
+            MATRIX_LOG(ERROR, "Writing the pipelined requests failed");
+            connection.close();
+            return;
+        }
+
+        size_t answered = 0;
+        bool reusable = true;
+        bool serverKeepAlive = true;
+        HTTPRequestTiming counted;
+        for (size_t i = 0; i < sendable.size() && reusable; i++) {
+            MatrixRequestMetrics metrics;
+            metrics.endpoint = sendable[i]->kind == OUTBOUND_RECEIPT ? ENDPOINT_OTHER : ENDPOINT_SEND;
+            startHeapMetrics(metrics);
+            HTTPResponse response;
+            if (!connection.readResponseHeaders(response, syncTimeout + waitForResponse)) {
+                break;
+            }
+            MatrixJsonDocument doc(jsonPool, SEND_CAPACITY, maxMessageLength);
+            unsigned long bodyStart = micros();
+            serverKeepAlive = response.keepAlive;
+            reusable = readHTTPBody(connection, response, doc.body(), doc.bodyCapacity()) && serverKeepAlive;
+            metrics.bodyTime = micros() - bodyStart;
+
+            StaticJsonDocument<256> filter;
+            buildSendFilter(filter);
+            unsigned long parseStart = micros();
+            deserializeJson(doc, doc.body(), DeserializationOption::Filter(filter));
+            metrics.parseTime = micros() - parseStart;
+            metrics.documentUsage = doc.memoryUsage();
+            OutboundOutcome& outcome = *sendableOutcomes[i];
+            outcome.result = readOutboundResult(*sendable[i], response, doc, doc.body(), outcome.retryAfter, outcome.eventId);
+            answered++;
+
+            // The connection counts for the whole batch; each response gets
+            // what was added since the previous one, the handshake and the
+            // requests go to the first
+            readTransportMetrics(metrics, connection, response);
+            metrics.bytesIn -= counted.bytesIn;
+            metrics.bytesInflated -= counted.bytesInflated;
+            metrics.inflateTime -= counted.inflateTime;
+            counted = connection.getRequestTiming();
+            if (i > 0) {
+                metrics.reused = true;
+                metrics.connectTime = 0;
+                metrics.bytesOut = 0;
+            }
+            recordMetrics(metrics);
+        }
+        connection.release(reusable && answered == sendable.size(), serverKeepAlive);
+
+        if (answered > 0 || !connection.isReused()) {
+            if (answered < sendable.size()) {
+                MATRIX_LOGF(ERROR, "Only %u of %u pipelined requests were answered", (unsigned)answered, (unsigned)sendable.size());
             }
+            return;
+        }
+        // The server dropped the idle connection just as we reused it
+        MATRIX_LOG(DEBUG, "Kept-alive connection was closed by the server, reconnecting");
+        connection.close();
+    }
+}
+
+// Strings are stored as pointers, they have to outlive the event
+void MatrixClient::buildMediaEvent(JsonDocument& event, const String& fileName, const String& contentType, const String& contentUri, size_t fileSize, const MatrixMediaInfo& info) {
+    event["msgtype"] = info.msgType.c_str();
+    event["body"] = fileName.c_str();
+    event["url"] = contentUri.c_str();
+    JsonObject details = event.createNestedObject("info");
+    details["mimetype"] = contentType.c_str();
+    details["size"] = fileSize;
+    if (info.width > 0 && info.height > 0) {
+        details["w"] = info.width;
+        details["h"] = info.height;
+    }
+    if (info.duration > 0) {
+        details["duration"] = info.duration;
+    }
+}
+
+void MatrixClient::setUploadProgressCallback(UploadProgressCallback callback) {
+    uploadProgressCallback = callback;
+}
+
+String MatrixClient::uploadMedia(const String& fileName, const String& contentType, const uint8_t* fileData, size_t fileSize) {
+    const uint8_t* position = fileData;
+    MediaReader reader = [&position](uint8_t* buffer, size_t length) {
+        memcpy(buffer, position, length);
+        position += length;
+        return length;
+    };
+    std::function<bool()> rewind = [&position, fileData]() {
+        position = fileData;
+        return true;
+    };
+    return uploadMedia(fileName, contentType, reader, fileSize, rewind);
+}
+
+String MatrixClient::uploadMedia(const String& fileName, const String& contentType, Stream& source, size_t fileSize) {
+    MediaReader reader = [&source](uint8_t* buffer, size_t length) {
+        return source.readBytes(buffer, length);
+    };
+    return uploadMedia(fileName, contentType, reader, fileSize);
+}
+
+String MatrixClient::uploadMedia(const String& fileName, const String& contentType, MediaReader reader, size_t fileSize) {
+    return uploadMedia(fileName, contentType, reader, fileSize, nullptr);
+}
+
+// The file is read and written one chunk at a time, so an upload needs
+// uploadChunkSize bytes of memory whatever the size of the file. When the
+// server closed the kept-alive connection just as the upload went out, it is
+// sent once more on a fresh connection, provided the file can be read again:
+// through rewind, or from the chunk when the file fit into one.
+String MatrixClient::uploadMedia(const String& fileName, const String& contentType, MediaReader reader, size_t fileSize, std::function<bool()> rewind) {
+    if (!ensureAccessToken()) {
+        MATRIX_LOG(ERROR, "Cannot upload media: failed to ensure access token");
+        return "";
+    }
+
+    size_t chunkSize = uploadChunkSize > 0 ? uploadChunkSize : 1024;
+    if (chunkSize > fileSize && fileSize > 0) {
+        chunkSize = fileSize;
+    }
+    std::unique_ptr<uint8_t[]> chunk(new (std::nothrow) uint8_t[chunkSize]);
+    if (!chunk) {
+        MATRIX_LOGF(ERROR, "Cannot upload media: out of memory for a %lu byte chunk", (unsigned long)chunkSize);
+        return "";
+    }
+
+    String url = homeserverUrl + "/_matrix/media/v3/upload?filename=" + urlEncode(fileName);
+    MatrixRequestMetrics metrics;
+    metrics.endpoint = ENDPOINT_UPLOAD;
+    startHeapMetrics(metrics);
+
+    std::lock_guard<std::recursive_mutex> lock(requestMutex);
+    claimConnection();
+
+    HTTPResponse response;
+    bool answered = false;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!writeHTTPHeaders(connection, url, "POST", contentType, fileSize, true)) {
+            readTransportMetrics(metrics, connection, HTTPResponse());
+            recordMetrics(metrics);
+            return "";
+        }
 
-            if (c == '\n') currentLineIsBlank = true;
-            else if (c != '\r') currentLineIsBlank = false;
+        // The headers go out with the first chunk. From then on the body has
+        // to be complete, a short file leaves the connection unusable.
+        bool fromChunk = attempt > 0 && !rewind;
+        size_t sent = 0;
+        while (sent < fileSize) {
+            size_t length = fileSize - sent < chunkSize ? fileSize - sent : chunkSize;
+            size_t count = fromChunk ? length : reader(chunk.get(), length);
+            if (count == 0 || count > length || !connection.flushRequest(chunk.get(), count)) {
+                MATRIX_LOGF(ERROR, "Media upload of %s aborted after %lu of %lu bytes", fileName.c_str(), (unsigned long)sent, (unsigned long)fileSize);
+                readTransportMetrics(metrics, connection, HTTPResponse());
+                recordMetrics(metrics);
+                connection.close();
+                return "";
+            }
+            sent += count;
+            if (uploadProgressCallback) {
+                uploadProgressCallback(sent, fileSize);
+            }
+        }
+        if (fileSize == 0 && !connection.flushRequest()) {
+            MATRIX_LOGF(ERROR, "Media upload of %s failed", fileName.c_str());
+            readTransportMetrics(metrics, connection, HTTPResponse());
+            recordMetrics(metrics);
+            connection.close();
+            return "";
         }
 
-        if (responseReceived) {
-            body = extractJsonBody(body);
+        answered = connection.readResponseHeaders(response, syncTimeout + waitForResponse);
+        bool replayable = rewind || fileSize <= chunkSize;
+        if (answered || response.statusCode != 0 || !connection.isReused() || !replayable) {
             break;
         }
+        MATRIX_LOG(DEBUG, "Kept-alive connection was closed by the server, reconnecting");
+        connection.close();
+        if (rewind && !rewind()) {
+            MATRIX_LOGF(ERROR, "Media upload of %s cannot be repeated", fileName.c_str());
+            readTransportMetrics(metrics, connection, response);
+            recordMetrics(metrics);
+            return "";
+        }
+    }
+    chunk.reset();
+
+    MatrixJsonDocument doc(jsonPool, UPLOAD_CAPACITY, maxMessageLength);
+    bool complete = false;
+    if (answered) {
+        unsigned long bodyStart = micros();
+        complete = readHTTPBody(connection, response, doc.body(), doc.bodyCapacity());
+        metrics.bodyTime = micros() - bodyStart;
+    }
+    readTransportMetrics(metrics, connection, response);
+    connection.release(complete, response.keepAlive);
+
+    MATRIX_LOGF(DEBUG, "Media upload response: %s", doc.body());
+
+    // Parse the response to get the media URL
+    unsigned long parseStart = micros();
+    DeserializationError error = deserializeJson(doc, doc.body());
+    metrics.parseTime = micros() - parseStart;
+    metrics.documentUsage = doc.memoryUsage();
+    recordMetrics(metrics);
+    if (!error) {
+        if (doc.containsKey("content_uri")) {
+            return doc["content_uri"].as<String>();
+        } else {
+            MATRIX_LOG(ERROR, "No content_uri found in response");
+        }
+    } else {
+        MATRIX_LOGF(ERROR, "uploadMedia deserializeJson() failed: %s, responseBody: %s", error.c_str(), doc.body());
     }
-    return responseReceived;
+
+    return "";
 }
 
-String MatrixClient::extractJsonBody(const String& responseBody) {
-    int startIndex = responseBody.indexOf('{');
-    int endIndex = responseBody.lastIndexOf('}');
-    if (startIndex != -1 && endIndex != -1) {
-        return responseBody.substring(startIndex, endIndex + 1);
+bool MatrixClient::downloadMedia(const String& mxcUri, MediaWriter writer, size_t offset, size_t maxSize) {
+    return fetchMedia("download", mxcUri, "", writer, offset, maxSize);
+}
+
+bool MatrixClient::downloadMedia(const String& mxcUri, Print& sink, size_t offset, size_t maxSize) {
+    MediaWriter writer = [&sink](const uint8_t* data, size_t length) {
+        return sink.write(data, length) == length;
+    };
+    return fetchMedia("download", mxcUri, "", writer, offset, maxSize);
+}
+
+bool MatrixClient::downloadThumbnail(const String& mxcUri, int width, int height, MediaWriter writer, bool crop, size_t maxSize) {
+    String query = "?width=" + String(width) + "&height=" + String(height) + (crop ? "&method=crop" : "&method=scale");
+    return fetchMedia("thumbnail", mxcUri, query, writer, 0, maxSize);
+}
+
+bool MatrixClient::downloadThumbnail(const String& mxcUri, int width, int height, Print& sink, bool crop, size_t maxSize) {
+    MediaWriter writer = [&sink](const uint8_t* data, size_t length) {
+        return sink.write(data, length) == length;
+    };
+    return downloadThumbnail(mxcUri, width, height, writer, crop, maxSize);
+}
+
+// Streams the body straight from the connection into the writer, one block
+// at a time. The authenticated media API is tried first; servers without it
+// get the legacy /_matrix/media/v3 endpoints from then on. A server that
+// ignores the Range header sends the whole file, the first offset bytes of
+// which are skipped.
+bool MatrixClient::fetchMedia(const char* kind, const String& mxcUri, const String& query, MediaWriter writer, size_t offset, size_t maxSize) {
+    int slash = mxcUri.indexOf('/', 6);
+    if (!mxcUri.startsWith("mxc://") || slash <= 6 || slash == (int)mxcUri.length() - 1) {
+        MATRIX_LOGF(ERROR, "Not a media URI: %s", mxcUri.c_str());
+        return false;
+    }
+    if (!ensureAccessToken()) {
+        MATRIX_LOG(ERROR, "Cannot download media: failed to ensure access token");
+        return false;
+    }
+
+    String mediaPath = String(kind) + "/" + mxcUri.substring(6) + query;
+    String range = offset > 0 ? "Range: bytes=" + String((unsigned long)offset) + "-\r\n" : "";
+
+    std::lock_guard<std::recursive_mutex> lock(requestMutex);
+    claimConnection();
+
+    HTTPResponse response;
+    MatrixRequestMetrics metrics;
+    while (true) {
+        metrics = MatrixRequestMetrics();
+        metrics.endpoint = ENDPOINT_DOWNLOAD;
+        startHeapMetrics(metrics);
+        String url = homeserverUrl + (legacyMediaApi ? "/_matrix/media/v3/" : "/_matrix/client/v1/media/") + mediaPath;
+        if (!sendHTTPRequest(connection, url, "GET", "", true, response, range)) {
+            readTransportMetrics(metrics, connection, HTTPResponse());
+            recordMetrics(metrics);
+            return false;
+        }
+        if (response.isSuccess()) {
+            break;
+        }
+
+        MatrixJsonDocument doc(jsonPool, ERROR_CAPACITY, maxMessageLength);
+        bool complete = readHTTPBody(connection, response, doc.body(), doc.bodyCapacity());
+        readTransportMetrics(metrics, connection, response);
+        connection.release(complete, response.keepAlive);
+        recordMetrics(metrics);
+
+        StaticJsonDocument<64> filter;
+        filter["errcode"] = true;
+        deserializeJson(doc, doc.body(), DeserializationOption::Filter(filter));
+        if (!legacyMediaApi && (response.statusCode == 404 || response.statusCode == 405) && doc["errcode"] != "M_NOT_FOUND") {
+            MATRIX_LOG(DEBUG, "No authenticated media endpoints, using /_matrix/media/v3");
+            legacyMediaApi = true;
+            continue;
+        }
+        MATRIX_LOGF(ERROR, "Media download of %s failed with status %d: %s", mxcUri.c_str(), response.statusCode, doc.body());
+        return false;
+    }
+
+    bool partial = response.statusCode == 206;
+    size_t position = partial ? offset : 0;
+    if (maxSize > 0 && response.contentLength >= 0 && position + (size_t)response.contentLength > maxSize) {
+        MATRIX_LOGF(ERROR, "Media %s is larger than %lu bytes", mxcUri.c_str(), (unsigned long)maxSize);
+        readTransportMetrics(metrics, connection, HTTPResponse());
+        recordMetrics(metrics);
+        connection.close();
+        return false;
+    }
+
+    // A download cut short counts as a request without a complete response
+    HTTPResponse incomplete;
+    HTTPBodyStream body(connection, response);
+    body.setTimeout(waitForResponse);
+    uint8_t block[MATRIX_HTTP_BUFFER_SIZE];
+    unsigned long bodyStart = micros();
+    while (!body.isComplete()) {
+        size_t count = body.readBody(block, sizeof(block));
+        if (count == 0) {
+            if (body.isComplete()) {
+                break;
+            }
+            MATRIX_LOGF(ERROR, "Media download of %s interrupted after %lu bytes", mxcUri.c_str(), (unsigned long)position);
+            metrics.bodyTime = micros() - bodyStart;
+            readTransportMetrics(metrics, connection, incomplete);
+            recordMetrics(metrics);
+            connection.close();
+            return false;
+        }
+
+        size_t skip = position < offset ? offset - position : 0;
+        if (skip > count) {
+            skip = count;
+        }
+        position += count;
+        if (maxSize > 0 && position > maxSize) {
+            MATRIX_LOGF(ERROR, "Media %s is larger than %lu bytes", mxcUri.c_str(), (unsigned long)maxSize);
+            readTransportMetrics(metrics, connection, incomplete);
+            recordMetrics(metrics);
+            connection.close();
+            return false;
+        }
+        if (count > skip && !writer(block + skip, count - skip)) {
+            MATRIX_LOGF(ERROR, "Media download of %s aborted by the sink", mxcUri.c_str());
+            readTransportMetrics(metrics, connection, incomplete);
+            recordMetrics(metrics);
+            connection.close();
+            return false;
+        }
     }
+    metrics.bodyTime = micros() - bodyStart;
+    readTransportMetrics(metrics, connection, response);
+    connection.release(true, response.keepAlive);
+    recordMetrics(metrics);
+
+    MATRIX_LOGF(DEBUG, "Downloaded %lu bytes of %s", (unsigned long)(position > offset ? position - offset : 0), mxcUri.c_str());
+    return true;
+}
+
+String MatrixClient::performHTTPRequest(const String& url, const String& method, const String& payload, bool useAuth) {
+    String responseBody;
+    HTTPResponse response;
+    performHTTPRequest(url, method, payload, useAuth, response, responseBody);
     return responseBody;
 }
 
-bool MatrixClient::extractNextBatch(const String& responseBody) {
-    int index = responseBody.indexOf("\"next_batch\":\"");
-    if (index != -1) {
-        int start = index + 14; // Length of "\"next_batch\":\""
-        int end = responseBody.indexOf("\"", start);
-        if (end != -1) {
-            syncToken = responseBody.substring(start, end);
+bool MatrixClient::performHTTPRequest(const String& url, const String& method, const String& payload, bool useAuth, HTTPResponse& response, String& responseBody) {
+    MatrixRequestMetrics metrics;
+    MatrixJsonDocument received(jsonPool, 0, maxMessageLength);
+    bool answered = exchangeHTTP(url, method, payload, useAuth, response, received.body(), received.bodyCapacity(), metrics);
+    recordMetrics(metrics);
+    responseBody = received.body();
+    return answered;
+}
+
+// Reads the response body into the arena of doc and parses it there, so the
+// strings of the document point into the body instead of being copied. A
+// request that got no response leaves response.statusCode at 0.
+DeserializationError MatrixClient::performJsonRequest(const String& url, const String& method, const String& payload, MatrixJsonDocument& doc, bool useAuth, HTTPResponse* response, const JsonDocument* filter) {
+    MatrixRequestMetrics metrics;
+    HTTPResponse localResponse;
+    exchangeHTTP(url, method, payload, useAuth, response ? *response : localResponse, doc.body(), doc.bodyCapacity(), metrics);
+
+    unsigned long parseStart = micros();
+    DeserializationError error = filter ? deserializeJson(doc, doc.body(), DeserializationOption::Filter(*filter))
+                                        : deserializeJson(doc, doc.body());
+    metrics.parseTime = micros() - parseStart;
+    metrics.documentUsage = doc.memoryUsage();
+    recordMetrics(metrics);
+    return error;
+}
+
+bool MatrixClient::exchangeHTTP(const String& url, const String& method, const String& payload, bool useAuth, HTTPResponse& response, char* responseBody, size_t capacity, MatrixRequestMetrics& metrics) {
+    metrics.endpoint = endpointOf(url);
+    startHeapMetrics(metrics);
+
+    std::lock_guard<std::recursive_mutex> lock(requestMutex);
+    claimConnection();
+
+    if (!sendHTTPRequest(connection, url, method, payload, useAuth, response, acceptEncodingHeader())) {
+        response.statusCode = 0;
+        readTransportMetrics(metrics, connection, response);
+        return false;
+    }
+
+    unsigned long bodyStart = micros();
+    bool complete = readHTTPBody(connection, response, responseBody, capacity);
+    metrics.bodyTime = micros() - bodyStart;
+    readTransportMetrics(metrics, connection, response);
+    connection.release(complete, response.keepAlive);
+
+    MATRIX_LOGF(DEBUG, "HTTP %s request to %s completed with status %d and response: %s", method.c_str(), url.c_str(), response.statusCode, responseBody);
+
+    return true;
+}
+
+bool MatrixClient::sendHTTPRequest(HTTPConnection& link, const String& url, const String& method, const String& payload, bool useAuth, HTTPResponse& response, const String& extraHeaders) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!writeHTTPRequest(link, url, method, payload, useAuth, extraHeaders)) {
+            return false;
+        }
+
+        if (link.readResponseHeaders(response, syncTimeout + waitForResponse)) {
             return true;
         }
+        if (response.statusCode != 0 || !link.isReused()) {
+            break;
+        }
+        // The server dropped the idle connection just as we reused it
+        MATRIX_LOG(DEBUG, "Kept-alive connection was closed by the server, reconnecting");
+        link.close();
     }
+
+    MATRIX_LOGF(ERROR, "No response to %s %s", method.c_str(), url.c_str());
+    link.release(false, true);
     return false;
 }
 
-void MatrixClient::storeEvent(const MatrixEvent& event) {
-    recentEvents.push_back(event);
+bool MatrixClient::writeHTTPRequest(HTTPConnection& link, const String& url, const String& method, const String& payload, bool useAuth, const String& extraHeaders) {
+    bool hasBody = method != "GET";
+    if (!writeHTTPHeaders(link, url, method, "application/json", hasBody ? (long)payload.length() : -1, useAuth, extraHeaders)) {
+        return false;
+    }
+    if (!link.flushRequest((const uint8_t*)payload.c_str(), hasBody ? payload.length() : 0)) {
+        MATRIX_LOGF(ERROR, "Writing the %s request failed", method.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Connects and assembles the request line and headers in the request buffer
+// of the connection. The caller sends them with flushRequest(), along with
+// the contentLength bytes of the body; a negative contentLength sends no
+// body. extraHeaders are complete lines, each ending in CRLF.
+bool MatrixClient::writeHTTPHeaders(HTTPConnection& link, const String& url, const String& method, const String& contentType, long contentLength, bool useAuth, const String& extraHeaders) {
+    const int httpsPort = 443;
+
+    const char* host = strstr(url.c_str(), "://");
+    const char* path = host ? strchr(host + 3, '/') : nullptr;
+    if (!path) {
+        MATRIX_LOG(ERROR, "Invalid URL");
+        return false;
+    }
+    host += 3;
+    size_t hostLength = path - host;
+
+    if (!link.connect(host, hostLength, httpsPort, keepAlive)) {
+        MATRIX_LOGF(ERROR, "Connection to %.*s failed", (int)hostLength, host);
+        return false;
+    }
+
+    link.beginRequest();
+    return appendHTTPHeaders(link, url, method, contentType, contentLength, useAuth, extraHeaders);
+}
+
+// Appends the request line and headers behind whatever the request buffer
+// already holds, without connecting; pipelined requests follow the first one
+// this way.
+bool MatrixClient::appendHTTPHeaders(HTTPConnection& link, const String& url, const String& method, const String& contentType, long contentLength, bool useAuth, const String& extraHeaders) {
+    const char* host = strstr(url.c_str(), "://");
+    const char* path = host ? strchr(host + 3, '/') : nullptr;
+    if (!path) {
+        MATRIX_LOG(ERROR, "Invalid URL");
+        return false;
+    }
+    host += 3;
+
+    link.append(method);
+    link.append(" ");
+    link.append(path);
+    link.append(" HTTP/1.1\r\nHost: ");
+    link.append(host, path - host);
+    link.append("\r\nUser-Agent: ESP32\r\n");
+    link.append(link.keepAliveActive() ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+    link.append("Content-Type: ");
+    link.append(contentType);
+    if (useAuth) {
+        link.append("\r\nAuthorization: Bearer ");
+        link.append(accessToken);
+    }
+    if (contentLength >= 0) {
+        link.append("\r\nContent-Length: ");
+        link.appendNumber(contentLength);
+    }
+    link.append("\r\n");
+    link.append(extraHeaders);
+    link.append("\r\n");
+    return true;
+}
+
+// Media downloads go without, their bodies are already compressed.
+const String& MatrixClient::acceptEncodingHeader() const {
+    static const String accept = "Accept-Encoding: gzip, deflate\r\n";
+    static const String none;
+    return compressResponses ? accept : none;
+}
+
+// With a single client an outstanding long-poll occupies the connection. It
+// is dropped in favour of the new request; the sync token is unchanged, so
+// the next beginSync() picks up the same events.
+void MatrixClient::claimConnection() {
+    if (syncPending && syncConnection == &connection) {
+        MATRIX_LOG(DEBUG, "Cancelling the pending sync to send a request");
+        cancelSync();
+    }
+}
+
+// Reads the body as framed by the response headers into body, which has room
+// for capacity bytes and the terminator. Longer bodies are cut to that length
+// but still read to the end, so the connection stays usable for the next
+// request.
+bool MatrixClient::readHTTPBody(HTTPConnection& link, const HTTPResponse& response, char* body, size_t capacity) {
+    HTTPBodyStream framed(link, response);
+    framed.setTimeout(waitForResponse);
+    HTTPInflateStream stream(framed, link, response);
+
+    size_t length = 0;
+    bool truncated = false;
+    while (true) {
+        size_t count;
+        if (length < capacity) {
+            count = stream.readBody((uint8_t*)body + length, capacity - length);
+            length += count;
+        } else {
+            uint8_t rest[128];
+            count = stream.readBody(rest, sizeof(rest));
+            truncated = truncated || count > 0;
+        }
+        if (count == 0) {
+            break;
+        }
+    }
+    body[length] = '\0';
+
+    if (truncated) {
+        MATRIX_LOGF(ERROR, "Response body exceeds maxMessageLength and was cut to %u bytes", (unsigned)capacity);
+    }
+    if (stream.isCompressed() && stream.hasFailed() && !framed.hasFailed()) {
+        MATRIX_LOGF(ERROR, "Compressed response body could not be decoded after %lu bytes", framed.bytesRead());
+    } else if (stream.hasFailed()) {
+        MATRIX_LOGF(ERROR, "Response body incomplete after %lu bytes", framed.bytesRead());
+    }
+    return stream.drain();
+}
+
+HTTPConnectionStats MatrixClient::getConnectionStats() const {
+    HTTPConnectionStats stats = connection.getStats();
+    if (syncConnection != &connection) {
+        const HTTPConnectionStats& syncStats = syncConnection->getStats();
+        stats.requests += syncStats.requests;
+        stats.handshakes += syncStats.handshakes;
+        stats.reused += syncStats.reused;
+        stats.serverClosed += syncStats.serverClosed;
+        stats.fallbacks += syncStats.fallbacks;
+        stats.writes += syncStats.writes;
+    }
+    return stats;
+}
+
+MatrixMetrics MatrixClient::getMetrics() const {
+    std::lock_guard<std::mutex> lock(metricsMutex);
+    MatrixMetrics metrics = metricTotals;
+    metrics.jsonPoolMisses = jsonPool.getMisses();
+    metrics.syncOverflows = syncOverflows;
+    return metrics;
+}
+
+void MatrixClient::resetMetrics() {
+    std::lock_guard<std::mutex> lock(metricsMutex);
+    metricTotals = MatrixMetrics();
+}
+
+void MatrixClient::setMetricsCallback(MetricsCallback callback) {
+    metricsCallback = callback;
+}
+
+// Must be called while the request still owns the connection.
+void MatrixClient::readTransportMetrics(MatrixRequestMetrics& metrics, const HTTPConnection& link, const HTTPResponse& response) {
+    const HTTPRequestTiming& timing = link.getRequestTiming();
+    metrics.statusCode = response.statusCode;
+    metrics.reused = timing.reused;
+    metrics.connectTime = timing.connectTime;
+    metrics.firstByteTime = timing.firstByteTime;
+    metrics.bytesOut = timing.bytesOut;
+    metrics.bytesIn = timing.bytesIn;
+    metrics.bytesInflated = timing.bytesInflated;
+    metrics.inflateTime = timing.inflateTime;
+    sampleHeapMetrics(metrics);
+}
+
+void MatrixClient::recordMetrics(MatrixRequestMetrics& metrics) {
+    sampleHeapMetrics(metrics);
+    {
+        std::lock_guard<std::mutex> lock(metricsMutex);
+        MatrixEndpointMetrics& totals = metricTotals.endpoints[metrics.endpoint];
+        totals.requests++;
+        if (metrics.statusCode < 200 || metrics.statusCode >= 300) {
+            totals.failures++;
+        }
+        if (metrics.reused) {
+            totals.reused++;
+        }
+        totals.connectTime += metrics.connectTime;
+        totals.firstByteTime += metrics.firstByteTime;
+        totals.bodyTime += metrics.bodyTime;
+        totals.parseTime += metrics.parseTime;
+        totals.bytesOut += metrics.bytesOut;
+        totals.bytesIn += metrics.bytesIn;
+        totals.bytesInflated += metrics.bytesInflated;
+        totals.inflateTime += metrics.inflateTime;
+        if (metrics.documentUsage > totals.maxDocumentUsage) {
+            totals.maxDocumentUsage = metrics.documentUsage;
+        }
+        if (metricTotals.minFreeHeap == 0 || metrics.minFreeHeap < metricTotals.minFreeHeap) {
+            metricTotals.minFreeHeap = metrics.minFreeHeap;
+        }
+    }
+    if (metricsCallback) {
+        metricsCallback(metrics);
+    }
+}
+
+// Must be called with eventMutex held. Returns the slot for a new event with
+// its fields emptied but their buffers kept, or nullptr when the event has to
+// be dropped. Under EVENTS_BACKPRESSURE a full buffer loses nothing, the
+// caller stops and the event is fetched again.
+MatrixEvent* MatrixClient::storeEvent() {
+    if (eventOverflowPolicy == EVENTS_BACKPRESSURE && eventBuffer.full()) {
+        return nullptr;
+    }
+    receivedEvents++;
+    if (eventBuffer.full()) {
+        droppedEvents++;
+    }
+    MatrixEvent* event = eventBuffer.push(eventOverflowPolicy == EVENTS_DROP_OLDEST);
+    if (event) {
+        event->eventId = "";
+        event->sender = "";
+        event->messageContent = "";
+        event->room = INVALID_ROOM;
+        event->eventType = EVENT_MESSAGE;
+        event->messageType = MESSAGE_NONE;
+    }
+    return event;
+}
+
+// Updates the cached state of a room from a state event, either from the
+// room's state, its timeline or the stripped state of an invite.
+void MatrixClient::applyStateEvent(MatrixRoom& room, JsonObject event) {
+    const char* type = event["type"] | "";
+    if (strcmp(type, "m.room.name") == 0) {
+        room.name = event["content"]["name"] | "";
+    } else if (strcmp(type, "m.room.topic") == 0) {
+        room.topic = event["content"]["topic"] | "";
+    } else if (strcmp(type, "m.room.encryption") == 0) {
+        room.encrypted = true; // encryption cannot be turned off again
+    } else if (strcmp(type, "m.room.member") == 0 && syncConfig.userId == (event["state_key"] | "")) {
+        const char* membership = event["content"]["membership"] | "";
+        if (strcmp(membership, "join") == 0) {
+            room.membership = MEMBERSHIP_JOINED;
+        } else if (strcmp(membership, "invite") == 0) {
+            room.membership = MEMBERSHIP_INVITED;
+        } else if (strcmp(membership, "leave") == 0 || strcmp(membership, "ban") == 0) {
+            room.membership = MEMBERSHIP_LEFT;
+        }
+    }
+}
+
+// FNV-1a, used to place room IDs in the room index.
+static uint32_t hashRoomId(const char* roomId) {
+    uint32_t hash = 2166136261u;
+    while (*roomId) {
+        hash ^= (uint8_t)*roomId++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// The room index is an open-addressing hash table of room handles, kept at
+// most half full so lookups by room ID take constant time.
+MatrixRoomHandle MatrixClient::lookupRoom(const char* roomId, size_t& slot) const {
+    if (roomIndex.empty()) {
+        return INVALID_ROOM;
+    }
+    size_t mask = roomIndex.size() - 1;
+    slot = hashRoomId(roomId) & mask;
+    while (roomIndex[slot] != INVALID_ROOM) {
+        if (rooms[roomIndex[slot]].roomId == roomId) {
+            return roomIndex[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    return INVALID_ROOM;
+}
+
+// Returns the handle of the room, adding it to the table when it is new.
+MatrixRoomHandle MatrixClient::internRoom(const char* roomId) {
+    size_t slot = 0;
+    MatrixRoomHandle handle = lookupRoom(roomId, slot);
+    if (handle != INVALID_ROOM) {
+        return handle;
+    }
+    if (rooms.size() >= INVALID_ROOM - 1) {
+        return INVALID_ROOM;
+    }
+
+    rooms.emplace_back();
+    rooms.back().roomId = roomId;
+    handle = (MatrixRoomHandle)(rooms.size() - 1);
+
+    if (rooms.size() * 2 > roomIndex.size()) {
+        roomIndex.assign(roomIndex.empty() ? 16 : roomIndex.size() * 2, INVALID_ROOM);
+        for (size_t i = 0; i < rooms.size(); i++) {
+            lookupRoom(rooms[i].roomId.c_str(), slot);
+            roomIndex[slot] = (MatrixRoomHandle)i;
+        }
+    } else {
+        roomIndex[slot] = handle;
+    }
+    return handle;
+}
+
+// The room table is updated by sync, so when the sync task is running read
+// it from within consumeEvents().
+const MatrixRoom* MatrixClient::getRoom(MatrixRoomHandle room) const {
+    return room < rooms.size() ? &rooms[room] : nullptr;
+}
+
+MatrixRoomHandle MatrixClient::findRoom(const String& roomId) const {
+    size_t slot = 0;
+    return lookupRoom(roomId.c_str(), slot);
+}
+
+size_t MatrixClient::getRoomCount() const {
+    return rooms.size();
 }
 
+// Copies every buffered event; consumeEvents() avoids the copies.
 std::vector<MatrixEvent> MatrixClient::getRecentEvents() {
-    std::vector<MatrixEvent> events = recentEvents;
-    recentEvents.clear();
+    std::lock_guard<std::mutex> lock(eventMutex);
+    std::vector<MatrixEvent> events;
+    events.reserve(eventBuffer.size());
+    eventBuffer.consume([&events](const MatrixEvent& event) {
+        events.push_back(event);
+    });
     return events;
 }
+
+// Hands buffered events to visitor without copying them, oldest first. The
+// event is only valid during the call.
+size_t MatrixClient::consumeEvents(EventVisitor visitor, size_t maxEvents) {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    return eventBuffer.consume(visitor, maxEvents);
+}
+
+size_t MatrixClient::pendingEvents() {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    return eventBuffer.size();
+}
+
+unsigned long MatrixClient::getDroppedEvents() const {
+    return droppedEvents;
+}
+
+unsigned long MatrixClient::getDuplicateEvents() const {
+    return duplicateEvents;
+}
+
+// A sync repeated under EVENTS_BACKPRESSURE brings back up to a full buffer
+// of events already delivered, so the event index grows along unless it was
+// turned off. Without a buffer such a sync would be repeated forever.
+void MatrixClient::setEventBufferSize(size_t capacity) {
+    if (capacity == 0) {
+        MATRIX_LOG(ERROR, "The event buffer needs room for at least one event");
+        return;
+    }
+    std::lock_guard<std::mutex> lock(eventMutex);
+    eventBuffer.setCapacity(capacity);
+    if (recentEventIds.capacity() > 0 && recentEventIds.capacity() < capacity) {
+        recentEventIds.setCapacity(capacity);
+    }
+}
+
+void MatrixClient::setEventIndexSize(size_t capacity) {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    recentEventIds.setCapacity(capacity);
+}
+
+size_t MatrixClient::pendingTimelineGaps() {
+    std::lock_guard<std::mutex> lock(eventMutex);
+    return timelineGaps.size();
+}
@@ -1,22 +1,130 @@
 #ifndef MATRIX_CLIENT_H
 #define MATRIX_CLIENT_H
 
+#include <atomic>
+#include <deque>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <Client.h>
 #include <vector>
+#include "MatrixEventIndex.h"
+#include "MatrixHTTP.h"
+#include "MatrixJsonPool.h"
+#include "MatrixRingBuffer.h"
+#include "MatrixSessionStore.h"
+#include <time.h>
+
+#ifdef ESP_PLATFORM
+#include <esp_pthread.h>
+#endif
+
+enum MatrixEventType : uint8_t {
+    EVENT_MESSAGE,
+    EVENT_INVITATION
+};
+
+enum MatrixMessageType : uint8_t {
+    MESSAGE_NONE, // Not a message, e.g. an invitation
+    MESSAGE_TEXT,
+    MESSAGE_NOTICE,
+    MESSAGE_EMOTE,
+    MESSAGE_IMAGE,
+    MESSAGE_FILE,
+    MESSAGE_AUDIO,
+    MESSAGE_VIDEO,
+    MESSAGE_LOCATION,
+    MESSAGE_OTHER
+};
+
+typedef uint16_t MatrixRoomHandle; // Index into the client's room table
+const MatrixRoomHandle INVALID_ROOM = 0xFFFF;
+
+enum MatrixMembership : uint8_t {
+    MEMBERSHIP_NONE,
+    MEMBERSHIP_JOINED,
+    MEMBERSHIP_INVITED,
+    MEMBERSHIP_LEFT // Left, kicked or banned
+};
+
+// Metadata shared by all events of a room, stored once per room and kept up
+// to date from the state events of every sync.
+struct MatrixRoom {
+    String roomId;
+    String name;
+    String topic;
+    bool encrypted = false;
+    MatrixMembership membership = MEMBERSHIP_NONE; // Of the logged in user
+    int memberCount = 0; // Joined members, as reported by the room summary
+};
 
 struct MatrixEvent {
     String eventId;
-    String eventType;
     String sender;
-    String roomId;
-    String roomName;
-    String roomTopic;
-    bool roomEncryption = false;
-    String messageType;
     String messageContent;
+    MatrixRoomHandle room = INVALID_ROOM; // Resolve with MatrixClient::getRoom()
+    MatrixEventType eventType = EVENT_MESSAGE;
+    MatrixMessageType messageType = MESSAGE_NONE;
+};
+
+const char* matrixEventTypeName(MatrixEventType type);
+const char* matrixMessageTypeName(MatrixMessageType type); // The msgtype, e.g. "m.text"
+MatrixMessageType matrixMessageType(const char* msgtype);
+
+// Server-side sync filter, uploaded once and referenced by ID on every sync.
+// Presence, account data and ephemeral events are always left out.
+struct MatrixSyncFilter {
+    bool enabled = true;
+    std::vector<String> timelineTypes = {"m.room.message"};
+    int timelineLimit = 10;
+    std::vector<String> stateTypes = {"m.room.name", "m.room.topic", "m.room.encryption", "m.room.member"}; // Empty leaves room state out of the sync entirely
+    std::vector<String> eventFields = {
+        "type", "event_id", "sender", "state_key", "content.msgtype", "content.body", "content.name", "content.topic", "content.membership"
+    };
+};
+
+// Simplified sliding sync (MSC4186): only the windowSize most recently active
+// rooms are synced, so the cost of a sync depends on the window rather than on
+// the number of rooms of the account.
+struct MatrixSlidingSync {
+    bool enabled = false;
+    int windowSize = 10;
+    int timelineLimit = 10;
+    std::vector<String> requiredState = {"m.room.name", "m.room.topic", "m.room.encryption", "m.room.member"}; // m.room.member only for the logged in user
+};
+
+// Adapts the long-poll timeout of /sync and the pause between syncs to recent
+// activity. While events are flowing the next sync goes out right away; every
+// sync that comes back empty lengthens the long-poll, which costs no latency
+// as the server answers as soon as something happens, and the pause, which
+// does. Long-polls the network drops before the server answers lower the
+// timeout again. Replaces syncTimeout when enabled.
+struct MatrixSyncSchedule {
+    bool enabled = false;
+    unsigned long activeTimeout = 5000;  // Long-poll timeout after events arrived
+    unsigned long idleTimeout = 30000;   // Longest long-poll timeout, fewer requests and radio wake-ups while idle
+    unsigned long latencyTarget = 0;     // Longest pause between syncs while idle, what a new event may be delayed by; 0 never pauses
+};
+
+// The current choice of the sync schedule and what it costs.
+struct MatrixSyncPlan {
+    unsigned long timeout = 0;        // Long-poll timeout of the next sync
+    unsigned long pause = 0;          // Before the next sync, see getSyncDelay()
+    unsigned long timeoutCeiling = 0; // Below idleTimeout when the network dropped longer long-polls
+    unsigned long requestsPerHour = 0; // While nothing happens
+    unsigned int quietSyncs = 0;      // In a row without events
+};
+
+// Describes an uploaded file in its m.room.message event. The mimetype and
+// size are filled in from the upload.
+struct MatrixMediaInfo {
+    String msgType = "m.image"; // m.image, m.file, m.audio or m.video
+    int width = 0;              // Pixels, images and videos only; 0 leaves it out
+    int height = 0;
+    unsigned long duration = 0; // Milliseconds, audio and video only; 0 leaves it out
 };
 
 enum LogLevel {
@@ -26,49 +134,382 @@ enum LogLevel {
 };
 typedef void (*LoggerFunction)(LogLevel, const String& message);
 
+#ifndef MATRIX_LOG_LEVEL
+#define MATRIX_LOG_LEVEL DEBUG // Messages above this level are compiled out, e.g. -DMATRIX_LOG_LEVEL=INFO
+#endif
+
+enum EventOverflowPolicy {
+    EVENTS_DROP_OLDEST, // Overwrite the oldest unconsumed event
+    EVENTS_DROP_NEWEST, // Discard events that do not fit
+    EVENTS_BACKPRESSURE // Hold back syncs until there is room for a full timeline, repeat one that did not fit
+};
+
+enum SendStatus {
+    SEND_DELIVERED, // Accepted by the server
+    SEND_REJECTED,  // Refused by the server, retrying would not help
+    SEND_GAVE_UP    // Still failing after maxSendRetries retries
+};
+
+enum SyncStatus {
+    SYNC_IDLE,      // No sync request outstanding
+    SYNC_PENDING,   // Waiting for the server to answer
+    SYNC_COMPLETED, // The response was processed, new events are available
+    SYNC_FAILED
+};
+
+enum MatrixEndpoint : uint8_t {
+    ENDPOINT_LOGIN,
+    ENDPOINT_REFRESH,
+    ENDPOINT_SYNC,
+    ENDPOINT_SEND,     // Message and media events
+    ENDPOINT_UPLOAD,
+    ENDPOINT_DOWNLOAD, // Media and thumbnails
+    ENDPOINT_OTHER,
+    ENDPOINT_COUNT
+};
+
+const char* matrixEndpointName(MatrixEndpoint endpoint);
+
+// Measurements of a single request, times in microseconds.
+struct MatrixRequestMetrics {
+    MatrixEndpoint endpoint = ENDPOINT_OTHER;
+    int statusCode = 0;              // 0 when no complete response arrived
+    bool reused = false;             // Went out on a kept-alive connection
+    unsigned long connectTime = 0;   // TCP and TLS handshake, 0 when reused
+    unsigned long firstByteTime = 0; // From the end of the request to the end of the response headers
+    unsigned long bodyTime = 0;      // Sync responses are parsed while they are read, so this includes parseTime
+    unsigned long parseTime = 0;     // deserializeJson()
+    size_t bytesOut = 0;
+    size_t bytesIn = 0;              // Headers included
+    size_t bytesInflated = 0;        // Decoded size of a compressed body, 0 when it was not compressed
+    unsigned long inflateTime = 0;   // Decoding a compressed body, part of bodyTime
+    size_t documentUsage = 0;        // memoryUsage() of the parsed JSON document
+    uint32_t minFreeHeap = 0;        // Lowest free heap during the request: exact when it was a new low since boot, else the lower of the start and the end
+    uint32_t minFreeHeapBefore = 0;  // ESP.getMinFreeHeap() when the request started
+};
+
+// Totals per endpoint since the last resetMetrics(); divide by requests for
+// the averages.
+struct MatrixEndpointMetrics {
+    unsigned long requests = 0;
+    unsigned long failures = 0; // No complete response or a status other than 2xx
+    unsigned long reused = 0;
+    uint64_t connectTime = 0;
+    uint64_t firstByteTime = 0;
+    uint64_t bodyTime = 0;
+    uint64_t parseTime = 0;
+    uint64_t bytesOut = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesInflated = 0;
+    uint64_t inflateTime = 0;
+    size_t maxDocumentUsage = 0;
+};
+
+struct MatrixMetrics {
+    MatrixEndpointMetrics endpoints[ENDPOINT_COUNT];
+    uint32_t minFreeHeap = 0; // Low watermark over all requests, 0 before the first one
+    unsigned long jsonPoolMisses = 0; // Responses that found no free arena and were parsed on the heap, not cleared by resetMetrics()
+    unsigned long syncOverflows = 0; // Sync responses too large for the sync document, not cleared by resetMetrics()
+};
+
 class MatrixClient {
 public:
     using LoggerFunction = std::function<void(LogLevel, const String&)>;
+    using EventVisitor = std::function<void(const MatrixEvent& event)>;
+    using SendCallback = std::function<void(uint32_t messageId, SendStatus status, const String& eventId)>;
+    using MediaReader = std::function<size_t(uint8_t* buffer, size_t length)>; // Fills buffer with the next bytes of the file, 0 on error
+    using UploadProgressCallback = std::function<void(size_t sent, size_t total)>;
+    using MediaWriter = std::function<bool(const uint8_t* data, size_t length)>; // Receives the next bytes of a download, false aborts it
+    using MetricsCallback = std::function<void(const MatrixRequestMetrics& metrics)>;
     MatrixClient(Client& client, LoggerFunction logger = nullptr);
+    MatrixClient(Client& client, Client& syncClient, LoggerFunction logger = nullptr); // Long-polls on syncClient
+    ~MatrixClient();
     bool login(const String& matrixUser, const String& matrixPassword, const String& defaultServerHost);
     void setMasterUserId(const String& userId);
+    void setSessionStore(MatrixSessionStore* store); // login() resumes the stored session when there is one
+    bool saveSession();
     bool sendDMToMaster(const String& message, const String& msgType = "m.text");
     bool sync();
+    bool beginSync();
+    SyncStatus poll();
+    bool isSyncPending() const;
+    bool isLoggedIn() const;
+    bool startSyncTask();
+    void stopSyncTask();
     bool createRoom(const String& userId, String& roomId);
     bool joinRoom(const String& roomId);
     bool sendReadReceipt(const String& roomId, const String& eventId);
-    bool sendMessageToRoom(const String& roomId, const String& message, const String& msgType = "m.text");
-    bool sendMediaToRoom(const String& roomId, const String& fileName, const String& contentType, const uint8_t* fileData, size_t fileSize);
+    void markRead(const String& roomId, const String& eventId); // Sent with the next sync, only the latest event of each room
+    size_t flushReadMarkers(); // Sends the pending read markers now, returns the number of rooms still pending
+    bool sendMessageToRoom(const String& roomId, const String& message, const String& msgType = "m.text", const String& transactionId = ""); // Retrying with the same transactionId never posts twice
+    bool sendMediaToRoom(const String& roomId, const String& fileName, const String& contentType, const uint8_t* fileData, size_t fileSize, const MatrixMediaInfo& info = MatrixMediaInfo(), const String& transactionId = "");
+    bool sendMediaToRoom(const String& roomId, const String& fileName, const String& contentType, Stream& source, size_t fileSize, const MatrixMediaInfo& info = MatrixMediaInfo(), const String& transactionId = "");
+    bool sendMediaToRoom(const String& roomId, const String& fileName, const String& contentType, MediaReader reader, size_t fileSize, const MatrixMediaInfo& info = MatrixMediaInfo(), const String& transactionId = "");
+    String newTransactionId(); // Unique across restarts: device ID, a random boot nonce and a counter
+    String uploadMedia(const String& fileName, const String& contentType, const uint8_t* fileData, size_t fileSize); // Returns the mxc:// URI, empty on failure
+    String uploadMedia(const String& fileName, const String& contentType, Stream& source, size_t fileSize);
+    String uploadMedia(const String& fileName, const String& contentType, MediaReader reader, size_t fileSize);
+    void setUploadProgressCallback(UploadProgressCallback callback);
+    bool downloadMedia(const String& mxcUri, MediaWriter writer, size_t offset = 0, size_t maxSize = 0); // Resumes at offset, fails beyond maxSize bytes (0 for no limit)
+    bool downloadMedia(const String& mxcUri, Print& sink, size_t offset = 0, size_t maxSize = 0);
+    bool downloadThumbnail(const String& mxcUri, int width, int height, MediaWriter writer, bool crop = false, size_t maxSize = 0);
+    bool downloadThumbnail(const String& mxcUri, int width, int height, Print& sink, bool crop = false, size_t maxSize = 0);
+    uint32_t queueMessage(const String& roomId, const String& message, const String& msgType = "m.text");
+    uint32_t queueMedia(const String& roomId, const String& fileName, const String& contentType, const uint8_t* fileData, size_t fileSize, const MatrixMediaInfo& info = MatrixMediaInfo()); // fileData must stay valid until sent
+    uint32_t queueReadReceipt(const String& roomId, const String& eventId);
+    size_t processQueue();
+    size_t queuedMessages();
+    void setSendCallback(SendCallback callback);
     std::vector<MatrixEvent> getRecentEvents();
+    size_t consumeEvents(EventVisitor visitor, size_t maxEvents = (size_t)-1);
+    size_t pendingEvents();
+    unsigned long getDroppedEvents() const;
+    unsigned long getDuplicateEvents() const; // Events received again and not delivered a second time
+    void setEventBufferSize(size_t capacity); // At least 1, drops buffered events; grows the event index to match
+    void setEventIndexSize(size_t capacity); // Recent event IDs remembered to recognise duplicates, 0 turns it off; forgets the current ones
+    size_t pendingTimelineGaps();
+    const MatrixRoom* getRoom(MatrixRoomHandle room) const;
+    MatrixRoomHandle findRoom(const String& roomId) const;
+    size_t getRoomCount() const;
+    HTTPConnectionStats getConnectionStats() const;
+    MatrixMetrics getMetrics() const;
+    void resetMetrics();
+    void setMetricsCallback(MetricsCallback callback); // Called after every request, on the thread that made it
+    void setSyncFilter(const MatrixSyncFilter& filter);
+    void setSlidingSync(const MatrixSlidingSync& config); // Replaces /v3/sync when enabled
+    const MatrixSlidingSync& getSlidingSync() const;
+    void setSyncSchedule(const MatrixSyncSchedule& schedule);
+    const MatrixSyncSchedule& getSyncSchedule() const;
+    MatrixSyncPlan getSyncPlan();
+    unsigned long getSyncDelay(); // Pause the sync schedule asks for before the next sync, 0 when it is disabled
+    const MatrixSyncFilter& getSyncFilter() const;
+    String getSyncFilterId() const;
 
     int syncTimeout = 5000; // The maximum time to wait, in milliseconds, before server responds to the sync request.
     unsigned int waitForResponse = 1000;
     int maxMessageLength = 1500;
+    int syncDocumentSize = 8192; // Capacity of the JSON document holding the filtered sync response
+    int maxSyncDocumentSize = 32768; // The sync document grows up to this size when a response does not fit
+    unsigned long sessionSaveInterval = 60000; // Minimum time between saves of the sync token
+    bool keepAlive = true; // Reuse the connection between requests instead of reconnecting every time
+    int pipelineDepth = 1; // Queued messages written back to back before their responses are read, 1 sends one at a time
+    unsigned long readMarkerDelay = 0; // Minimum time read markers are collected before a sync sends them, 0 sends them with every sync
+    bool backfillGaps = false; // Fetch the messages a limited /v3/sync timeline left out through /messages
+    int backfillPageSize = 10; // Messages per /messages request
+    int backfillPagesPerSync = 1; // /messages requests made before each sync while gaps are open
+    bool compressResponses = false; // Ask for gzip or deflate compressed responses; each connection then keeps a window of MATRIX_INFLATE_WINDOW_SIZE bytes
+    EventOverflowPolicy eventOverflowPolicy = EVENTS_DROP_OLDEST;
+    int maxQueuedMessages = 16; // Capacity of the outbound queue
+    int maxSendRetries = 5; // Retries of a queued message after transient errors
+    unsigned long sendRetryDelay = 1000; // First retry delay in milliseconds, doubled on every retry
+    bool coalesceMessages = false; // Join queued messages to the same room into one event
+    size_t uploadChunkSize = 4096; // Bytes per write of an upload, best matched to the TLS record size (MBEDTLS_SSL_OUT_CONTENT_LEN)
+    uint32_t syncTaskStackSize = 8192; // Stack of the thread started by startSyncTask(), ESP32 only
+
+    static LogLevel logLevel; // Global log level setting, applies to custom loggers too
 
-    static LogLevel logLevel; // Global log level setting
+    static bool logEnabled(LogLevel level) {
+        return level <= MATRIX_LOG_LEVEL && level <= logLevel;
+    }
 
 private:
+    friend class MatrixClientPool;
+
+    enum OutboundKind {
+        OUTBOUND_MESSAGE,
+        OUTBOUND_MEDIA,
+        OUTBOUND_RECEIPT
+    };
+
+    enum OutboundResult {
+        OUTBOUND_DELIVERED,
+        OUTBOUND_REJECTED,
+        OUTBOUND_RETRY
+    };
+
+    // Messages a limited sync timeline left out, between the end of the
+    // previous sync and the start of the timeline.
+    struct TimelineGap {
+        MatrixRoomHandle room;
+        String from; // Advances as the gap is filled
+        String to;   // prev_batch of the limited timeline
+    };
+
+    // Taken by beginSync() under requestMutex; the response is read with this
+    // copy, so setters called from other threads meanwhile do not interfere.
+    struct SyncConfig {
+        bool sliding = false;
+        int timelineLimit = 0;
+        bool backfillGaps = false;
+        String userId;
+        String masterUserId;
+    };
+
+    struct ReadMarker {
+        String roomId;
+        String eventId;
+    };
+
+    struct OutboundOutcome {
+        OutboundResult result = OUTBOUND_RETRY;
+        unsigned long retryAfter = 0;
+        String eventId;
+    };
+
+    struct OutboundMessage {
+        OutboundKind kind;
+        String roomId;
+        String msgType;        // Content type for media
+        String body;           // File name for media, event ID for receipts
+        String transactionId;  // Kept across retries so the server can deduplicate
+        String contentUri;
+        const uint8_t* fileData = nullptr;
+        size_t fileSize = 0;
+        MatrixMediaInfo mediaInfo;
+        std::vector<uint32_t> ids; // Several when messages were coalesced
+        int attempts = 0;
+        unsigned long notBefore = 0;
+        bool inFlight = false;
+    };
+
+    // Runs on connections, a request lock, JSON arenas and a sync document
+    // shared with the other accounts of a MatrixClientPool. linkHost is the
+    // homeserver of the shared connections, empty until the first login.
+    MatrixClient(HTTPConnection& connection, HTTPConnection& syncConnection, std::recursive_mutex& requestMutex, String& linkHost, MatrixJsonPool& jsonPool,
+                 std::unique_ptr<DynamicJsonDocument>& syncDocument, LoggerFunction logger);
+    static size_t jsonDocumentCapacity();
+
     String performHTTPRequest(const String& url, const String& method, const String& payload, bool useAuth = true);
-    bool readHTTPResponse(String &body, String &headers);
+    void logFormatted(LogLevel level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+    bool performHTTPRequest(const String& url, const String& method, const String& payload, bool useAuth, HTTPResponse& response, String& responseBody);
+    DeserializationError performJsonRequest(const String& url, const String& method, const String& payload, MatrixJsonDocument& doc, bool useAuth = true, HTTPResponse* response = nullptr, const JsonDocument* filter = nullptr);
+    bool exchangeHTTP(const String& url, const String& method, const String& payload, bool useAuth, HTTPResponse& response, char* responseBody, size_t capacity, MatrixRequestMetrics& metrics);
+    void readTransportMetrics(MatrixRequestMetrics& metrics, const HTTPConnection& link, const HTTPResponse& response);
+    void recordMetrics(MatrixRequestMetrics& metrics);
+    void recordSyncFailure();
+    void scheduleNextSync(bool succeeded, bool eventsReceived);
+    uint32_t enqueue(OutboundMessage& item);
+    OutboundResult sendOutbound(OutboundMessage& item, unsigned long& retryAfter, String& eventId);
+    void sendPipelined(const std::vector<OutboundMessage*>& batch, std::vector<OutboundOutcome>& outcomes);
+    bool buildOutbound(OutboundMessage& item, String& url, String& payload);
+    OutboundResult readOutboundResult(const OutboundMessage& item, const HTTPResponse& response, JsonDocument& doc, const char* responseBody, unsigned long& retryAfter, String& eventId);
+    bool sendRoomMessage(const String& roomId, const String& payload, const String& transactionId);
+    bool sendHTTPRequest(HTTPConnection& link, const String& url, const String& method, const String& payload, bool useAuth, HTTPResponse& response, const String& extraHeaders = "");
+    bool writeHTTPRequest(HTTPConnection& link, const String& url, const String& method, const String& payload, bool useAuth, const String& extraHeaders = "");
+    bool writeHTTPHeaders(HTTPConnection& link, const String& url, const String& method, const String& contentType, long contentLength, bool useAuth, const String& extraHeaders = "");
+    bool appendHTTPHeaders(HTTPConnection& link, const String& url, const String& method, const String& contentType, long contentLength, bool useAuth, const String& extraHeaders = "");
+    bool readHTTPBody(HTTPConnection& link, const HTTPResponse& response, char* body, size_t capacity);
+    void claimConnection();
+    const String& acceptEncodingHeader() const;
+    bool finishSync(const HTTPResponse& response);
+    JsonDocument& reuseSyncDocument();
+    void handleSyncOverflow(size_t capacity);
+    int effectiveTimelineLimit(int configured) const;
+    SyncStatus retrySync(const String& reason);
+    void cancelSync();
+    void syncTaskLoop();
     bool discoverServer(const String& matrixUser);
-    String extractJsonBody(const String& responseBody);
-    bool extractNextBatch(const String& responseBody);
+    void buildSyncFilter(JsonDocument& filter, bool initialSync);
+    void buildSlidingSyncFilter(JsonDocument& filter, bool initialSync);
+    void buildSlidingSyncRequest(JsonDocument& request);
+    bool processSync(JsonDocument& doc);
+    bool processSlidingSync(JsonDocument& doc);
+    bool processTimeline(MatrixRoomHandle handle, JsonArray events, size_t firstLive);
+    bool processInvite(MatrixRoomHandle handle, JsonArray events);
+    void addTimelineGap(MatrixRoomHandle handle, const char* prevBatch);
+    void backfillTimeline(int pages);
+    void addStateFilter(JsonObject event);
+    void applyStateEvent(MatrixRoom& room, JsonObject event);
+    void buildFilterDefinition(JsonDocument& definition);
+    bool uploadSyncFilter();
+    bool claimLinkHost();
     bool ensureAccessToken();
+    bool restoreSession(const String& matrixUser);
+    void invalidateSession();
+    String getMasterRoomId();
+    bool resolveMasterRoom(const String& master, String& roomId);
+    void adoptDirectRoom(JsonArray roomIds);
     bool refreshAccessToken();
-    void storeEvent(const MatrixEvent& event);
-    String uploadMedia(const String& fileName, const String& contentType, const uint8_t* fileData, size_t fileSize);
-    
+    MatrixEvent* storeEvent();
+    MatrixRoomHandle internRoom(const char* roomId);
+    MatrixRoomHandle lookupRoom(const char* roomId, size_t& slot) const;
+    String uploadMedia(const String& fileName, const String& contentType, MediaReader reader, size_t fileSize, std::function<bool()> rewind);
+    bool postMedia(const String& roomId, const String& fileName, const String& contentType, const String& mediaUrl, size_t fileSize, const MatrixMediaInfo& info, const String& transactionId);
+    bool fetchMedia(const char* kind, const String& mxcUri, const String& query, MediaWriter writer, size_t offset, size_t maxSize);
+    void buildMediaEvent(JsonDocument& event, const String& fileName, const String& contentType, const String& contentUri, size_t fileSize, const MatrixMediaInfo& info);
 
-    Client *client;
+    std::unique_ptr<HTTPConnection> ownConnection;
+    HTTPConnection& connection;
+    std::unique_ptr<HTTPConnection> ownSyncConnection;
+    HTTPConnection* syncConnection;
     LoggerFunction logger;
     String homeserverUrl;
+    String userId;
     String accessToken;
     String refreshToken;
     String syncToken;
     String masterUserId;
     String masterRoomId;
-    unsigned long tokenExpiryTime;
-    std::vector<MatrixEvent> recentEvents;
+    MatrixSyncFilter syncFilter;
+    MatrixSlidingSync slidingSync;
+    MatrixSyncSchedule syncSchedule;
+    MatrixSyncPlan syncPlan;
+    unsigned int ceilingHolds = 0; // Quiet syncs in a row at the timeout ceiling
+    unsigned long syncRequestTimeout = 0; // Long-poll timeout of the outstanding sync
+    unsigned long receivedEvents = 0; // Events stored since the start, for the sync schedule
+    String slidingPos;
+    String syncPayload; // Body of a sliding sync request, empty for /v3/sync
+    String syncFilterId;
+    bool inlineSyncFilter = false;
+    bool legacyMediaApi = false; // The server lacks the authenticated /_matrix/client/v1/media endpoints
+    bool tokenExpires = false;
+    unsigned long tokenExpiryTime = 0;
+    MatrixSessionStore* sessionStore = nullptr;
+    String loginUser;
+    unsigned long sessionSavedAt = 0;
+    MatrixRingBuffer<MatrixEvent> eventBuffer{32};
+    std::deque<MatrixRoom> rooms; // Never shrinks, so handles and references stay valid
+    std::vector<MatrixRoomHandle> roomIndex;
+    std::atomic<unsigned long> droppedEvents{0};
+    size_t syncCapacity = 0; // Of the sync document after responses did not fit, 0 for syncDocumentSize
+    int reducedTimelineLimit = 0; // Until the next sync that fits, 0 when not reduced
+    std::atomic<unsigned long> syncOverflows{0};
+    MatrixEventIndex recentEventIds{64};
+    std::atomic<unsigned long> duplicateEvents{0};
+    std::deque<TimelineGap> timelineGaps; // Oldest first
+    String syncUrl;
+    SyncConfig syncConfig;
+    std::atomic<bool> syncPending{false};
+    bool syncInitial = false;
+    bool syncRetried = false;
+    unsigned long syncStartedAt = 0;
+    std::thread syncTask;
+    std::atomic<bool> syncTaskRunning{false};
+    std::recursive_mutex ownRequestMutex;
+    std::recursive_mutex& requestMutex; // Serializes requests on the main connection
+    bool pooled = false; // Synced by a MatrixClientPool
+    String* linkHost = nullptr; // Guarded by requestMutex
+    unsigned long syncTimeoutCap = (unsigned long)-1; // Share of a MatrixClientPool round
+    std::mutex eventMutex;
+    std::deque<OutboundMessage> outbox;
+    std::mutex outboxMutex;
+    std::mutex queueMutex; // Held by processQueue() while it sends
+    uint32_t nextMessageId = 1;
+    String transactionPrefix;
+    std::vector<ReadMarker> readMarkers;
+    unsigned long readMarkersSince = 0;
+    std::mutex markerMutex;
+    std::atomic<uint32_t> transactionCounter{0};
+    SendCallback sendCallback;
+    UploadProgressCallback uploadProgressCallback;
+    MetricsCallback metricsCallback;
+    MatrixMetrics metricTotals;
+    MatrixRequestMetrics syncMetrics;
+    std::unique_ptr<MatrixJsonPool> ownJsonPool;
+    MatrixJsonPool& jsonPool;
+    std::unique_ptr<DynamicJsonDocument> ownSyncDocument;
+    std::unique_ptr<DynamicJsonDocument>& syncDocument; // Kept from one sync to the next
+    mutable std::mutex metricsMutex;
     static void defaultLoggerFunction(LogLevel level, const String& message) {
         if (level <= logLevel) {
             Serial.println(message);
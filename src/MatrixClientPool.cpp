@@ -0,0 +1,120 @@
+#include "MatrixClientPool.h"
+
+MatrixClientPool::MatrixClientPool(MatrixClientPool::LoggerFunction logger)
+    : logger(logger), jsonPool(MatrixClient::jsonDocumentCapacity()) {}
+
+MatrixClient& MatrixClientPool::addAccount(Client& client, Client& syncClient) {
+    Link* link = nullptr;
+    for (Link& candidate : links) {
+        if (candidate.client == &client && candidate.syncClient == &syncClient) {
+            link = &candidate;
+            break;
+        }
+    }
+    if (!link) {
+        links.emplace_back(client, syncClient);
+        link = &links.back();
+    }
+
+    Account account;
+    account.client.reset(new MatrixClient(link->connection, link->syncConnection, link->requestMutex, link->host, jsonPool, syncDocument, logger));
+    link->accounts.push_back(accounts.size());
+    accounts.push_back(std::move(account));
+    return *accounts.back().client;
+}
+
+MatrixClient& MatrixClientPool::getAccount(size_t account) {
+    return *accounts[account].client;
+}
+
+size_t MatrixClientPool::getAccountCount() const {
+    return accounts.size();
+}
+
+// Polls the outstanding sync of every connection and starts the next
+// account's turn once it is done.
+size_t MatrixClientPool::loop() {
+    size_t completed = 0;
+    for (Link& link : links) {
+        if (link.syncing != NO_ACCOUNT) {
+            Account& account = accounts[link.syncing];
+            SyncStatus status = account.client->poll();
+            if (status == SYNC_PENDING) {
+                continue;
+            }
+            if (status == SYNC_COMPLETED) {
+                completed++;
+                account.notBefore = millis() + account.client->getSyncDelay();
+            } else {
+                account.notBefore = millis() + account.client->waitForResponse; // don't hammer a server that is unreachable
+            }
+            link.syncing = NO_ACCOUNT;
+        }
+        beginTurn(link);
+    }
+
+    if (processQueues) {
+        for (Account& account : accounts) {
+            account.client->processQueue();
+        }
+    }
+    return completed;
+}
+
+// Starts the sync of the next account of the connection that is logged in
+// and not pausing. An account whose sync cannot be started waits like one
+// whose sync failed, so it does not hold up the others. Its long-poll is cut
+// to its share of the round; its own syncTimeout or sync schedule still
+// decide below that.
+void MatrixClientPool::beginTurn(Link& link) {
+    for (size_t tried = 0; tried < link.accounts.size(); tried++) {
+        size_t index = link.accounts[link.nextTurn];
+        link.nextTurn = (link.nextTurn + 1) % link.accounts.size();
+
+        Account& account = accounts[index];
+        if (!account.client->isLoggedIn() || (long)(millis() - account.notBefore) < 0) {
+            continue;
+        }
+        account.client->syncTimeoutCap = syncTimeout / link.accounts.size();
+        if (account.client->beginSync()) {
+            link.syncing = index;
+        } else {
+            account.notBefore = millis() + account.client->waitForResponse;
+        }
+        return;
+    }
+}
+
+size_t MatrixClientPool::consumeEvents(MatrixClientPool::AccountEventVisitor visitor, size_t maxEvents) {
+    size_t consumed = 0;
+    for (size_t index = 0; index < accounts.size() && consumed < maxEvents; index++) {
+        consumed += accounts[index].client->consumeEvents([&visitor, index](const MatrixEvent& event) {
+            visitor(index, event);
+        }, maxEvents - consumed);
+    }
+    return consumed;
+}
+
+size_t MatrixClientPool::pendingEvents() {
+    size_t pending = 0;
+    for (Account& account : accounts) {
+        pending += account.client->pendingEvents();
+    }
+    return pending;
+}
+
+HTTPConnectionStats MatrixClientPool::getConnectionStats() const {
+    HTTPConnectionStats total;
+    for (const Link& link : links) {
+        for (const HTTPConnection* connection : {&link.connection, &link.syncConnection}) {
+            const HTTPConnectionStats& stats = connection->getStats();
+            total.requests += stats.requests;
+            total.handshakes += stats.handshakes;
+            total.reused += stats.reused;
+            total.serverClosed += stats.serverClosed;
+            total.fallbacks += stats.fallbacks;
+            total.writes += stats.writes;
+        }
+    }
+    return total;
+}
@@ -0,0 +1,81 @@
+#ifndef MATRIX_CLIENT_POOL_H
+#define MATRIX_CLIENT_POOL_H
+
+#include <deque>
+#include <vector>
+#include "MatrixClient.h"
+
+// Hosts several accounts on one event loop. Accounts added with the same pair
+// of clients share their two connections, so the accounts of one homeserver
+// need a single handshake each for requests and for syncs instead of one per
+// account, and all accounts share the JSON arenas and the sync document.
+// They have to be on the same homeserver: login() fails for an account whose
+// homeserver differs from the one the first account of its clients logged in
+// to.
+//
+// loop() syncs the accounts of each connection in turn without waiting: one
+// sync is outstanding per connection, and no account long-polls for more than
+// its share of syncTimeout, so a round over all of them takes about as long
+// as a single account's long-poll while they are quiet. Below that share an
+// account's own syncTimeout, or its MatrixSyncSchedule, still applies. Events stay with their account
+// and are handed out together with its index by consumeEvents().
+//
+// The accounts are driven from the thread that calls loop(); do not call
+// sync(), beginSync() or poll() on them, and startSyncTask() is refused.
+// Other requests can be made from any thread.
+class MatrixClientPool {
+public:
+    using LoggerFunction = MatrixClient::LoggerFunction;
+    using AccountEventVisitor = std::function<void(size_t account, const MatrixEvent& event)>;
+
+    explicit MatrixClientPool(LoggerFunction logger = nullptr);
+    MatrixClientPool(const MatrixClientPool&) = delete;
+    MatrixClientPool& operator=(const MatrixClientPool&) = delete;
+
+    // Log in with the returned client; the index of the account is the
+    // number of accounts added before it
+    MatrixClient& addAccount(Client& client, Client& syncClient);
+    MatrixClient& getAccount(size_t account);
+    size_t getAccountCount() const;
+
+    size_t loop(); // Never waits for the server, returns the number of syncs completed
+    size_t consumeEvents(AccountEventVisitor visitor, size_t maxEvents = (size_t)-1);
+    size_t pendingEvents();
+    HTTPConnectionStats getConnectionStats() const; // Summed over the shared connections
+
+    unsigned long syncTimeout = 5000; // Long-poll time of a round of syncs over one connection, caps each account at its share
+    bool processQueues = true; // Also drain the outbound queues of the accounts in loop()
+
+private:
+    static const size_t NO_ACCOUNT = (size_t)-1;
+
+    // The connections shared by the accounts added with one pair of clients
+    struct Link {
+        Link(Client& client, Client& syncClient) : client(&client), syncClient(&syncClient), connection(client), syncConnection(syncClient) {}
+
+        Client* client;
+        Client* syncClient;
+        HTTPConnection connection;
+        HTTPConnection syncConnection;
+        std::recursive_mutex requestMutex;
+        String host;                    // Homeserver of the accounts, set by the first login
+        std::vector<size_t> accounts;
+        size_t nextTurn = 0;            // Position in accounts
+        size_t syncing = NO_ACCOUNT;    // Account whose sync is outstanding
+    };
+
+    struct Account {
+        std::unique_ptr<MatrixClient> client;
+        unsigned long notBefore = 0; // Pause of the sync schedule, or after a failed sync
+    };
+
+    void beginTurn(Link& link);
+
+    LoggerFunction logger;
+    MatrixJsonPool jsonPool;
+    std::unique_ptr<DynamicJsonDocument> syncDocument; // Sync responses are parsed one at a time, so one is enough
+    std::deque<Link> links;
+    std::deque<Account> accounts;
+};
+
+#endif // MATRIX_CLIENT_POOL_H
@@ -0,0 +1,78 @@
+#ifndef MATRIX_EVENT_INDEX_H
+#define MATRIX_EVENT_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Remembers the IDs of the most recent events as 64-bit hashes in a ring of
+// fixed size, so an event that arrives a second time, e.g. from a sync that
+// was retried after a partial read, is recognised. When the ring is full the
+// oldest ID is forgotten.
+class MatrixEventIndex {
+public:
+    explicit MatrixEventIndex(size_t capacity = 0) : hashes(capacity) {}
+
+    // Forgets all IDs.
+    void setCapacity(size_t capacity) {
+        hashes.assign(capacity, 0);
+        next = 0;
+        count = 0;
+    }
+
+    size_t capacity() const { return hashes.size(); }
+    size_t size() const { return count; }
+
+    // Empty IDs are never duplicates.
+    bool contains(const char* eventId) const {
+        if (!eventId || !*eventId || hashes.empty()) {
+            return false;
+        }
+        uint64_t hash = hashEventId(eventId);
+        for (size_t i = 0; i < count; i++) {
+            if (hashes[i] == hash) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns false when eventId is among the remembered ones, otherwise
+    // remembers it. Empty IDs are never duplicates.
+    bool insert(const char* eventId) {
+        if (!eventId || !*eventId || hashes.empty()) {
+            return true;
+        }
+        if (contains(eventId)) {
+            return false;
+        }
+        hashes[next] = hashEventId(eventId);
+        next = (next + 1) % hashes.size();
+        if (count < hashes.size()) {
+            count++;
+        }
+        return true;
+    }
+
+    void clear() {
+        next = 0;
+        count = 0;
+    }
+
+private:
+    // FNV-1a; with 64 bits, two of a few hundred IDs practically never collide
+    static uint64_t hashEventId(const char* eventId) {
+        uint64_t hash = 14695981039346656037ull;
+        while (*eventId) {
+            hash ^= (uint8_t)*eventId++;
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    std::vector<uint64_t> hashes;
+    size_t next = 0;
+    size_t count = 0;
+};
+
+#endif // MATRIX_EVENT_INDEX_H
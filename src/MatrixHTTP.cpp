@@ -0,0 +1,516 @@
+#include "MatrixHTTP.h"
+
+#include <new>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+// Case-insensitive search for a comma separated token, e.g. "chunked" in "gzip, chunked".
+static bool headerHasToken(const char* value, const char* token) {
+    size_t tokenLength = strlen(token);
+    while (*value) {
+        while (*value == ' ' || *value == ',') {
+            value++;
+        }
+        const char* end = value;
+        while (*end && *end != ',' && *end != ' ' && *end != ';') {
+            end++;
+        }
+        if ((size_t)(end - value) == tokenLength && strncasecmp(value, token, tokenLength) == 0) {
+            return true;
+        }
+        value = end;
+        while (*value && *value != ',') {
+            value++;
+        }
+    }
+    return false;
+}
+
+HTTPConnection::HTTPConnection(Client& client) : tcp(&client) {
+}
+
+bool HTTPConnection::connect(const char* host, size_t hostLength, uint16_t port, bool keepAlive) {
+    if (hostLength != connectedHost.length() || strncmp(host, connectedHost.c_str(), hostLength) != 0 || port != connectedPort) {
+        // A different host gets its own keep-alive negotiation
+        close();
+        keepAliveRefused = false;
+        connectedHost = "";
+        connectedHost.concat(host, hostLength);
+        connectedPort = port;
+    }
+    keepAliveRequested = keepAlive;
+    stats.requests++;
+    timing = HTTPRequestTiming();
+
+    if (isOpen) {
+        if (tcp->connected() && available() == 0) {
+            lastReused = true;
+            timing.reused = true;
+            stats.reused++;
+            return true;
+        }
+        // Either the server closed the idle connection or unread data is
+        // left over from a previous response; both mean we must start over.
+        stats.serverClosed++;
+        close();
+    }
+
+    lastReused = false;
+    unsigned long connectStart = micros();
+    bool connected = tcp->connect(connectedHost.c_str(), port);
+    timing.connectTime = micros() - connectStart;
+    if (!connected) {
+        return false;
+    }
+    stats.handshakes++;
+    isOpen = true;
+    return true;
+}
+
+void HTTPConnection::release(bool reusable, bool serverKeepAlive) {
+    if (keepAliveRequested && !keepAliveRefused && !serverKeepAlive) {
+        keepAliveRefused = true;
+        stats.fallbacks++;
+    }
+    if (!reusable || !keepAliveActive()) {
+        close();
+    }
+}
+
+void HTTPConnection::close() {
+    if (isOpen) {
+        tcp->stop();
+    }
+    isOpen = false;
+    lastReused = false;
+    bufferStart = 0;
+    bufferEnd = 0;
+}
+
+// Kept for the next compressed response, so decoding does not allocate and
+// free 32 KiB on every request. nullptr when there is not enough memory.
+uint8_t* HTTPConnection::inflateWindow() {
+    if (!window) {
+        window.reset(new (std::nothrow) uint8_t[MATRIX_INFLATE_WINDOW_SIZE]);
+    }
+    return window.get();
+}
+
+void HTTPConnection::beginRequest() {
+    requestLength = 0;
+    requestFailed = false;
+}
+
+// Only requests that outgrow the buffer, e.g. with an inline sync filter in
+// the URL, are written in more than one piece.
+void HTTPConnection::append(const char* data, size_t length) {
+    while (length > 0) {
+        if (requestLength == sizeof(request)) {
+            writeOut((const uint8_t*)request, requestLength);
+            requestLength = 0;
+        }
+        size_t count = sizeof(request) - requestLength;
+        if (count > length) {
+            count = length;
+        }
+        memcpy(request + requestLength, data, count);
+        requestLength += count;
+        data += count;
+        length -= count;
+    }
+}
+
+void HTTPConnection::appendNumber(long value) {
+    char number[12];
+    append(number, snprintf(number, sizeof(number), "%ld", value));
+}
+
+// Writes the assembled request, with the body copied behind it when it still
+// fits into the buffer or else written straight from its own memory. Further
+// calls write more of the body without copying.
+bool HTTPConnection::flushRequest(const uint8_t* body, size_t length) {
+    if (length > 0 && length <= sizeof(request) - requestLength) {
+        append((const char*)body, length);
+        length = 0;
+    }
+    if (requestLength > 0) {
+        writeOut((const uint8_t*)request, requestLength);
+        requestLength = 0;
+    }
+    if (length > 0) {
+        writeOut(body, length);
+    }
+    bool written = !requestFailed;
+    requestFailed = false;
+    return written;
+}
+
+bool HTTPConnection::writeOut(const uint8_t* data, size_t length) {
+    stats.writes++;
+    if (requestFailed || tcp->write(data, length) != length) {
+        requestFailed = true;
+    }
+    timing.bytesOut += length;
+    sentAt = micros();
+    return !requestFailed;
+}
+
+bool HTTPConnection::fillBuffer() {
+    if (bufferStart < bufferEnd) {
+        return true;
+    }
+    bufferStart = 0;
+    bufferEnd = 0;
+
+    int count = tcp->available();
+    if (count <= 0) {
+        return false;
+    }
+    if ((size_t)count > sizeof(buffer)) {
+        count = sizeof(buffer);
+    }
+    int received = tcp->read(buffer, count);
+    if (received <= 0) {
+        return false;
+    }
+    timing.bytesIn += received;
+    bufferEnd = received;
+    return true;
+}
+
+int HTTPConnection::available() {
+    return (int)(bufferEnd - bufferStart) + tcp->available();
+}
+
+int HTTPConnection::read() {
+    if (!fillBuffer()) {
+        return -1;
+    }
+    return buffer[bufferStart++];
+}
+
+int HTTPConnection::peek() {
+    if (!fillBuffer()) {
+        return -1;
+    }
+    return buffer[bufferStart];
+}
+
+// Copies whatever is already available, without waiting. Large reads bypass
+// the buffer once it is empty.
+size_t HTTPConnection::read(uint8_t* destination, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        if (bufferStart == bufferEnd && length - total >= sizeof(buffer)) {
+            int count = tcp->available();
+            if (count <= 0) {
+                break;
+            }
+            if ((size_t)count > length - total) {
+                count = length - total;
+            }
+            int received = tcp->read(destination + total, count);
+            if (received <= 0) {
+                break;
+            }
+            timing.bytesIn += received;
+            total += received;
+            continue;
+        }
+
+        if (!fillBuffer()) {
+            break;
+        }
+        size_t count = bufferEnd - bufferStart;
+        if (count > length - total) {
+            count = length - total;
+        }
+        memcpy(destination + total, buffer + bufferStart, count);
+        bufferStart += count;
+        total += count;
+    }
+    return total;
+}
+
+// Sleeps between polls rather than spinning, so other tasks get the CPU
+// while the server is still working on the response.
+bool HTTPConnection::waitForData(unsigned long timeout) {
+    unsigned long start = millis();
+    while (available() == 0) {
+        if (!tcp->connected() || millis() - start >= timeout) {
+            return false;
+        }
+        delay(1);
+    }
+    return true;
+}
+
+bool HTTPConnection::readLine(char* line, size_t size, unsigned long timeout) {
+    unsigned long start = millis();
+    size_t length = 0;
+    while (true) {
+        int c = read();
+        if (c < 0) {
+            unsigned long elapsed = millis() - start;
+            if (elapsed >= timeout || !waitForData(timeout - elapsed)) {
+                return false;
+            }
+            continue;
+        }
+        if (c == '\n') {
+            break;
+        }
+        // Overlong lines are cut, none of the headers we use get that long
+        if (c != '\r' && length < size - 1) {
+            line[length++] = (char)c;
+        }
+    }
+    line[length] = 0;
+    return true;
+}
+
+void HTTPConnection::parseHeader(HTTPResponse& response, char* line) {
+    char* colon = strchr(line, ':');
+    if (!colon) {
+        return;
+    }
+    *colon = 0;
+    char* value = colon + 1;
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+
+    if (strcasecmp(line, "Content-Length") == 0) {
+        response.contentLength = atol(value);
+    } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+        response.chunked = headerHasToken(value, "chunked");
+    } else if (strcasecmp(line, "Connection") == 0) {
+        if (headerHasToken(value, "close")) {
+            response.keepAlive = false;
+        } else if (headerHasToken(value, "keep-alive")) {
+            response.keepAlive = true;
+        }
+    } else if (strcasecmp(line, "Content-Encoding") == 0) {
+        if (headerHasToken(value, "gzip") || headerHasToken(value, "x-gzip")) {
+            response.contentEncoding = HTTP_GZIP;
+        } else if (headerHasToken(value, "deflate")) {
+            response.contentEncoding = HTTP_DEFLATE;
+        } else if (!headerHasToken(value, "identity")) {
+            response.contentEncoding = HTTP_UNSUPPORTED_ENCODING;
+        }
+    } else if (strcasecmp(line, "Content-Type") == 0) {
+        response.contentType = value;
+    } else if (strcasecmp(line, "Retry-After") == 0) {
+        response.retryAfter = atol(value) * 1000; // only the delay-seconds form
+    }
+}
+
+bool HTTPConnection::readResponseHeaders(HTTPResponse& response, unsigned long timeout) {
+    char line[256];
+    do {
+        response = HTTPResponse();
+        if (!readLine(line, sizeof(line), timeout)) {
+            return false;
+        }
+        char* status = strchr(line, ' ');
+        if (strncmp(line, "HTTP/", 5) != 0 || !status) {
+            return false;
+        }
+        response.statusCode = atoi(status + 1);
+        response.keepAlive = strncmp(line, "HTTP/1.0", 8) != 0;
+
+        while (true) {
+            if (!readLine(line, sizeof(line), timeout)) {
+                return false;
+            }
+            if (line[0] == 0) {
+                break;
+            }
+            parseHeader(response, line);
+        }
+    } while (response.statusCode >= 100 && response.statusCode < 200); // skip interim responses
+
+    if (response.statusCode == 204 || response.statusCode == 304) {
+        response.contentLength = 0;
+        response.chunked = false;
+    }
+    timing.firstByteTime = micros() - sentAt;
+    return true;
+}
+
+HTTPBodyStream::HTTPBodyStream(HTTPConnection& connection, const HTTPResponse& response)
+    : connection(&connection),
+      chunked(response.chunked),
+      untilClose(!response.chunked && response.contentLength < 0),
+      remaining(response.chunked ? 0 : response.contentLength) {
+    finished = !chunked && !untilClose && remaining == 0;
+}
+
+int HTTPBodyStream::available() {
+    if (finished || failed) {
+        return 0;
+    }
+    long count = connection->available();
+    if (!untilClose && count > remaining) {
+        count = remaining;
+    }
+    return (int)count;
+}
+
+int HTTPBodyStream::read() {
+    if (!prepare()) {
+        return -1;
+    }
+    int c = nextByte();
+    if (c < 0) {
+        return -1;
+    }
+    advance(1);
+    return c;
+}
+
+int HTTPBodyStream::peek() {
+    if (!prepare()) {
+        return -1;
+    }
+    int c = connection->peek();
+    if (c < 0 && connection->waitForData(_timeout)) {
+        c = connection->peek();
+    }
+    return c;
+}
+
+size_t HTTPBodyStream::readBody(uint8_t* destination, size_t length) {
+    size_t total = 0;
+    while (total < length && prepare()) {
+        size_t wanted = length - total;
+        if (!untilClose && (long)wanted > remaining) {
+            wanted = remaining;
+        }
+        size_t count = connection->read(destination + total, wanted);
+        if (count == 0) {
+            if (!connection->waitForData(_timeout)) {
+                if (untilClose && !connection->client().connected()) {
+                    finished = true;
+                } else {
+                    failed = true;
+                }
+                break;
+            }
+            continue;
+        }
+        advance(count);
+        total += count;
+    }
+    return total;
+}
+
+// Skips whatever is left of the body, e.g. trailing whitespace after the JSON
+// document, so the connection can be reused. Returns false when the end of
+// the body could not be reached or the body only ends with the connection.
+bool HTTPBodyStream::drain() {
+    if (untilClose) {
+        return false;
+    }
+    uint8_t scratch[64];
+    while (!finished && !failed) {
+        readBody(scratch, sizeof(scratch));
+    }
+    return finished;
+}
+
+bool HTTPBodyStream::prepare() {
+    if (finished || failed) {
+        return false;
+    }
+    if (chunked && remaining == 0) {
+        return beginChunk();
+    }
+    return true;
+}
+
+// Reads the chunk-size line (and the CRLF closing the previous chunk). A
+// zero-sized chunk ends the body after its optional trailer lines.
+bool HTTPBodyStream::beginChunk() {
+    char line[32];
+    size_t length = 0;
+    bool skippedDelimiter = firstChunk;
+    while (true) {
+        int c = nextByte();
+        if (c < 0) {
+            return false;
+        }
+        if (c != '\n') {
+            if (c != '\r' && length < sizeof(line) - 1) {
+                line[length++] = (char)c;
+            }
+            continue;
+        }
+        line[length] = 0;
+        if (!skippedDelimiter) {
+            skippedDelimiter = true;
+            length = 0;
+            continue;
+        }
+        break;
+    }
+    firstChunk = false;
+
+    char* end;
+    long size = strtol(line, &end, 16);
+    if (end == line || size < 0) {
+        failed = true;
+        return false;
+    }
+    if (size > 0) {
+        remaining = size;
+        return true;
+    }
+
+    // Last chunk, skip the trailer up to the empty line
+    length = 1;
+    while (length > 0) {
+        length = 0;
+        while (true) {
+            int c = nextByte();
+            if (c < 0) {
+                return false;
+            }
+            if (c == '\n') {
+                break;
+            }
+            if (c != '\r') {
+                length++;
+            }
+        }
+    }
+    finished = true;
+    return false;
+}
+
+int HTTPBodyStream::nextByte() {
+    int c = connection->read();
+    if (c < 0 && connection->waitForData(_timeout)) {
+        c = connection->read();
+    }
+    if (c < 0) {
+        if (untilClose && !connection->client().connected()) {
+            finished = true;
+        } else {
+            failed = true;
+        }
+    }
+    return c;
+}
+
+void HTTPBodyStream::advance(size_t count) {
+    consumed += count;
+    if (untilClose) {
+        return;
+    }
+    remaining -= count;
+    if (!chunked && remaining == 0) {
+        finished = true;
+    }
+}
@@ -0,0 +1,173 @@
+#ifndef MATRIX_HTTP_H
+#define MATRIX_HTTP_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include <memory>
+
+#ifndef MATRIX_HTTP_BUFFER_SIZE
+#define MATRIX_HTTP_BUFFER_SIZE 512 // Block size used to read responses from the socket
+#endif
+
+#ifndef MATRIX_HTTP_REQUEST_BUFFER_SIZE
+#define MATRIX_HTTP_REQUEST_BUFFER_SIZE 1024 // Request line, headers and small bodies are collected here before they are written
+#endif
+
+#ifndef MATRIX_INFLATE_WINDOW_SIZE
+#define MATRIX_INFLATE_WINDOW_SIZE 32768 // History needed to decode compressed responses, deflate refers back up to 32 KiB
+#endif
+
+struct HTTPConnectionStats {
+    unsigned long requests = 0;     // Requests sent through the connection
+    unsigned long handshakes = 0;   // TCP/TLS connects performed
+    unsigned long reused = 0;       // Requests that went out on an already open connection
+    unsigned long serverClosed = 0; // Idle connections found closed by the server
+    unsigned long fallbacks = 0;    // Times the server refused keep-alive
+    unsigned long writes = 0;       // Writes to the socket, each may become a TLS record of its own
+
+    float reuseRatio() const {
+        return requests ? (float)reused / (float)requests : 0.0f;
+    }
+};
+
+// Transport measurements of the latest request, times in microseconds.
+// connect() starts a new request.
+struct HTTPRequestTiming {
+    bool reused = false;             // Went out on a kept-alive connection
+    unsigned long connectTime = 0;   // TCP and TLS handshake, 0 when reused
+    unsigned long firstByteTime = 0; // From the last write to the end of the response headers
+    size_t bytesOut = 0;
+    size_t bytesIn = 0;              // Headers included
+    unsigned long inflateTime = 0;   // Decoding a compressed body, waiting for the socket excluded
+    size_t bytesInflated = 0;        // Decoded size of a compressed body
+};
+
+enum HTTPContentEncoding : uint8_t {
+    HTTP_IDENTITY,
+    HTTP_GZIP,
+    HTTP_DEFLATE,
+    HTTP_UNSUPPORTED_ENCODING
+};
+
+// Status line and the headers the client acts upon.
+struct HTTPResponse {
+    int statusCode = 0;
+    long contentLength = -1; // -1 when the server did not send one
+    bool chunked = false;
+    bool keepAlive = true;   // false when the server will close the connection
+    long retryAfter = -1;    // Retry-After in milliseconds, -1 when not sent
+    HTTPContentEncoding contentEncoding = HTTP_IDENTITY;
+    String contentType;
+
+    bool isSuccess() const { return statusCode >= 200 && statusCode < 300; }
+};
+
+// Keeps a single connection open per host so consecutive requests skip the
+// TCP and TLS handshake. The server can refuse keep-alive by answering with
+// "Connection: close", in which case the connection falls back to
+// connect-per-request for that host.
+//
+// Responses are read from the socket in blocks through an internal buffer.
+// Requests are assembled in a second buffer with append() and go out with a
+// single write by flushRequest(), so the headers do not end up in a TLS
+// record and TCP segment each.
+class HTTPConnection {
+public:
+    explicit HTTPConnection(Client& client);
+
+    bool connect(const char* host, size_t hostLength, uint16_t port, bool keepAlive);
+    bool connect(const String& host, uint16_t port, bool keepAlive) { return connect(host.c_str(), host.length(), port, keepAlive); }
+    void release(bool reusable, bool serverKeepAlive);
+    void close();
+
+    Client& client() { return *tcp; }
+    bool isReused() const { return lastReused; }
+    bool keepAliveActive() const { return keepAliveRequested && !keepAliveRefused; }
+    const HTTPConnectionStats& getStats() const { return stats; }
+    const HTTPRequestTiming& getRequestTiming() const { return timing; }
+    uint8_t* inflateWindow();
+    void recordInflate(unsigned long time, size_t bytes) {
+        timing.inflateTime += time;
+        timing.bytesInflated += bytes;
+    }
+
+    void beginRequest();
+    void append(const char* data, size_t length);
+    void append(const char* text) { append(text, strlen(text)); }
+    void append(const String& text) { append(text.c_str(), text.length()); }
+    void appendNumber(long value);
+    bool flushRequest(const uint8_t* body = nullptr, size_t length = 0);
+
+    bool readResponseHeaders(HTTPResponse& response, unsigned long timeout);
+
+    int available();
+    int read();
+    int peek();
+    size_t read(uint8_t* destination, size_t length);
+    bool waitForData(unsigned long timeout);
+
+private:
+    bool fillBuffer();
+    bool writeOut(const uint8_t* data, size_t length);
+    bool readLine(char* line, size_t size, unsigned long timeout);
+    void parseHeader(HTTPResponse& response, char* line);
+
+    Client* tcp;
+    String connectedHost;
+    uint16_t connectedPort = 0;
+    bool isOpen = false;
+    bool lastReused = false;
+    bool keepAliveRequested = true;
+    bool keepAliveRefused = false;
+    HTTPConnectionStats stats;
+    HTTPRequestTiming timing;
+    unsigned long sentAt = 0;
+
+    uint8_t buffer[MATRIX_HTTP_BUFFER_SIZE];
+    size_t bufferStart = 0;
+    size_t bufferEnd = 0;
+
+    char request[MATRIX_HTTP_REQUEST_BUFFER_SIZE];
+    size_t requestLength = 0;
+    bool requestFailed = false;
+
+    std::unique_ptr<uint8_t[]> window; // Allocated with the first compressed response
+};
+
+// Exposes an HTTP response body as a Stream so that it can be parsed directly
+// from the connection without first being copied into memory. The body ends
+// on its framing: after Content-Length bytes, after the last chunk of a
+// chunked body, or when the server closes the connection if neither is given.
+// Reads wait up to the stream timeout for data to arrive.
+class HTTPBodyStream : public Stream {
+public:
+    HTTPBodyStream(HTTPConnection& connection, const HTTPResponse& response);
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t) override { return 0; }
+
+    size_t readBody(uint8_t* destination, size_t length);
+    bool drain();
+    bool isComplete() const { return finished; }
+    bool hasFailed() const { return failed; }
+    unsigned long bytesRead() const { return consumed; }
+
+private:
+    bool prepare();
+    bool beginChunk();
+    int nextByte();
+    void advance(size_t count);
+
+    HTTPConnection* connection;
+    bool chunked;
+    bool untilClose;
+    long remaining;        // Bytes left in the body or in the current chunk
+    bool firstChunk = true;
+    bool finished = false;
+    bool failed = false;
+    unsigned long consumed = 0;
+};
+
+#endif // MATRIX_HTTP_H
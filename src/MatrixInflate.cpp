@@ -0,0 +1,496 @@
+#include "MatrixInflate.h"
+
+#include <string.h>
+
+static_assert((MATRIX_INFLATE_WINDOW_SIZE & (MATRIX_INFLATE_WINDOW_SIZE - 1)) == 0, "MATRIX_INFLATE_WINDOW_SIZE must be a power of two");
+static_assert(MATRIX_INFLATE_WINDOW_SIZE >= 1024, "MATRIX_INFLATE_WINDOW_SIZE must hold a batch and a match");
+
+static const uint32_t WINDOW_MASK = MATRIX_INFLATE_WINDOW_SIZE - 1;
+static const uint32_t BATCH_SIZE = 256; // Decoded per call, the longest match may add 258 more
+
+static const uint16_t lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t codeLengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+HTTPInflateStream::HTTPInflateStream(HTTPBodyStream& body, HTTPConnection& connection, const HTTPResponse& response)
+    : body(&body),
+      connection(&connection),
+      encoding(response.contentEncoding),
+      window(nullptr) {
+    literalCode.symbol = literalSymbols;
+    distanceCode.symbol = distanceSymbols;
+    if (encoding == HTTP_IDENTITY) {
+        return;
+    }
+    if (encoding == HTTP_UNSUPPORTED_ENCODING) {
+        state = STATE_FAILED;
+        return;
+    }
+    if (body.isComplete()) {
+        state = STATE_DONE; // e.g. a 204 that names the encoding it would have used
+        return;
+    }
+    window = connection.inflateWindow();
+    if (!window) {
+        state = STATE_FAILED;
+    }
+}
+
+int HTTPInflateStream::available() {
+    if (!isCompressed()) {
+        return body->available();
+    }
+    if (written != delivered) {
+        return (int)(written - delivered);
+    }
+    return state < STATE_DONE && body->available() > 0 ? 1 : 0;
+}
+
+int HTTPInflateStream::read() {
+    if (!isCompressed()) {
+        return body->read();
+    }
+    if (written == delivered && !produce()) {
+        return -1;
+    }
+    return window[delivered++ & WINDOW_MASK];
+}
+
+int HTTPInflateStream::peek() {
+    if (!isCompressed()) {
+        return body->peek();
+    }
+    if (written == delivered && !produce()) {
+        return -1;
+    }
+    return window[delivered & WINDOW_MASK];
+}
+
+size_t HTTPInflateStream::readBody(uint8_t* destination, size_t length) {
+    if (!isCompressed()) {
+        return body->readBody(destination, length);
+    }
+    size_t total = 0;
+    while (total < length) {
+        if (written == delivered && !produce()) {
+            break;
+        }
+        size_t count = written - delivered;
+        if (count > length - total) {
+            count = length - total;
+        }
+        // The decoded bytes may wrap around the end of the window
+        size_t offset = delivered & WINDOW_MASK;
+        size_t first = MATRIX_INFLATE_WINDOW_SIZE - offset < count ? MATRIX_INFLATE_WINDOW_SIZE - offset : count;
+        memcpy(destination + total, window + offset, first);
+        memcpy(destination + total + first, window, count - first);
+        delivered += count;
+        total += count;
+    }
+    return total;
+}
+
+// Decodes and discards the rest of the body, then skips whatever follows
+// the compressed data so the connection can be reused.
+bool HTTPInflateStream::drain() {
+    if (!isCompressed()) {
+        return body->drain();
+    }
+    while (state < STATE_DONE) {
+        delivered = written;
+        produce();
+    }
+    delivered = written;
+    return state == STATE_DONE && body->drain();
+}
+
+bool HTTPInflateStream::isComplete() const {
+    if (!isCompressed()) {
+        return body->isComplete();
+    }
+    return state == STATE_DONE && written == delivered;
+}
+
+bool HTTPInflateStream::hasFailed() const {
+    return isCompressed() ? state == STATE_FAILED : body->hasFailed();
+}
+
+unsigned long HTTPInflateStream::bytesRead() const {
+    return isCompressed() ? delivered : body->bytesRead();
+}
+
+// Decodes the next batch into the window. Only called once everything
+// decoded so far has been handed out, so a batch never overwrites bytes the
+// reader has yet to see. Returns false when nothing more is coming.
+bool HTTPInflateStream::produce() {
+    unsigned long start = micros();
+    waitTime = 0;
+    uint32_t before = written;
+    while (state < STATE_DONE && written - before < BATCH_SIZE && step()) {
+    }
+    connection->recordInflate(micros() - start - waitTime, written - before);
+    return written != before;
+}
+
+bool HTTPInflateStream::step() {
+    switch (state) {
+    case STATE_HEADER:
+        return readHeader();
+    case STATE_BLOCK:
+        return readBlockHeader();
+    case STATE_STORED: {
+        int c = nextAlignedByte();
+        if (c < 0) {
+            return fail();
+        }
+        window[written++ & WINDOW_MASK] = (uint8_t)c;
+        if (--storedRemaining == 0) {
+            state = STATE_BLOCK;
+        }
+        return true;
+    }
+    case STATE_CODES: {
+        int symbol = decodeSymbol(literalCode);
+        if (symbol < 0) {
+            return fail();
+        }
+        if (symbol < 256) {
+            window[written++ & WINDOW_MASK] = (uint8_t)symbol;
+            return true;
+        }
+        if (symbol == 256) {
+            state = STATE_BLOCK;
+            return true;
+        }
+        symbol -= 257;
+        if (symbol >= 29 || !needBits(lengthExtra[symbol])) {
+            return fail();
+        }
+        uint32_t length = lengthBase[symbol] + takeBits(lengthExtra[symbol]);
+        symbol = decodeSymbol(distanceCode);
+        if (symbol < 0 || symbol >= 30 || !needBits(distanceExtra[symbol])) {
+            return fail();
+        }
+        uint32_t distance = distanceBase[symbol] + takeBits(distanceExtra[symbol]);
+        if (distance > written || distance > MATRIX_INFLATE_WINDOW_SIZE) {
+            return fail(); // before the start of the body, or compressed with a larger window
+        }
+        while (length-- > 0) {
+            window[written & WINDOW_MASK] = window[(written - distance) & WINDOW_MASK];
+            written++;
+        }
+        return true;
+    }
+    case STATE_TRAILER:
+        return readTrailer();
+    default:
+        return false;
+    }
+}
+
+// gzip (RFC 1952) has a header of its own. "deflate" is meant to be zlib
+// (RFC 1950) but some servers send raw deflate data, so the two bytes are
+// put back when they are not a zlib header.
+bool HTTPInflateStream::readHeader() {
+    int first = nextByte();
+    int second = nextByte();
+    if (first < 0 || second < 0) {
+        return fail();
+    }
+
+    if (encoding == HTTP_DEFLATE) {
+        if ((first & 0x0f) == 8 && ((first << 8) | second) % 31 == 0) {
+            if (second & 0x20) {
+                return fail(); // preset dictionary
+            }
+            zlibWrapped = true;
+        } else {
+            bitBuffer = first | (second << 8);
+            bitCount = 16;
+        }
+        state = STATE_BLOCK;
+        return true;
+    }
+
+    int method = nextByte();
+    int flags = nextByte();
+    if (first != 0x1f || second != 0x8b || method != 8 || flags < 0) {
+        return fail();
+    }
+    for (int i = 0; i < 6; i++) { // modification time, extra flags, OS
+        if (nextByte() < 0) {
+            return fail();
+        }
+    }
+    if (flags & 0x04) { // FEXTRA
+        int low = nextByte();
+        int high = nextByte();
+        if (low < 0 || high < 0) {
+            return fail();
+        }
+        for (int i = low | (high << 8); i > 0; i--) {
+            if (nextByte() < 0) {
+                return fail();
+            }
+        }
+    }
+    for (int flag = 0x08; flag <= 0x10; flag <<= 1) { // FNAME and FCOMMENT, zero-terminated
+        if (flags & flag) {
+            int c;
+            while ((c = nextByte()) > 0) {
+            }
+            if (c < 0) {
+                return fail();
+            }
+        }
+    }
+    if ((flags & 0x02) && (nextByte() < 0 || nextByte() < 0)) { // FHCRC
+        return fail();
+    }
+    state = STATE_BLOCK;
+    return true;
+}
+
+bool HTTPInflateStream::readBlockHeader() {
+    if (lastBlock) {
+        state = STATE_TRAILER;
+        return true;
+    }
+    if (!needBits(3)) {
+        return fail();
+    }
+    lastBlock = takeBits(1);
+    uint32_t type = takeBits(2);
+
+    if (type == 0) {
+        takeBits(bitCount & 7);
+        int bytes[4];
+        for (int i = 0; i < 4; i++) {
+            bytes[i] = nextAlignedByte();
+            if (bytes[i] < 0) {
+                return fail();
+            }
+        }
+        uint16_t length = bytes[0] | (bytes[1] << 8);
+        uint16_t complement = bytes[2] | (bytes[3] << 8);
+        if (length != (uint16_t)~complement) {
+            return fail();
+        }
+        storedRemaining = length;
+        state = length > 0 ? STATE_STORED : STATE_BLOCK;
+        return true;
+    }
+
+    if (type == 1) {
+        uint8_t lengths[288 + 30];
+        memset(lengths, 8, 144);
+        memset(lengths + 144, 9, 112);
+        memset(lengths + 256, 7, 24);
+        memset(lengths + 280, 8, 8);
+        memset(lengths + 288, 5, 30);
+        buildCode(literalCode, lengths, 288);
+        buildCode(distanceCode, lengths + 288, 30);
+        state = STATE_CODES;
+        return true;
+    }
+
+    if (type == 2 && readDynamicCodes()) {
+        state = STATE_CODES;
+        return true;
+    }
+    return fail();
+}
+
+// The literal/length and distance code lengths are themselves Huffman coded,
+// with run lengths for repeats.
+bool HTTPInflateStream::readDynamicCodes() {
+    if (!needBits(14)) {
+        return false;
+    }
+    int literals = takeBits(5) + 257;
+    int distances = takeBits(5) + 1;
+    int codeLengths = takeBits(4) + 4;
+    if (literals > 286 || distances > 30) {
+        return false;
+    }
+
+    uint8_t lengths[288 + 30];
+    memset(lengths, 0, 19);
+    for (int i = 0; i < codeLengths; i++) {
+        if (!needBits(3)) {
+            return false;
+        }
+        lengths[codeLengthOrder[i]] = takeBits(3);
+    }
+    uint16_t lengthSymbols[19];
+    Huffman lengthCode;
+    lengthCode.symbol = lengthSymbols;
+    if (!buildCode(lengthCode, lengths, 19)) {
+        return false;
+    }
+
+    int index = 0;
+    while (index < literals + distances) {
+        int symbol = decodeSymbol(lengthCode);
+        if (symbol < 0) {
+            return false;
+        }
+        if (symbol < 16) {
+            lengths[index++] = symbol;
+            continue;
+        }
+        uint8_t value = 0;
+        int repeat;
+        if (symbol == 16) {
+            if (index == 0 || !needBits(2)) {
+                return false;
+            }
+            value = lengths[index - 1];
+            repeat = 3 + takeBits(2);
+        } else if (symbol == 17) {
+            if (!needBits(3)) {
+                return false;
+            }
+            repeat = 3 + takeBits(3);
+        } else {
+            if (!needBits(7)) {
+                return false;
+            }
+            repeat = 11 + takeBits(7);
+        }
+        if (index + repeat > literals + distances) {
+            return false;
+        }
+        memset(lengths + index, value, repeat);
+        index += repeat;
+    }
+
+    return lengths[256] != 0 && buildCode(literalCode, lengths, literals) && buildCode(distanceCode, lengths + literals, distances);
+}
+
+// The gzip trailer ends with the decoded size, which is checked; the CRC32
+// and the Adler-32 of zlib are skipped.
+bool HTTPInflateStream::readTrailer() {
+    takeBits(bitCount & 7);
+    int trailerSize = encoding == HTTP_GZIP ? 8 : zlibWrapped ? 4 : 0;
+    uint32_t size = 0;
+    for (int i = 0; i < trailerSize; i++) {
+        int c = nextAlignedByte();
+        if (c < 0) {
+            return fail();
+        }
+        if (i >= 4) {
+            size |= (uint32_t)c << (8 * (i - 4));
+        }
+    }
+    if (encoding == HTTP_GZIP && size != written) {
+        return fail();
+    }
+    state = STATE_DONE;
+    return true;
+}
+
+// Incomplete codes are accepted; a code that is not assigned fails when it
+// is decoded.
+bool HTTPInflateStream::buildCode(Huffman& code, const uint8_t* lengths, int symbols) {
+    memset(code.count, 0, sizeof(code.count));
+    for (int i = 0; i < symbols; i++) {
+        code.count[lengths[i]]++;
+    }
+    code.count[0] = 0;
+
+    int left = 1;
+    for (int length = 1; length < 16; length++) {
+        left <<= 1;
+        left -= code.count[length];
+        if (left < 0) {
+            return false; // more codes than the lengths allow
+        }
+    }
+
+    uint16_t offsets[16];
+    offsets[1] = 0;
+    for (int length = 1; length < 15; length++) {
+        offsets[length + 1] = offsets[length] + code.count[length];
+    }
+    for (int i = 0; i < symbols; i++) {
+        if (lengths[i] != 0) {
+            code.symbol[offsets[lengths[i]]++] = i;
+        }
+    }
+    return true;
+}
+
+// Canonical codes of one length are consecutive numbers, so a symbol is
+// found by reading one bit at a time and comparing against the first code
+// of each length.
+int HTTPInflateStream::decodeSymbol(const Huffman& code) {
+    int value = 0;
+    int first = 0;
+    int index = 0;
+    for (int length = 1; length < 16; length++) {
+        if (!needBits(1)) {
+            return -1;
+        }
+        value |= takeBits(1);
+        int count = code.count[length];
+        if (value - first < count) {
+            return code.symbol[index + value - first];
+        }
+        index += count;
+        first = (first + count) << 1;
+        value <<= 1;
+    }
+    return -1;
+}
+
+bool HTTPInflateStream::needBits(uint8_t count) {
+    while (bitCount < count) {
+        int c = nextByte();
+        if (c < 0) {
+            return false;
+        }
+        bitBuffer |= (uint32_t)c << bitCount;
+        bitCount += 8;
+    }
+    return true;
+}
+
+uint32_t HTTPInflateStream::takeBits(uint8_t count) {
+    uint32_t value = bitBuffer & ((1UL << count) - 1);
+    bitBuffer >>= count;
+    bitCount -= count;
+    return value;
+}
+
+// Reads the compressed data in blocks of what has arrived, at least a byte.
+int HTTPInflateStream::nextByte() {
+    if (inputStart == inputEnd) {
+        int ready = body->available();
+        size_t wanted = ready > (int)sizeof(input) ? sizeof(input) : ready > 0 ? ready : 1;
+        unsigned long start = micros();
+        inputStart = 0;
+        inputEnd = body->readBody(input, wanted);
+        waitTime += micros() - start;
+        if (inputEnd == 0) {
+            return -1;
+        }
+    }
+    return input[inputStart++];
+}
+
+// Stored blocks and trailers start on a byte boundary; whole bytes may still
+// be in the bit buffer.
+int HTTPInflateStream::nextAlignedByte() {
+    if (bitCount >= 8) {
+        return takeBits(8);
+    }
+    return nextByte();
+}
+
+bool HTTPInflateStream::fail() {
+    state = STATE_FAILED;
+    return false;
+}
@@ -0,0 +1,78 @@
+#ifndef MATRIX_INFLATE_H
+#define MATRIX_INFLATE_H
+
+#include <Arduino.h>
+#include "MatrixHTTP.h"
+
+// Decodes a gzip or deflate compressed response body while it is read, so
+// the JSON parser is fed plain text without the body ever being held in
+// memory. Decoded bytes are written into the history window of the
+// connection, which deflate refers back to for repeated strings, and handed
+// out from there. Bodies without a Content-Encoding pass through unchanged.
+// Checksums are not verified, TLS already protects the data.
+class HTTPInflateStream : public Stream {
+public:
+    HTTPInflateStream(HTTPBodyStream& body, HTTPConnection& connection, const HTTPResponse& response);
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t) override { return 0; }
+
+    size_t readBody(uint8_t* destination, size_t length);
+    bool drain();
+    bool isComplete() const;
+    bool hasFailed() const;
+    bool isCompressed() const { return encoding != HTTP_IDENTITY; }
+    unsigned long bytesRead() const; // Decoded bytes handed out
+
+private:
+    enum State : uint8_t { STATE_HEADER, STATE_BLOCK, STATE_STORED, STATE_CODES, STATE_TRAILER, STATE_DONE, STATE_FAILED };
+
+    // Canonical Huffman code: the number of codes of each length and the
+    // symbols in code order.
+    struct Huffman {
+        uint16_t count[16];
+        uint16_t* symbol;
+    };
+
+    bool produce();
+    bool step();
+    bool readHeader();
+    bool readBlockHeader();
+    bool readDynamicCodes();
+    bool readTrailer();
+    bool buildCode(Huffman& code, const uint8_t* lengths, int symbols);
+    int decodeSymbol(const Huffman& code);
+    bool needBits(uint8_t count);
+    uint32_t takeBits(uint8_t count);
+    int nextByte();
+    int nextAlignedByte();
+    bool fail();
+
+    HTTPBodyStream* body;
+    HTTPConnection* connection;
+    HTTPContentEncoding encoding;
+    State state = STATE_HEADER;
+    bool zlibWrapped = false;
+    bool lastBlock = false;
+
+    uint8_t* window;
+    uint32_t written = 0;   // Decoded bytes, the window holds the last MATRIX_INFLATE_WINDOW_SIZE
+    uint32_t delivered = 0; // Decoded bytes handed to the reader
+    uint16_t storedRemaining = 0;
+
+    uint32_t bitBuffer = 0;
+    uint8_t bitCount = 0;
+    uint8_t input[128];
+    size_t inputStart = 0;
+    size_t inputEnd = 0;
+    unsigned long waitTime = 0; // Spent waiting for the socket, not decoding
+
+    Huffman literalCode;
+    Huffman distanceCode;
+    uint16_t literalSymbols[288];
+    uint16_t distanceSymbols[30];
+};
+
+#endif // MATRIX_INFLATE_H
@@ -0,0 +1,78 @@
+#include "MatrixJsonPool.h"
+
+#include <algorithm>
+#include <new>
+#include <stdint.h>
+
+// Arenas start on an 8 byte boundary, as the document inside expects
+static size_t alignArena(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+static size_t arenaSize(size_t documentCapacity, size_t bodyCapacity) {
+    return alignArena(documentCapacity + bodyCapacity + 1);
+}
+
+MatrixJsonPool::MatrixJsonPool(size_t documentCapacity) : documentCapacity(alignArena(documentCapacity)) {}
+
+unsigned long MatrixJsonPool::getMisses() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return misses;
+}
+
+char* MatrixJsonPool::acquire(size_t wantedBody) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t slot = MATRIX_JSON_ARENAS;
+    bool anyLent = false;
+    for (size_t i = 0; i < MATRIX_JSON_ARENAS; i++) {
+        if (lent[i]) {
+            anyLent = true;
+        } else if (slot == MATRIX_JSON_ARENAS) {
+            slot = i;
+        }
+    }
+
+    if (wantedBody > bodyCapacity && !anyLent) {
+        // The first request, or the body limit was raised since
+        memory.reset(new (std::nothrow) char[MATRIX_JSON_ARENAS * arenaSize(documentCapacity, wantedBody)]);
+        bodyCapacity = memory ? wantedBody : 0;
+    }
+    if (memory && wantedBody <= bodyCapacity && slot < MATRIX_JSON_ARENAS) {
+        lent[slot] = true;
+        return memory.get() + slot * arenaSize(documentCapacity, bodyCapacity);
+    }
+
+    misses++;
+    return new (std::nothrow) char[arenaSize(documentCapacity, wantedBody)];
+}
+
+void MatrixJsonPool::release(char* arena) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uintptr_t start = (uintptr_t)memory.get();
+    size_t size = arenaSize(documentCapacity, bodyCapacity);
+    if (memory && (uintptr_t)arena >= start && (uintptr_t)arena < start + MATRIX_JSON_ARENAS * size) {
+        lent[((uintptr_t)arena - start) / size] = false;
+    } else {
+        delete[] arena;
+    }
+}
+
+MatrixJsonDocument::MatrixJsonDocument(MatrixJsonPool& pool, size_t capacity, size_t bodyCapacity)
+    : MatrixJsonDocument(pool, capacity, bodyCapacity, pool.acquire(bodyCapacity)) {}
+
+// Without memory for an arena the document has no room at all, so parsing
+// into it fails with NoMemory.
+MatrixJsonDocument::MatrixJsonDocument(MatrixJsonPool& pool, size_t capacity, size_t bodyCapacity, char* arena)
+    : JsonDocument(arena, arena ? std::min(capacity, pool.getDocumentCapacity()) : 0),
+      pool(&pool),
+      arena(arena),
+      bodyBuffer(arena ? arena + pool.getDocumentCapacity() : emptyBody),
+      bodySize(arena ? bodyCapacity : 0) {
+    bodyBuffer[0] = '\0';
+}
+
+MatrixJsonDocument::~MatrixJsonDocument() {
+    if (arena) {
+        pool->release(arena);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef MATRIX_JSON_POOL_H
+#define MATRIX_JSON_POOL_H
+
+#include <ArduinoJson.h>
+#include <memory>
+#include <mutex>
+
+#ifndef MATRIX_JSON_ARENAS
+#define MATRIX_JSON_ARENAS 3 // Documents that can be held at the same time: two nested on the loop, one on the sync task
+#endif
+
+// Arenas for the parsed responses of API requests, allocated once and then
+// lent out again and again, so requests do not keep allocating and freeing
+// blocks of the heap that fragment it over time. Each arena holds a JSON
+// document of up to documentCapacity bytes followed by the response body,
+// which is parsed in place. The deepest nesting is sendDMToMaster(), which
+// holds m.direct while it creates the room and writes m.direct back, and the
+// sync task may hold a third; beyond that, documents go to the heap. Only
+// responses live here: URLs and serialized request bodies are still Strings.
+class MatrixJsonPool {
+public:
+    explicit MatrixJsonPool(size_t documentCapacity);
+
+    size_t getDocumentCapacity() const { return documentCapacity; }
+    unsigned long getMisses() const; // Documents that found every arena taken, or too small, and went to the heap
+
+private:
+    friend class MatrixJsonDocument;
+
+    char* acquire(size_t bodyCapacity);
+    void release(char* arena);
+
+    mutable std::mutex mutex;
+    const size_t documentCapacity;
+    size_t bodyCapacity = 0; // Of the allocated arenas, they are replaced when a larger one is asked for while none is lent out
+    std::unique_ptr<char[]> memory;
+    bool lent[MATRIX_JSON_ARENAS] = {};
+    unsigned long misses = 0;
+};
+
+// A JSON document in an arena borrowed from the pool for as long as the
+// document lives. capacity is the room the endpoint needs for the shape of
+// its response and may not exceed the document capacity of the pool.
+class MatrixJsonDocument : public JsonDocument {
+public:
+    MatrixJsonDocument(MatrixJsonPool& pool, size_t capacity, size_t bodyCapacity);
+    ~MatrixJsonDocument();
+    MatrixJsonDocument(const MatrixJsonDocument&) = delete;
+    MatrixJsonDocument& operator=(const MatrixJsonDocument&) = delete;
+
+    char* body() { return bodyBuffer; }  // Always NUL terminated
+    const char* body() const { return bodyBuffer; }
+    size_t bodyCapacity() const { return bodySize; } // Without the terminator
+
+private:
+    MatrixJsonDocument(MatrixJsonPool& pool, size_t capacity, size_t bodyCapacity, char* arena);
+
+    MatrixJsonPool* pool;
+    char* arena;
+    char* bodyBuffer;
+    size_t bodySize;
+    char emptyBody[1] = {0};
+};
+
+#endif // MATRIX_JSON_POOL_H
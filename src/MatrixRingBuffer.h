@@ -0,0 +1,82 @@
+#ifndef MATRIX_RING_BUFFER_H
+#define MATRIX_RING_BUFFER_H
+
+#include <stddef.h>
+#include <vector>
+
+// Fixed-capacity FIFO whose slots are allocated once and then reused, so
+// members that own heap memory (like String) keep their buffers from one
+// round to the next instead of being freed and allocated again.
+template <typename T>
+class MatrixRingBuffer {
+public:
+    explicit MatrixRingBuffer(size_t capacity = 0) : slots(capacity) {}
+
+    // Drops the current contents.
+    void setCapacity(size_t capacity) {
+        slots.clear();
+        slots.resize(capacity);
+        head = 0;
+        count = 0;
+    }
+
+    size_t capacity() const { return slots.size(); }
+    size_t size() const { return count; }
+    size_t available() const { return slots.size() - count; }
+    bool empty() const { return count == 0; }
+    bool full() const { return count == slots.size(); }
+
+    // Appends a slot and returns it for the caller to fill in; it still holds
+    // whatever was stored there before. When full, the oldest element is
+    // given up if overwrite is set, otherwise nothing is added and nullptr is
+    // returned.
+    T* push(bool overwrite) {
+        if (slots.empty()) {
+            return nullptr;
+        }
+        if (full()) {
+            if (!overwrite) {
+                return nullptr;
+            }
+            pop();
+        }
+        T* slot = &slots[(head + count) % slots.size()];
+        count++;
+        return slot;
+    }
+
+    T& front() { return slots[head]; }
+
+    void pop() {
+        if (count == 0) {
+            return;
+        }
+        head = (head + 1) % slots.size();
+        count--;
+    }
+
+    void clear() {
+        head = 0;
+        count = 0;
+    }
+
+    // Hands up to maxCount elements to visitor in place, oldest first, and
+    // removes them. Returns how many were visited.
+    template <typename Visitor>
+    size_t consume(Visitor visitor, size_t maxCount = (size_t)-1) {
+        size_t visited = 0;
+        while (count > 0 && visited < maxCount) {
+            visitor(front());
+            pop();
+            visited++;
+        }
+        return visited;
+    }
+
+private:
+    std::vector<T> slots;
+    size_t head = 0;
+    size_t count = 0;
+};
+
+#endif // MATRIX_RING_BUFFER_H
@@ -0,0 +1,117 @@
+#include "MatrixSessionStore.h"
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <Preferences.h>
+
+bool MatrixPreferencesStore::load(MatrixSession& session) {
+    Preferences preferences;
+    if (!preferences.begin(name, true)) {
+        return false;
+    }
+    session.loginUser = preferences.getString("user", "");
+    session.homeserverUrl = preferences.getString("server", "");
+    session.userId = preferences.getString("userId", "");
+    session.accessToken = preferences.getString("access", "");
+    session.refreshToken = preferences.getString("refresh", "");
+    session.tokenExpiresAt = preferences.getLong64("expires", 0);
+    session.syncToken = preferences.getString("since", "");
+    session.syncFilterId = preferences.getString("filter", "");
+    session.masterRoomId = preferences.getString("dmRoom", "");
+    preferences.end();
+    return !session.accessToken.isEmpty();
+}
+
+// putString() returns the number of bytes written, 0 when it fails
+static bool putString(Preferences& preferences, const char* key, const String& value) {
+    return preferences.putString(key, value) == value.length();
+}
+
+bool MatrixPreferencesStore::save(const MatrixSession& session) {
+    Preferences preferences;
+    if (!preferences.begin(name, false)) {
+        return false;
+    }
+    // NVS skips writes of unchanged values, so only what changed wears the flash.
+    // Every value is written even after a failure, the others may still fit.
+    bool saved = putString(preferences, "user", session.loginUser);
+    saved &= putString(preferences, "server", session.homeserverUrl);
+    saved &= putString(preferences, "userId", session.userId);
+    saved &= putString(preferences, "access", session.accessToken);
+    saved &= putString(preferences, "refresh", session.refreshToken);
+    saved &= preferences.putLong64("expires", session.tokenExpiresAt) == sizeof(int64_t);
+    saved &= putString(preferences, "since", session.syncToken);
+    saved &= putString(preferences, "filter", session.syncFilterId);
+    saved &= putString(preferences, "dmRoom", session.masterRoomId);
+    preferences.end();
+    return saved;
+}
+
+void MatrixPreferencesStore::clear() {
+    Preferences preferences;
+    if (preferences.begin(name, false)) {
+        preferences.clear();
+        preferences.end();
+    }
+}
+#endif
+
+#if !defined(ARDUINO)
+#include <stdio.h>
+
+static const char* const SESSION_FILE_HEADER = "matrix-session 1";
+
+static bool readLine(FILE* file, String& value) {
+    char line[1024];
+    if (!fgets(line, sizeof(line), file)) {
+        return false;
+    }
+    line[strcspn(line, "\r\n")] = 0;
+    value = line;
+    return true;
+}
+
+bool MatrixFileStore::load(MatrixSession& session) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+        return false;
+    }
+    String header;
+    String expires;
+    bool complete = readLine(file, header) && header == SESSION_FILE_HEADER &&
+                    readLine(file, session.loginUser) &&
+                    readLine(file, session.homeserverUrl) &&
+                    readLine(file, session.userId) &&
+                    readLine(file, session.accessToken) &&
+                    readLine(file, session.refreshToken) &&
+                    readLine(file, expires) &&
+                    readLine(file, session.syncToken) &&
+                    readLine(file, session.syncFilterId) &&
+                    readLine(file, session.masterRoomId);
+    fclose(file);
+    session.tokenExpiresAt = atoll(expires.c_str());
+    return complete && !session.accessToken.isEmpty();
+}
+
+// Writes a temporary file first and renames it, so a crash never leaves a
+// half written session behind.
+bool MatrixFileStore::save(const MatrixSession& session) {
+    String temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    int written = fprintf(file, "%s\n%s\n%s\n%s\n%s\n%s\n%lld\n%s\n%s\n%s\n", SESSION_FILE_HEADER,
+                          session.loginUser.c_str(), session.homeserverUrl.c_str(), session.userId.c_str(),
+                          session.accessToken.c_str(), session.refreshToken.c_str(), (long long)session.tokenExpiresAt,
+                          session.syncToken.c_str(), session.syncFilterId.c_str(), session.masterRoomId.c_str());
+    if (fclose(file) != 0 || written < 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    return rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+void MatrixFileStore::clear() {
+    remove(path.c_str());
+}
+#endif
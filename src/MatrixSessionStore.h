@@ -0,0 +1,60 @@
+#ifndef MATRIX_SESSION_STORE_H
+#define MATRIX_SESSION_STORE_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Everything needed to resume a session without discovery, login or an
+// initial sync.
+struct MatrixSession {
+    String loginUser;      // The user name login() was called with
+    String homeserverUrl;
+    String userId;
+    String accessToken;
+    String refreshToken;
+    int64_t tokenExpiresAt = 0; // Wall-clock expiry in seconds since the epoch, 0 when the token does not expire
+    String syncToken;
+    String syncFilterId;
+    String masterRoomId;
+};
+
+// Persists a MatrixSession across restarts.
+class MatrixSessionStore {
+public:
+    virtual ~MatrixSessionStore() {}
+    virtual bool load(MatrixSession& session) = 0;
+    virtual bool save(const MatrixSession& session) = 0;
+    virtual void clear() = 0;
+};
+
+#if defined(ARDUINO_ARCH_ESP32)
+// Keeps the session in NVS through the Preferences library.
+class MatrixPreferencesStore : public MatrixSessionStore {
+public:
+    explicit MatrixPreferencesStore(const char* name = "matrix") : name(name) {}
+
+    bool load(MatrixSession& session) override;
+    bool save(const MatrixSession& session) override;
+    void clear() override;
+
+private:
+    const char* name;
+};
+#endif
+
+#if !defined(ARDUINO)
+// Keeps the session in a file, for the host build.
+class MatrixFileStore : public MatrixSessionStore {
+public:
+    explicit MatrixFileStore(const String& path) : path(path) {}
+
+    bool load(MatrixSession& session) override;
+    bool save(const MatrixSession& session) override;
+    void clear() override;
+
+private:
+    String path;
+};
+#endif
+
+#endif // MATRIX_SESSION_STORE_H
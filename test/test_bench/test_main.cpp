@@ -0,0 +1,259 @@
+// Host benchmarks for the hot paths of MatrixClient, run with `pio test -e native -v`.
+// Every request is answered by MockClient, so the numbers only cover the work done
+// on the device side: building requests, parsing responses and heap usage.
+#include <Arduino.h>
+#include <MatrixClient.h>
+#include <MatrixClientPool.h>
+#include <MockClient.h>
+#include <unity.h>
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+static const char* ROOM_ID = "!bench:example.org";
+
+static MockClient mock;
+static MatrixClient* matrixClient = nullptr;
+static int syncEventCount = 0;
+
+struct BenchResult {
+    unsigned long iterations;
+    unsigned long averageMicros;
+    size_t bytesWritten;
+    unsigned long writes;
+    size_t bytesRead;
+    size_t allocations;
+    size_t bytesAllocated;
+    size_t peakHeap;
+    unsigned long poolMisses;
+};
+
+// Every response brings new event IDs, repeated ones would be dropped as duplicates
+static std::string syncPayload(int eventCount) {
+    static unsigned long syncSerial = 0;
+    syncSerial++;
+    std::string body = "{\"next_batch\":\"s_next\",\"rooms\":{\"join\":{\"";
+    body += ROOM_ID;
+    body += "\":{\"timeline\":{\"events\":[";
+    for (int i = 0; i < eventCount; i++) {
+        if (i > 0) {
+            body += ",";
+        }
+        body += "{\"type\":\"m.room.message\",\"event_id\":\"$event" + std::to_string(syncSerial) + "_" + std::to_string(i) +
+                "\",\"sender\":\"@user:example.org\",\"origin_server_ts\":1700000000000,"
+                "\"unsigned\":{\"age\":1234},\"content\":{\"msgtype\":\"m.text\","
+                "\"body\":\"Benchmark message number " + std::to_string(i) + "\"}}";
+    }
+    body += "]}}}}}";
+    return body;
+}
+
+static std::string respond(const std::string& request) {
+    if (request.find("/.well-known/") != std::string::npos) {
+        return MockClient::response(200, "{\"m.homeserver\":{\"base_url\":\"https://example.org\"}}");
+    }
+    if (request.find("/login") != std::string::npos) {
+        return MockClient::response(200,
+            "{\"access_token\":\"token\",\"refresh_token\":\"refresh\",\"expires_in_ms\":3600000,"
+            "\"user_id\":\"@bench:example.org\",\"device_id\":\"BENCH\"}");
+    }
+    if (request.find("/filter") != std::string::npos) {
+        return MockClient::response(200, "{\"filter_id\":\"1\"}");
+    }
+    if (request.find("/sync") != std::string::npos) {
+        if (request.find("since=") == std::string::npos) {
+            return MockClient::response(200, "{\"next_batch\":\"s_initial\"}");
+        }
+        return MockClient::response(200, syncPayload(syncEventCount));
+    }
+    if (request.find("/createRoom") != std::string::npos) {
+        return MockClient::response(200, "{\"room_id\":\"!dm:example.org\"}");
+    }
+    if (request.find("/account_data/m.direct") != std::string::npos) {
+        return MockClient::response(200, "{}");
+    }
+    if (request.find("/upload") != std::string::npos) {
+        return MockClient::response(200, "{\"content_uri\":\"mxc://example.org/media\"}");
+    }
+    if (request.find("/send/") != std::string::npos) {
+        return MockClient::response(200, "{\"event_id\":\"$sent\"}");
+    }
+    return MockClient::response(404, "{\"errcode\":\"M_NOT_FOUND\"}");
+}
+
+template <typename Operation>
+static BenchResult measure(unsigned long iterations, Operation operation) {
+    mock.resetStats();
+    nativeResetHeapPeak();
+    unsigned long missesBefore = matrixClient->getMetrics().jsonPoolMisses;
+    NativeHeapStats heapBefore = nativeHeapStats();
+    unsigned long start = micros();
+    for (unsigned long i = 0; i < iterations; i++) {
+        TEST_ASSERT_TRUE(operation());
+    }
+    unsigned long elapsed = micros() - start;
+    NativeHeapStats heapAfter = nativeHeapStats();
+
+    BenchResult result;
+    result.iterations = iterations;
+    result.averageMicros = elapsed / iterations;
+    result.bytesWritten = mock.stats().bytesWritten / iterations;
+    result.writes = mock.stats().writeCalls / iterations;
+    result.bytesRead = mock.stats().bytesRead / iterations;
+    result.allocations = (heapAfter.allocations - heapBefore.allocations) / iterations;
+    result.bytesAllocated = (heapAfter.bytesAllocated - heapBefore.bytesAllocated) / iterations;
+    result.peakHeap = heapAfter.peakBytesInUse - heapBefore.bytesInUse;
+    result.poolMisses = matrixClient->getMetrics().jsonPoolMisses - missesBefore;
+    return result;
+}
+
+static void report(const char* name, const BenchResult& result) {
+    char line[200];
+    snprintf(line, sizeof(line),
+             "%-24s %6lu runs %9lu us %8zu B out %4lu writes %9zu B in %7zu allocs %10zu B alloc %10zu B peak %3lu misses",
+             name, result.iterations, result.averageMicros, result.bytesWritten, result.writes, result.bytesRead,
+             result.allocations, result.bytesAllocated, result.peakHeap, result.poolMisses);
+    TEST_MESSAGE(line);
+}
+
+static void benchSync(int eventCount, unsigned long iterations) {
+    syncEventCount = eventCount;
+    // Room for every event of the response in the filtered document
+    matrixClient->syncDocumentSize = 1024 + eventCount * 256;
+    matrixClient->setEventBufferSize(eventCount);
+    BenchResult result = measure(iterations, [] {
+        size_t received = 0;
+        bool synced = matrixClient->sync();
+        matrixClient->consumeEvents([&received](const MatrixEvent&) {
+            received++;
+        });
+        return synced && received == (size_t)syncEventCount;
+    });
+    char name[32];
+    snprintf(name, sizeof(name), "sync (%d events)", eventCount);
+    report(name, result);
+}
+
+void setUp() {
+    mock = MockClient();
+    mock.setResponder(respond);
+    matrixClient = new MatrixClient(mock);
+    MatrixClient::logLevel = ERROR;
+    TEST_ASSERT_TRUE(matrixClient->login("@bench:example.org", "password", "example.org"));
+    TEST_ASSERT_TRUE(matrixClient->sync()); // initial sync, sets the since token
+}
+
+void tearDown() {
+    delete matrixClient;
+    matrixClient = nullptr;
+}
+
+void test_login() {
+    BenchResult result = measure(20, [] {
+        return matrixClient->login("@bench:example.org", "password", "example.org");
+    });
+    report("login", result);
+}
+
+void test_sync_10_events() {
+    benchSync(10, 50);
+}
+
+void test_sync_100_events() {
+    benchSync(100, 20);
+}
+
+void test_sync_1000_events() {
+    benchSync(1000, 5);
+}
+
+void test_sync_10000_events() {
+    benchSync(10000, 2);
+}
+
+void test_send_message() {
+    BenchResult result = measure(100, [] {
+        return matrixClient->sendMessageToRoom(ROOM_ID, "Benchmark message");
+    });
+    report("sendMessageToRoom", result);
+}
+
+void test_queue_burst() {
+    BenchResult result = measure(10, [] {
+        for (int i = 0; i < matrixClient->maxQueuedMessages; i++) {
+            if (matrixClient->queueMessage(ROOM_ID, "Burst message") == 0) {
+                return false;
+            }
+        }
+        return matrixClient->processQueue() == 0;
+    });
+    char name[32];
+    snprintf(name, sizeof(name), "queue burst (%d msgs)", matrixClient->maxQueuedMessages);
+    report(name, result);
+}
+
+void test_upload_media() {
+    static std::vector<uint8_t> image(16 * 1024, 0x5a);
+    BenchResult result = measure(20, [] {
+        return matrixClient->sendMediaToRoom(ROOM_ID, "bench.jpg", "image/jpeg", image.data(), image.size());
+    });
+    report("uploadMedia (16 KiB)", result);
+}
+
+// Every run has a new master user, so the DM room is looked up in m.direct,
+// created and recorded there, with the m.direct document held throughout
+void test_dm_master() {
+    static int masters = 0;
+    BenchResult result = measure(20, [] {
+        matrixClient->setMasterUserId("@master" + String(++masters) + ":example.org");
+        return matrixClient->sendDMToMaster("Benchmark message");
+    });
+    report("sendDMToMaster (new)", result);
+    TEST_ASSERT_EQUAL(0, result.poolMisses);
+}
+
+// Accounts share one pair of connections; the sync traffic goes through mock
+void test_pool_round() {
+    const size_t accountCount = 4;
+    MockClient requestMock;
+    requestMock.setResponder(respond);
+    MatrixClientPool pool;
+    for (size_t i = 0; i < accountCount; i++) {
+        TEST_ASSERT_TRUE(pool.addAccount(requestMock, mock).login("@bench:example.org", "password", "example.org"));
+    }
+    syncEventCount = 10;
+    auto round = [&pool, accountCount] {
+        size_t synced = 0;
+        unsigned long start = millis();
+        while (synced < accountCount && millis() - start < 5000) {
+            synced += pool.loop();
+        }
+        size_t received = pool.consumeEvents([](size_t, const MatrixEvent&) {});
+        return synced == accountCount && received == accountCount * syncEventCount;
+    };
+    size_t initialSyncs = 0;
+    while (initialSyncs < accountCount) {
+        initialSyncs += pool.loop();
+    }
+    BenchResult result = measure(20, round);
+    char name[32];
+    snprintf(name, sizeof(name), "pool round (%zu accounts)", accountCount);
+    report(name, result);
+    TEST_ASSERT_TRUE(pool.getConnectionStats().handshakes == 2); // one per connection, not per account
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_login);
+    RUN_TEST(test_sync_10_events);
+    RUN_TEST(test_sync_100_events);
+    RUN_TEST(test_sync_1000_events);
+    RUN_TEST(test_sync_10000_events);
+    RUN_TEST(test_send_message);
+    RUN_TEST(test_queue_burst);
+    RUN_TEST(test_upload_media);
+    RUN_TEST(test_dm_master);
+    RUN_TEST(test_pool_round);
+    return UNITY_END();
+}
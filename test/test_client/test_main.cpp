@@ -0,0 +1,723 @@
+// Behaviour tests of MatrixClient against a homeserver scripted with MockClient,
+// run with `pio test -e native -f test_client`.
+#include <Arduino.h>
+#include <MatrixClient.h>
+#include <MatrixClientPool.h>
+#include <MockClient.h>
+#include <unity.h>
+
+#include <stdio.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char* ROOM_ID = "!room:example.org";
+
+using Handler = std::function<std::string(const std::string& request)>;
+
+static MockClient mock;
+static MatrixClient* matrixClient = nullptr;
+static Handler handler; // Answers what the test scripts, an empty reply falls through to the defaults
+
+static bool contains(const std::string& text, const std::string& part) {
+    return text.find(part) != std::string::npos;
+}
+
+static std::string requestLine(const std::string& request) {
+    return request.substr(0, request.find("\r\n"));
+}
+
+static std::string requestBody(const std::string& request) {
+    return request.substr(request.find("\r\n\r\n") + 4);
+}
+
+static std::string message(const std::string& eventId, const std::string& body) {
+    return "{\"type\":\"m.room.message\",\"event_id\":\"" + eventId + "\",\"sender\":\"@user:example.org\","
+           "\"origin_server_ts\":1700000000000,\"content\":{\"msgtype\":\"m.text\",\"body\":\"" + body + "\"}}";
+}
+
+// A /v3/sync response with the events in the timeline of one room
+static std::string syncResponse(const std::string& nextBatch, const std::vector<std::string>& events, const std::string& timelineExtra = "") {
+    std::string body = "{\"next_batch\":\"" + nextBatch + "\",\"rooms\":{\"join\":{\"" + ROOM_ID + "\":{\"timeline\":{" + timelineExtra + "\"events\":[";
+    for (size_t i = 0; i < events.size(); i++) {
+        body += (i ? "," : "") + events[i];
+    }
+    return body + "]}}}}}";
+}
+
+static std::string respond(const std::string& request) {
+    if (handler) {
+        std::string reply = handler(request);
+        if (!reply.empty()) {
+            return reply;
+        }
+    }
+    if (contains(request, "/.well-known/")) {
+        return MockClient::response(200, "{\"m.homeserver\":{\"base_url\":\"https://example.org\"}}");
+    }
+    if (contains(request, "/login")) {
+        return MockClient::response(200,
+            "{\"access_token\":\"token\",\"refresh_token\":\"refresh\",\"expires_in_ms\":3600000,"
+            "\"user_id\":\"@bot:example.org\",\"device_id\":\"TEST\"}");
+    }
+    if (contains(request, "/filter")) {
+        return MockClient::response(200, "{\"filter_id\":\"1\"}");
+    }
+    if (contains(request, "/sync")) {
+        return MockClient::response(200, contains(request, "since=") ? "{\"next_batch\":\"s_next\"}" : "{\"next_batch\":\"s0\"}");
+    }
+    if (contains(request, "/send/")) {
+        return MockClient::response(200, "{\"event_id\":\"$sent\"}");
+    }
+    if (contains(request, "/read_markers")) {
+        return MockClient::response(200, "{}");
+    }
+    return MockClient::response(404, "{\"errcode\":\"M_NOT_FOUND\"}");
+}
+
+static std::vector<std::string> requestsTo(const std::string& path) {
+    std::vector<std::string> found;
+    for (const std::string& request : mock.requestLog()) {
+        if (contains(requestLine(request), path)) {
+            found.push_back(request);
+        }
+    }
+    return found;
+}
+
+static std::vector<std::string> consumeBodies() {
+    std::vector<std::string> bodies;
+    matrixClient->consumeEvents([&bodies](const MatrixEvent& event) {
+        bodies.push_back(event.messageContent.c_str());
+    });
+    return bodies;
+}
+
+void setUp() {
+    mock = MockClient();
+    mock.setResponder(respond);
+    handler = nullptr;
+    MatrixClient::logLevel = ERROR;
+    matrixClient = new MatrixClient(mock);
+    TEST_ASSERT_TRUE(matrixClient->login("@bot:example.org", "password", "example.org"));
+    mock.clearRequestLog();
+    mock.resetStats();
+}
+
+void tearDown() {
+    delete matrixClient;
+    matrixClient = nullptr;
+}
+
+void test_framing_keep_alive() {
+    int sends = 0;
+    handler = [&sends](const std::string& request) -> std::string {
+        if (!contains(request, "/send/")) {
+            return "";
+        }
+        std::string body = "{\"event_id\":\"$sent" + std::to_string(++sends) + "\"}";
+        return sends % 2 ? MockClient::chunkedResponse(200, body, 3) : MockClient::response(200, body);
+    };
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_TRUE(matrixClient->sendMessageToRoom(ROOM_ID, "framed"));
+    }
+    TEST_ASSERT_EQUAL(4, sends);
+    TEST_ASSERT_EQUAL(0, mock.stats().connects); // all on the connection opened by login()
+}
+
+void test_server_closing_connection() {
+    mock.closeAfterResponse = true;
+    TEST_ASSERT_TRUE(matrixClient->sendMessageToRoom(ROOM_ID, "one")); // still on the connection of login()
+    TEST_ASSERT_TRUE(matrixClient->sendMessageToRoom(ROOM_ID, "two"));
+    TEST_ASSERT_TRUE(matrixClient->sendMessageToRoom(ROOM_ID, "three"));
+    TEST_ASSERT_EQUAL(2, mock.stats().connects);
+}
+
+static void syncThreeEvents(EventOverflowPolicy policy) {
+    matrixClient->eventOverflowPolicy = policy;
+    matrixClient->setEventBufferSize(2);
+    handler = [](const std::string& request) -> std::string {
+        if (contains(request, "/sync") && contains(request, "since=")) {
+            return MockClient::response(200, syncResponse("s1", {message("$1", "one"), message("$2", "two"), message("$3", "three")}));
+        }
+        return "";
+    };
+    TEST_ASSERT_TRUE(matrixClient->sync()); // initial
+    TEST_ASSERT_TRUE(matrixClient->sync());
+}
+
+void test_overflow_drop_oldest() {
+    syncThreeEvents(EVENTS_DROP_OLDEST);
+    std::vector<std::string> bodies = consumeBodies();
+    TEST_ASSERT_EQUAL(2, bodies.size());
+    TEST_ASSERT_EQUAL_STRING("two", bodies[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("three", bodies[1].c_str());
+    TEST_ASSERT_EQUAL(1, matrixClient->getDroppedEvents());
+}
+
+void test_overflow_drop_newest() {
+    syncThreeEvents(EVENTS_DROP_NEWEST);
+    std::vector<std::string> bodies = consumeBodies();
+    TEST_ASSERT_EQUAL(2, bodies.size());
+    TEST_ASSERT_EQUAL_STRING("one", bodies[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("two", bodies[1].c_str());
+    TEST_ASSERT_EQUAL(1, matrixClient->getDroppedEvents());
+}
+
+// A dropped event is not remembered as seen, so it is taken when the server
+// sends it again
+void test_dropped_event_not_duplicate() {
+    syncThreeEvents(EVENTS_DROP_NEWEST);
+    TEST_ASSERT_EQUAL(2, consumeBodies().size());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    std::vector<std::string> bodies = consumeBodies();
+    TEST_ASSERT_EQUAL(1, bodies.size());
+    TEST_ASSERT_EQUAL_STRING("three", bodies[0].c_str());
+    TEST_ASSERT_EQUAL(2, matrixClient->getDuplicateEvents());
+}
+
+void test_overflow_backpressure() {
+    matrixClient->eventOverflowPolicy = EVENTS_BACKPRESSURE;
+    matrixClient->setEventBufferSize(2);
+    handler = [](const std::string& request) -> std::string {
+        if (contains(request, "/sync") && contains(request, "since=s0")) {
+            return MockClient::response(200, syncResponse("s1", {message("$1", "one"), message("$2", "two")}));
+        }
+        return "";
+    };
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    size_t syncs = requestsTo("/sync").size();
+    TEST_ASSERT_FALSE(matrixClient->beginSync()); // buffer full, nothing is sent
+    TEST_ASSERT_EQUAL(syncs, requestsTo("/sync").size());
+    TEST_ASSERT_EQUAL(2, consumeBodies().size());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_EQUAL(0, matrixClient->getDroppedEvents());
+}
+
+// A sync with more events than there is room for keeps its token and is
+// repeated, the events already delivered are skipped
+void test_backpressure_repeats_sync() {
+    matrixClient->eventOverflowPolicy = EVENTS_BACKPRESSURE;
+    matrixClient->setEventBufferSize(2);
+    handler = [](const std::string& request) -> std::string {
+        if (contains(request, "/sync") && contains(request, "since=s0")) {
+            std::string room = std::string("{\"timeline\":{\"events\":[");
+            return MockClient::response(200, "{\"next_batch\":\"s1\",\"rooms\":{\"join\":{"
+                "\"!a:example.org\":" + room + message("$1", "one") + "," + message("$2", "two") + "]}},"
+                "\"!b:example.org\":" + room + message("$3", "three") + "," + message("$4", "four") + "]}}}}}");
+        }
+        return "";
+    };
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    std::vector<std::string> bodies = consumeBodies();
+    TEST_ASSERT_EQUAL(2, bodies.size());
+    TEST_ASSERT_EQUAL_STRING("two", bodies[1].c_str());
+
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    std::vector<std::string> syncs = requestsTo("/sync");
+    TEST_ASSERT_TRUE(contains(requestLine(syncs.back()), "since=s0"));
+    bodies = consumeBodies();
+    TEST_ASSERT_EQUAL(2, bodies.size());
+    TEST_ASSERT_EQUAL_STRING("three", bodies[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("four", bodies[1].c_str());
+
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_TRUE(contains(requestLine(requestsTo("/sync").back()), "since=s1"));
+    TEST_ASSERT_EQUAL(0, matrixClient->getDroppedEvents());
+}
+
+// The event index grows with the buffer, so a repeated sync with a full
+// buffer of events is recognised; an empty buffer is refused
+void test_event_buffer_size() {
+    matrixClient->setEventIndexSize(1);
+    matrixClient->setEventBufferSize(0);
+    matrixClient->setEventBufferSize(3);
+    handler = [](const std::string& request) -> std::string {
+        if (contains(request, "/sync") && contains(request, "since=")) {
+            return MockClient::response(200, syncResponse("s0", {message("$1", "one"), message("$2", "two"), message("$3", "three")}));
+        }
+        return "";
+    };
+    TEST_ASSERT_TRUE(matrixClient->sync()); // initial
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_EQUAL(3, consumeBodies().size());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_EQUAL(0, consumeBodies().size());
+    TEST_ASSERT_EQUAL(3, matrixClient->getDuplicateEvents());
+}
+
+void test_duplicate_events() {
+    handler = [](const std::string& request) -> std::string {
+        if (contains(request, "/sync") && contains(request, "since=")) {
+            return MockClient::response(200, syncResponse("s1", {message("$same", "once")}));
+        }
+        return "";
+    };
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_EQUAL(1, consumeBodies().size());
+    TEST_ASSERT_EQUAL(1, matrixClient->getDuplicateEvents());
+}
+
+void test_gap_backfill() {
+    matrixClient->backfillGaps = true;
+    matrixClient->backfillPageSize = 2;
+    handler = [](const std::string& request) -> std::string {
+        std::string line = requestLine(request);
+        if (contains(line, "/messages")) {
+            if (contains(line, "from=s0")) {
+                return MockClient::response(200, "{\"end\":\"p1\",\"chunk\":[" + message("$g1", "gap1") + "," + message("$g2", "gap2") + "]}");
+            }
+            return MockClient::response(200, "{\"chunk\":[]}");
+        }
+        if (contains(line, "/sync") && contains(line, "since=s0")) {
+            return MockClient::response(200, syncResponse("s1", {message("$live", "live")}, "\"limited\":true,\"prev_batch\":\"pb\","));
+        }
+        return "";
+    };
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_EQUAL(1, matrixClient->pendingTimelineGaps());
+    TEST_ASSERT_TRUE(matrixClient->sync()); // first page before the sync
+    TEST_ASSERT_TRUE(matrixClient->sync()); // empty page closes the gap
+    TEST_ASSERT_EQUAL(0, matrixClient->pendingTimelineGaps());
+
+    std::vector<std::string> pages = requestsTo("/messages");
+    TEST_ASSERT_EQUAL(2, pages.size());
+    TEST_ASSERT_TRUE(contains(requestLine(pages[0]), "dir=f&from=s0&to=pb&limit=2"));
+    TEST_ASSERT_TRUE(contains(requestLine(pages[1]), "from=p1&to=pb"));
+    std::vector<std::string> bodies = consumeBodies();
+    TEST_ASSERT_EQUAL(3, bodies.size());
+    TEST_ASSERT_EQUAL_STRING("live", bodies[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("gap1", bodies[1].c_str());
+    TEST_ASSERT_EQUAL_STRING("gap2", bodies[2].c_str());
+}
+
+void test_sliding_sync_position_reset() {
+    MatrixSlidingSync config;
+    config.enabled = true;
+    matrixClient->setSlidingSync(config);
+    handler = [](const std::string& request) -> std::string {
+        if (!contains(request, "simplified_msc3575/sync")) {
+            return "";
+        }
+        if (contains(requestLine(request), "pos=p1")) {
+            return MockClient::response(400, "{\"errcode\":\"M_UNKNOWN_POS\",\"error\":\"Unknown position\"}");
+        }
+        return MockClient::response(200, "{\"pos\":\"p1\"}");
+    };
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_FALSE(matrixClient->sync());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+
+    std::vector<std::string> syncs = requestsTo("simplified_msc3575/sync");
+    TEST_ASSERT_EQUAL(3, syncs.size());
+    TEST_ASSERT_FALSE(contains(requestLine(syncs[0]), "pos="));
+    TEST_ASSERT_TRUE(contains(requestLine(syncs[1]), "pos=p1"));
+    TEST_ASSERT_FALSE(contains(requestLine(syncs[2]), "pos="));
+}
+
+void test_session_round_trip() {
+    const char* path = "test_client_session.txt";
+    remove(path);
+    MatrixFileStore store(path);
+    {
+        MatrixClient client(mock);
+        client.setSessionStore(&store);
+        TEST_ASSERT_TRUE(client.login("@bot:example.org", "password", "example.org"));
+        TEST_ASSERT_TRUE(client.sync());
+        TEST_ASSERT_TRUE(client.saveSession());
+    }
+
+    MatrixSession session;
+    TEST_ASSERT_TRUE(store.load(session));
+    TEST_ASSERT_EQUAL_STRING("token", session.accessToken.c_str());
+    TEST_ASSERT_EQUAL_STRING("s0", session.syncToken.c_str());
+
+    mock.clearRequestLog();
+    MatrixClient resumed(mock);
+    resumed.setSessionStore(&store);
+    TEST_ASSERT_TRUE(resumed.login("@bot:example.org", "password", "example.org"));
+    TEST_ASSERT_EQUAL(0, mock.requestLog().size()); // no discovery, no login
+    TEST_ASSERT_TRUE(resumed.sync());
+    TEST_ASSERT_TRUE(contains(requestLine(mock.requestLog()[0]), "since=s0"));
+    remove(path);
+}
+
+// An upload that finds the kept-alive connection closed by the server is
+// sent again in full on a new one
+void test_upload_stale_connection() {
+    matrixClient->uploadChunkSize = 4;
+    int uploads = 0;
+    handler = [&uploads](const std::string& request) -> std::string {
+        if (!contains(request, "/upload")) {
+            return "";
+        }
+        if (++uploads == 1) {
+            mock.serverClose();
+            return "";
+        }
+        return MockClient::response(200, "{\"content_uri\":\"mxc://example.org/file\"}");
+    };
+    const uint8_t data[] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    String uri = matrixClient->uploadMedia("file.bin", "application/octet-stream", data, sizeof(data));
+    TEST_ASSERT_EQUAL_STRING("mxc://example.org/file", uri.c_str());
+    TEST_ASSERT_EQUAL(2, uploads);
+    TEST_ASSERT_EQUAL(1, mock.stats().connects);
+    TEST_ASSERT_EQUAL_STRING("0123456789", requestBody(requestsTo("/upload").back()).c_str());
+}
+
+void test_range_download() {
+    const std::string file = "0123456789";
+    handler = [&file](const std::string& request) -> std::string {
+        if (!contains(request, "/media/download/")) {
+            return "";
+        }
+        size_t range = request.find("Range: bytes=");
+        if (range == std::string::npos) {
+            return MockClient::response(200, file);
+        }
+        size_t offset = strtoul(request.c_str() + range + 13, nullptr, 10);
+        return MockClient::response(206, file.substr(offset));
+    };
+
+    std::string received;
+    MatrixClient::MediaWriter writer = [&received](const uint8_t* data, size_t length) {
+        received.append((const char*)data, length);
+        return true;
+    };
+    TEST_ASSERT_TRUE(matrixClient->downloadMedia("mxc://example.org/file", writer, 4));
+    TEST_ASSERT_EQUAL_STRING("456789", received.c_str());
+    TEST_ASSERT_TRUE(contains(mock.requestLog().back(), "Range: bytes=4-\r\n"));
+
+    // A server that ignores the range sends everything, the start is skipped
+    handler = [&file](const std::string& request) -> std::string {
+        return contains(request, "/media/download/") ? MockClient::response(200, file) : "";
+    };
+    received.clear();
+    TEST_ASSERT_TRUE(matrixClient->downloadMedia("mxc://example.org/file", writer, 7));
+    TEST_ASSERT_EQUAL_STRING("789", received.c_str());
+    TEST_ASSERT_FALSE(matrixClient->downloadMedia("mxc://example.org/file", writer, 0, 5));
+}
+
+void test_read_marker_coalescing() {
+    for (int i = 0; i < 10; i++) {
+        matrixClient->markRead(i % 2 ? "!a:example.org" : "!b:example.org", "$event" + String(i));
+    }
+    TEST_ASSERT_EQUAL(0, requestsTo("/read_markers").size());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+
+    std::vector<std::string> markers = requestsTo("/read_markers");
+    TEST_ASSERT_EQUAL(2, markers.size());
+    for (const std::string& marker : markers) {
+        std::string latest = contains(requestLine(marker), "!a:example.org") ? "$event9" : "$event8";
+        TEST_ASSERT_TRUE(contains(requestBody(marker), "\"m.fully_read\":\"" + latest + "\""));
+        TEST_ASSERT_TRUE(contains(requestBody(marker), "\"m.read\":\"" + latest + "\""));
+    }
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_EQUAL(2, requestsTo("/read_markers").size());
+}
+
+void test_long_messages() {
+    std::string longBody(2000, 'a');
+    TEST_ASSERT_TRUE(matrixClient->sendMessageToRoom(ROOM_ID, longBody.c_str()));
+    TEST_ASSERT_TRUE(contains(requestBody(requestsTo("/send/").back()), "\"body\":\"" + longBody + "\""));
+
+    // Queued messages, one at a time, pipelined and coalesced
+    for (int depth : {1, 3}) {
+        mock.clearRequestLog();
+        matrixClient->pipelineDepth = depth;
+        for (char c : {'x', 'y', 'z'}) {
+            TEST_ASSERT_TRUE(matrixClient->queueMessage(depth == 1 ? ROOM_ID : ("!" + String(c) + ":example.org"), std::string(600, c).c_str()) != 0);
+        }
+        while (matrixClient->queuedMessages() > 0) {
+            matrixClient->processQueue();
+        }
+        std::vector<std::string> sends = requestsTo("/send/");
+        TEST_ASSERT_EQUAL(3, sends.size());
+        for (size_t i = 0; i < sends.size(); i++) {
+            TEST_ASSERT_TRUE(contains(requestBody(sends[i]), "\"body\":\"" + std::string(600, "xyz"[i]) + "\""));
+        }
+    }
+
+    mock.clearRequestLog();
+    matrixClient->pipelineDepth = 1;
+    matrixClient->coalesceMessages = true;
+    matrixClient->queueMessage(ROOM_ID, std::string(600, 'x').c_str());
+    matrixClient->queueMessage(ROOM_ID, std::string(600, 'y').c_str());
+    matrixClient->processQueue();
+    std::vector<std::string> sends = requestsTo("/send/");
+    TEST_ASSERT_EQUAL(1, sends.size());
+    TEST_ASSERT_TRUE(contains(requestBody(sends[0]), std::string(600, 'x') + "\\n" + std::string(600, 'y')));
+}
+
+// A message is sent once when two threads drain the queue together
+void test_queue_drained_once() {
+    mock.firstByteDelay = 50; // the first thread is still waiting for the answer
+    TEST_ASSERT_TRUE(matrixClient->queueMessage(ROOM_ID, "once") != 0);
+    std::thread other([] { matrixClient->processQueue(); });
+    delay(10);
+    TEST_ASSERT_EQUAL(1, matrixClient->processQueue());
+    other.join();
+    TEST_ASSERT_EQUAL(0, matrixClient->queuedMessages());
+    TEST_ASSERT_EQUAL(1, requestsTo("/send/").size());
+}
+
+// The low point of the heap in the middle of a request is reported, not only
+// the free heap at its start and end
+void test_request_heap_low() {
+    MatrixRequestMetrics seen;
+    matrixClient->setMetricsCallback([&seen](const MatrixRequestMetrics& metrics) {
+        seen = metrics;
+    });
+    handler = [](const std::string& request) -> std::string {
+        if (contains(request, "/send/")) {
+            std::vector<char> spike(64 * 1024, 1); // freed before the response is read
+            TEST_ASSERT_EQUAL(1, spike.back());
+        }
+        return "";
+    };
+    nativeResetHeapPeak();
+    uint32_t before = ESP.getFreeHeap();
+    TEST_ASSERT_TRUE(matrixClient->sendMessageToRoom(ROOM_ID, "spike"));
+    TEST_ASSERT_TRUE(seen.minFreeHeap <= before - 64 * 1024);
+}
+
+void test_sync_schedule() {
+    bool withEvents = false;
+    int serial = 0;
+    handler = [&withEvents, &serial](const std::string& request) -> std::string {
+        if (!contains(request, "/sync") || !contains(request, "since=")) {
+            return "";
+        }
+        std::string token = "s" + std::to_string(++serial);
+        return MockClient::response(200, withEvents ? syncResponse(token, {message("$e" + token, "hi")}) : "{\"next_batch\":\"" + token + "\"}");
+    };
+    MatrixSyncSchedule schedule;
+    schedule.enabled = true;
+    schedule.activeTimeout = 1000;
+    schedule.idleTimeout = 6000;
+    schedule.latencyTarget = 800;
+    matrixClient->setSyncSchedule(schedule);
+
+    for (int i = 0; i < 5; i++) {
+        TEST_ASSERT_TRUE(matrixClient->sync());
+    }
+    std::vector<std::string> syncs = requestsTo("/sync");
+    TEST_ASSERT_FALSE(contains(requestLine(syncs[0]), "timeout=")); // the initial sync is never held
+    TEST_ASSERT_TRUE(contains(requestLine(syncs[1]), "timeout=2000"));
+    TEST_ASSERT_TRUE(contains(requestLine(syncs[2]), "timeout=4000"));
+    TEST_ASSERT_TRUE(contains(requestLine(syncs[3]), "timeout=6000"));
+    MatrixSyncPlan plan = matrixClient->getSyncPlan();
+    TEST_ASSERT_EQUAL(6000, plan.timeout);
+    TEST_ASSERT_EQUAL(800, plan.pause);
+    TEST_ASSERT_EQUAL(800, matrixClient->getSyncDelay());
+    TEST_ASSERT_EQUAL(3600000UL / 6800, plan.requestsPerHour);
+
+    withEvents = true;
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    plan = matrixClient->getSyncPlan();
+    TEST_ASSERT_EQUAL(1000, plan.timeout);
+    TEST_ASSERT_EQUAL(0, plan.pause);
+
+    schedule.enabled = false;
+    matrixClient->setSyncSchedule(schedule);
+    TEST_ASSERT_EQUAL(0, matrixClient->getSyncDelay());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_TRUE(contains(requestLine(mock.requestLog().back()), "timeout=5000"));
+}
+
+static std::vector<std::string> manyMessages(const std::string& prefix, int count) {
+    std::vector<std::string> events;
+    for (int i = 0; i < count; i++) {
+        events.push_back(message(prefix + std::to_string(i), "A message that takes some room in the document, number " + std::to_string(i)));
+    }
+    return events;
+}
+
+void test_sync_document_growth() {
+    matrixClient->syncDocumentSize = 512;
+    matrixClient->maxSyncDocumentSize = 65536;
+    matrixClient->setEventBufferSize(32);
+    handler = [](const std::string& request) -> std::string {
+        if (contains(request, "/sync") && contains(request, "since=s0")) {
+            return MockClient::response(200, syncResponse("s1", manyMessages("$big", 20)));
+        }
+        return "";
+    };
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_FALSE(matrixClient->sync());
+    int attempts = 1;
+    while (!matrixClient->sync() && attempts < 8) {
+        attempts++;
+    }
+    TEST_ASSERT_EQUAL(attempts, matrixClient->getMetrics().syncOverflows);
+    TEST_ASSERT_EQUAL(20, consumeBodies().size());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_TRUE(contains(requestLine(mock.requestLog().back()), "since=s1"));
+}
+
+// Parses the timeline limit of an inline filter, 0 for the uploaded one
+static int inlineTimelineLimit(const std::string& request) {
+    size_t limit = request.find("limit%22%3A");
+    return limit == std::string::npos || limit > request.find("\r\n") ? 0 : atoi(request.c_str() + limit + 11);
+}
+
+void test_sync_timeline_reduction() {
+    matrixClient->syncDocumentSize = 1024;
+    matrixClient->maxSyncDocumentSize = 1024;
+    std::vector<int> limits;
+    handler = [&limits](const std::string& request) -> std::string {
+        if (!contains(request, "/sync") || !contains(request, "since=")) {
+            return "";
+        }
+        if (contains(request, "since=s1")) {
+            return MockClient::response(200, "{\"next_batch\":\"s2\"}");
+        }
+        int limit = inlineTimelineLimit(request);
+        limits.push_back(limit);
+        return MockClient::response(200, syncResponse("s1", manyMessages("$cut", limit ? limit : 10), "\"limited\":true,\"prev_batch\":\"pb\","));
+    };
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    int attempts = 0;
+    while (!matrixClient->sync() && attempts < 6) {
+        attempts++;
+    }
+    TEST_ASSERT_TRUE(attempts > 0 && attempts < 6);
+    TEST_ASSERT_EQUAL(0, limits[0]);
+    for (size_t i = 1; i < limits.size(); i++) {
+        TEST_ASSERT_EQUAL(limits[i - 1] ? limits[i - 1] / 2 : 5, limits[i]); // halved every time
+    }
+    TEST_ASSERT_EQUAL(limits.back(), consumeBodies().size());
+    TEST_ASSERT_TRUE(matrixClient->sync());
+    TEST_ASSERT_TRUE(contains(requestLine(mock.requestLog().back()), "filter=1&since=s1")); // back to the full limit
+}
+
+// Accounts sharing the connections of a pool must be on one homeserver
+void test_pool_homeserver_check() {
+    MockClient syncs;
+    Handler server = [](const std::string& request) -> std::string {
+        if (contains(request, "/.well-known/") && contains(request, "Host: other.org")) {
+            return MockClient::response(200, "{\"m.homeserver\":{\"base_url\":\"https://matrix.other.org\"}}");
+        }
+        return respond(request);
+    };
+    mock.setResponder(server);
+    syncs.setResponder(server);
+    MatrixClientPool pool;
+    TEST_ASSERT_TRUE(pool.addAccount(mock, syncs).login("@one:example.org", "password", "example.org"));
+    TEST_ASSERT_TRUE(pool.addAccount(mock, syncs).login("@two:example.org", "password", "example.org"));
+    TEST_ASSERT_FALSE(pool.addAccount(mock, syncs).login("@three:other.org", "password", "other.org"));
+    TEST_ASSERT_FALSE(pool.getAccount(2).isLoggedIn());
+    for (const std::string& request : mock.requestLog()) {
+        TEST_ASSERT_FALSE(contains(request, "Host: matrix.other.org"));
+    }
+}
+
+// The pool caps the long-poll of each account at its share of the round
+// without overwriting the account's own syncTimeout
+void test_pool_sync_timeout() {
+    MockClient syncs;
+    syncs.setResponder(respond);
+    MatrixClientPool pool;
+    pool.syncTimeout = 4000;
+    MatrixClient& first = pool.addAccount(mock, syncs);
+    MatrixClient& second = pool.addAccount(mock, syncs);
+    second.syncTimeout = 500;
+    TEST_ASSERT_TRUE(first.login("@one:example.org", "password", "example.org"));
+    TEST_ASSERT_TRUE(second.login("@two:example.org", "password", "example.org"));
+    size_t synced = 0;
+    unsigned long start = millis();
+    while (synced < 4 && millis() - start < 5000) {
+        synced += pool.loop();
+    }
+    TEST_ASSERT_EQUAL(4, synced);
+
+    std::vector<std::string> timeouts;
+    for (const std::string& request : syncs.requestLog()) {
+        std::string line = requestLine(request);
+        if (contains(line, "since=")) {
+            timeouts.push_back(line.substr(line.find("timeout=")));
+        }
+    }
+    TEST_ASSERT_TRUE(timeouts.size() >= 2); // the next round may have begun
+    TEST_ASSERT_TRUE(contains(timeouts[0], "timeout=2000 "));
+    TEST_ASSERT_TRUE(contains(timeouts[1], "timeout=500 "));
+    TEST_ASSERT_EQUAL(5000, first.syncTimeout);
+    TEST_ASSERT_EQUAL(500, second.syncTimeout);
+}
+
+// The sync task and the application both find the token expired; the
+// refresh token may only be spent once
+void test_concurrent_token_refresh() {
+    std::mutex serverMutex;
+    std::string validRefresh = "refresh";
+    int refreshes = 0;
+    int rejected = 0;
+    auto server = [&](const std::string& request) -> std::string {
+        std::lock_guard<std::mutex> lock(serverMutex);
+        if (contains(request, "/login")) {
+            return MockClient::response(200, "{\"access_token\":\"token\",\"refresh_token\":\"refresh\",\"expires_in_ms\":5000,\"user_id\":\"@bot:example.org\"}");
+        }
+        if (contains(request, "/refresh")) {
+            if (!contains(requestBody(request), "\"" + validRefresh + "\"")) {
+                rejected++;
+                return MockClient::response(401, "{\"errcode\":\"M_UNKNOWN_TOKEN\"}");
+            }
+            validRefresh = "refresh" + std::to_string(++refreshes);
+            return MockClient::response(200, "{\"access_token\":\"fresh\",\"refresh_token\":\"" + validRefresh + "\",\"expires_in_ms\":3600000}");
+        }
+        if (!contains(request, "/login") && !contains(request, "/.well-known/") && !contains(request, "Authorization: Bearer fresh")) {
+            return MockClient::response(401, "{\"errcode\":\"M_UNKNOWN_TOKEN\"}");
+        }
+        return respond(request);
+    };
+    MockClient requests;
+    MockClient syncs;
+    requests.setResponder(server);
+    syncs.setResponder(server);
+    MatrixClient client(requests, syncs);
+    TEST_ASSERT_TRUE(client.login("@bot:example.org", "password", "example.org"));
+    requests.firstByteDelay = 50; // the refresh of the sync task is still under way when the message goes out
+    TEST_ASSERT_TRUE(client.startSyncTask());
+    delay(10);
+    bool sent = client.sendMessageToRoom(ROOM_ID, "while syncing");
+    client.stopSyncTask();
+    TEST_ASSERT_TRUE(sent);
+    TEST_ASSERT_EQUAL(1, refreshes);
+    TEST_ASSERT_EQUAL(0, rejected);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_framing_keep_alive);
+    RUN_TEST(test_server_closing_connection);
+    RUN_TEST(test_overflow_drop_oldest);
+    RUN_TEST(test_overflow_drop_newest);
+    RUN_TEST(test_dropped_event_not_duplicate);
+    RUN_TEST(test_overflow_backpressure);
+    RUN_TEST(test_backpressure_repeats_sync);
+    RUN_TEST(test_event_buffer_size);
+    RUN_TEST(test_duplicate_events);
+    RUN_TEST(test_gap_backfill);
+    RUN_TEST(test_sliding_sync_position_reset);
+    RUN_TEST(test_session_round_trip);
+    RUN_TEST(test_upload_stale_connection);
+    RUN_TEST(test_range_download);
+    RUN_TEST(test_read_marker_coalescing);
+    RUN_TEST(test_long_messages);
+    RUN_TEST(test_queue_drained_once);
+    RUN_TEST(test_request_heap_low);
+    RUN_TEST(test_sync_schedule);
+    RUN_TEST(test_pool_homeserver_check);
+    RUN_TEST(test_pool_sync_timeout);
+    RUN_TEST(test_concurrent_token_refresh);
+    RUN_TEST(test_sync_document_growth);
+    RUN_TEST(test_sync_timeline_reduction);
+    return UNITY_END();
+}
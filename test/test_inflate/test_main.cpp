@@ -0,0 +1,446 @@
+// Tests of the gzip and deflate decoder of compressed responses, run with
+// `pio test -e native -f test_inflate`. The streams are assembled here bit by
+// bit, so every block type and wrapper is covered without a compressor.
+#include <Arduino.h>
+#include <MatrixHTTP.h>
+#include <MatrixInflate.h>
+#include <MockClient.h>
+#include <unity.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Writes deflate data least significant bit first, Huffman codes most
+// significant bit first, as RFC 1951 stores them.
+class DeflateWriter {
+public:
+    void bits(uint32_t value, int count) {
+        for (int i = 0; i < count; i++) {
+            bit((value >> i) & 1);
+        }
+    }
+
+    void code(uint32_t value, int length) {
+        for (int i = length - 1; i >= 0; i--) {
+            bit((value >> i) & 1);
+        }
+    }
+
+    void align() {
+        bitCount = 0;
+    }
+
+    void stored(const std::string& data, bool last) {
+        bits(last, 1);
+        bits(0, 2);
+        align();
+        uint16_t length = data.size();
+        for (uint16_t value : {length, (uint16_t)~length}) {
+            out += (char)(value & 0xff);
+            out += (char)(value >> 8);
+        }
+        out += data;
+    }
+
+    void beginFixed(bool last) {
+        bits(last, 1);
+        bits(1, 2);
+    }
+
+    void literal(int symbol) {
+        if (symbol < 144) {
+            code(0x30 + symbol, 8);
+        } else if (symbol < 256) {
+            code(0x190 + symbol - 144, 9);
+        } else if (symbol < 280) {
+            code(symbol - 256, 7);
+        } else {
+            code(0xc0 + symbol - 280, 8);
+        }
+    }
+
+    void match(int length, int distance) {
+        static const int lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const int lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const int distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        static const int distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        int symbol = length == 258 ? 28 : 0;
+        while (symbol < 27 && lengthBase[symbol + 1] <= length) {
+            symbol++;
+        }
+        literal(257 + symbol);
+        bits(length - lengthBase[symbol], lengthExtra[symbol]);
+        symbol = 0;
+        while (symbol < 29 && distanceBase[symbol + 1] <= distance) {
+            symbol++;
+        }
+        code(symbol, 5);
+        bits(distance - distanceBase[symbol], distanceExtra[symbol]);
+    }
+
+    void endBlock() {
+        literal(256);
+    }
+
+    // Flushes the partial byte, the caller appends whatever follows
+    std::string& finish() {
+        align();
+        return out;
+    }
+
+private:
+    void bit(int value) {
+        if (bitCount == 0) {
+            out += '\0';
+        }
+        out.back() = (char)(out.back() | (value << bitCount));
+        bitCount = (bitCount + 1) & 7;
+    }
+
+    std::string out;
+    int bitCount = 0;
+};
+
+// A sync response compressed by zlib at level 9 into one dynamic Huffman block
+static const uint8_t dynamicBlock[] = {
+    0xa5, 0x8e, 0xcf, 0x0e, 0x82, 0x30, 0x0c, 0xc6, 0x5f, 0x65, 0xf6, 0x4c, 0x48, 0x14, 0x10, 0xe1, 0xe4, 0xd5, 0x67, 0x30, 0x86, 0x6c, 0xa3, 0xc2,
+    0x0c, 0x5b, 0x91, 0x2d, 0x06, 0x42, 0x78, 0x77, 0xbb, 0x8b, 0x89, 0x37, 0x13, 0xdb, 0x43, 0xff, 0x7c, 0xe9, 0xef, 0xeb, 0x0a, 0x0e, 0xe7, 0xd0,
+    0x28, 0x19, 0x74, 0x0f, 0x35, 0xf8, 0xf2, 0x50, 0x54, 0x45, 0x93, 0xe7, 0xa7, 0xac, 0xd9, 0x57, 0x59, 0x0e, 0x09, 0x4c, 0x44, 0xd6, 0x43, 0xbd,
+    0xc2, 0x83, 0x8c, 0x8b, 0x75, 0x57, 0x1e, 0x8e, 0x9e, 0xf3, 0x59, 0xe3, 0x2c, 0xed, 0x38, 0x60, 0xaa, 0xc9, 0x46, 0x21, 0x18, 0x8b, 0x83, 0x71,
+    0x18, 0x7b, 0x7c, 0xa1, 0x0b, 0x7c, 0x76, 0xe5, 0xf5, 0x32, 0xf2, 0x0a, 0x6c, 0x1a, 0x49, 0xa9, 0x45, 0xef, 0x65, 0x87, 0x0c, 0xf6, 0xe8, 0x5a,
+    0x9c, 0x58, 0x39, 0xcb, 0xc1, 0x68, 0xfc, 0xa2, 0x25, 0xa0, 0xc9, 0x05, 0x46, 0x44, 0x96, 0xf5, 0xdd, 0x87, 0x11, 0xf8, 0x5b, 0x56, 0x15, 0xb5,
+    0x0b, 0xcf, 0x17, 0x21, 0xad, 0x90, 0xe2, 0x6e, 0x7c, 0x0f, 0xdb, 0x96, 0xfc, 0xe2, 0xa5, 0x48, 0xfd, 0xe9, 0x24, 0x02, 0x11, 0xbb, 0xdd, 0xb6,
+    0x18, 0x6f};
+static const char* dynamicText =
+    "{\"next_batch\":\"s72595_4483_1934\",\"rooms\":{\"join\":{\"!726s6s6q:example.com\":{\"timeline\":{\"events\":["
+    "{\"type\":\"m.room.message\",\"sender\":\"@alice:example.com\",\"content\":{\"msgtype\":\"m.text\",\"body\":\"I am a fish\"}},"
+    "{\"type\":\"m.room.message\",\"sender\":\"@bob:example.com\",\"content\":{\"msgtype\":\"m.text\",\"body\":\"I am a fish too\"}}]}}}}}";
+
+static const char* GZIP = "Content-Encoding: gzip\r\n";
+static const char* DEFLATE = "Content-Encoding: deflate\r\n";
+static const std::string NEXT_RESPONSE = "HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\n";
+
+static uint32_t crc32(const std::string& data) {
+    uint32_t crc = 0xffffffff;
+    for (unsigned char c : data) {
+        crc ^= c;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t adler32(const std::string& data) {
+    uint32_t a = 1;
+    uint32_t b = 0;
+    for (unsigned char c : data) {
+        a = (a + c) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+static void appendLittleEndian(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out += (char)(value >> (8 * i));
+    }
+}
+
+// With a file name and an extra field, which are skipped
+static std::string gzip(const std::string& deflated, const std::string& plain) {
+    std::string out("\x1f\x8b\x08\x0c\0\0\0\0\x02\x03", 10);
+    out += std::string("\x04\0abcd", 6);
+    out += std::string("sync.json\0", 10);
+    out += deflated;
+    appendLittleEndian(out, crc32(plain));
+    appendLittleEndian(out, plain.size());
+    return out;
+}
+
+static std::string zlib(const std::string& deflated, const std::string& plain) {
+    std::string out = "\x78\x9c" + deflated;
+    uint32_t checksum = adler32(plain);
+    for (int i = 3; i >= 0; i--) {
+        out += (char)(checksum >> (8 * i));
+    }
+    return out;
+}
+
+// A stored, a fixed and a dynamic Huffman block in one stream
+static std::string mixedBlocks(std::string& plain) {
+    DeflateWriter writer;
+    writer.stored("stored block, ", false);
+    writer.beginFixed(false);
+    for (char c : std::string("fixed block")) {
+        writer.literal((unsigned char)c);
+    }
+    writer.literal(0xe9); // a nine bit code
+    writer.match(11, 12);  // "fixed block"
+    writer.match(20, 1);   // a run overlapping the bytes it copies
+    writer.endBlock();
+    writer.stored("", false); // aligns the dynamic block, which zlib wrote from a byte boundary
+    std::string out = writer.finish();
+    out.append((const char*)dynamicBlock, sizeof(dynamicBlock));
+
+    plain = "stored block, fixed block\xe9" "fixed block" + std::string(20, 'k') + dynamicText;
+    return out;
+}
+
+static std::string chunk(const std::string& data) {
+    char size[16];
+    snprintf(size, sizeof(size), "%x\r\n", (unsigned)data.size());
+    return size + data + "\r\n";
+}
+
+// The compressed body in two chunks split at split, or with a Content-Length
+// when split is negative. Another response follows on the connection.
+static std::string compressedResponse(const std::string& packed, const char* encoding, long split = -1) {
+    if (split < 0) {
+        return MockClient::response(200, packed, encoding) + NEXT_RESPONSE;
+    }
+    std::string raw = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n" + std::string(encoding) + "\r\n";
+    if (split > 0) {
+        raw += chunk(packed.substr(0, split));
+    }
+    if ((size_t)split < packed.size()) {
+        raw += chunk(packed.substr(split));
+    }
+    return raw + "0\r\n\r\n" + NEXT_RESPONSE;
+}
+
+struct Decoded {
+    std::string text;
+    bool failed;
+    bool complete;
+    bool nextIntact;     // The response after it can still be read
+    unsigned long taken; // Compressed bytes taken from the body
+};
+
+static Decoded decode(const std::string& raw, size_t readSize = 64, size_t deliveryChunk = 0) {
+    MockClient mock;
+    mock.deliveryChunk = deliveryChunk;
+    mock.queueResponse(raw);
+    HTTPConnection link(mock);
+    TEST_ASSERT_TRUE(link.connect("example.org", 443, true));
+    link.beginRequest();
+    link.append("GET / HTTP/1.1\r\n\r\n");
+    TEST_ASSERT_TRUE(link.flushRequest());
+
+    HTTPResponse response;
+    TEST_ASSERT_TRUE(link.readResponseHeaders(response, 1000));
+    HTTPBodyStream body(link, response);
+    HTTPInflateStream stream(body, link, response);
+    TEST_ASSERT_TRUE(stream.isCompressed());
+
+    Decoded decoded;
+    std::vector<uint8_t> buffer(readSize);
+    size_t count;
+    while ((count = stream.readBody(buffer.data(), buffer.size())) > 0) {
+        decoded.text.append((const char*)buffer.data(), count);
+    }
+    decoded.failed = stream.hasFailed();
+    decoded.complete = stream.isComplete();
+    decoded.taken = body.bytesRead();
+    decoded.nextIntact = false;
+    if (!decoded.failed && stream.drain()) {
+        HTTPResponse next;
+        decoded.nextIntact = link.readResponseHeaders(next, 1000) && next.statusCode == 204;
+    } else if (body.isComplete()) {
+        HTTPResponse next;
+        decoded.nextIntact = link.readResponseHeaders(next, 1000) && next.statusCode == 204;
+    }
+    return decoded;
+}
+
+static void assertDecoded(const Decoded& decoded, const std::string& plain) {
+    TEST_ASSERT_FALSE(decoded.failed);
+    TEST_ASSERT_TRUE(decoded.complete);
+    TEST_ASSERT_TRUE(decoded.nextIntact);
+    TEST_ASSERT_TRUE(decoded.text == plain);
+}
+
+static void assertFailed(const std::string& packed, const char* encoding) {
+    Decoded decoded = decode(compressedResponse(packed, encoding));
+    TEST_ASSERT_TRUE(decoded.failed);
+    TEST_ASSERT_FALSE(decoded.complete);
+    TEST_ASSERT_LESS_OR_EQUAL(packed.size(), decoded.taken);
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+void test_stored_block() {
+    std::string plain(70000, '\0');
+    for (size_t i = 0; i < plain.size(); i++) {
+        plain[i] = (char)(i * 7 + i / 251);
+    }
+    DeflateWriter writer;
+    writer.stored(plain.substr(0, 65535), false); // the largest stored block
+    writer.stored(plain.substr(65535), true);
+    assertDecoded(decode(compressedResponse(writer.finish(), DEFLATE), 1000), plain);
+}
+
+void test_fixed_block() {
+    DeflateWriter writer;
+    writer.beginFixed(true);
+    std::string plain;
+    for (int symbol = 0; symbol < 256; symbol++) { // every literal length: 8 and 9 bits
+        writer.literal(symbol);
+        plain += (char)symbol;
+    }
+    for (int length : {3, 10, 11, 18, 67, 130, 257, 258}) { // every number of extra length bits
+        writer.match(length, 256);
+        for (int i = 0; i < length; i++) {
+            plain += plain[plain.size() - 256];
+        }
+    }
+    writer.endBlock();
+    assertDecoded(decode(compressedResponse(writer.finish(), DEFLATE)), plain);
+}
+
+void test_dynamic_block() {
+    std::string packed((const char*)dynamicBlock, sizeof(dynamicBlock));
+    assertDecoded(decode(compressedResponse(packed, DEFLATE)), dynamicText);
+}
+
+void test_wrappers() {
+    std::string plain;
+    std::string deflated = mixedBlocks(plain);
+    assertDecoded(decode(compressedResponse(gzip(deflated, plain), GZIP)), plain);
+    assertDecoded(decode(compressedResponse(zlib(deflated, plain), DEFLATE)), plain);
+    assertDecoded(decode(compressedResponse(deflated, DEFLATE)), plain); // raw deflate sent as "deflate"
+    assertDecoded(decode(compressedResponse(deflated, DEFLATE), 1), plain);
+}
+
+// Matches reach back the full 32 KiB, across the wrap of the window
+void test_window_back_references() {
+    std::string plain(MATRIX_INFLATE_WINDOW_SIZE + 1000, '\0');
+    uint32_t seed = 1;
+    for (char& c : plain) {
+        seed = seed * 1103515245 + 12345;
+        c = (char)(seed >> 16);
+    }
+    DeflateWriter writer;
+    writer.stored(plain, false);
+    writer.beginFixed(true);
+    for (int i = 0; i < 300; i++) {
+        int distance = i % 2 ? MATRIX_INFLATE_WINDOW_SIZE : MATRIX_INFLATE_WINDOW_SIZE - i;
+        int length = 3 + i % 256;
+        writer.match(length, distance);
+        for (int j = 0; j < length; j++) {
+            plain += plain[plain.size() - distance];
+        }
+    }
+    writer.endBlock();
+    std::string packed = writer.finish();
+    for (size_t readSize : {1, 100, 4096, 65536}) {
+        assertDecoded(decode(compressedResponse(gzip(packed, plain), GZIP), readSize), plain);
+    }
+}
+
+// The chunk boundary falls on every byte of the stream: the wrapper, block
+// headers, codes and the trailer
+void test_split_at_every_byte() {
+    std::string plain;
+    std::string packed = gzip(mixedBlocks(plain), plain);
+    for (size_t split = 0; split <= packed.size(); split++) {
+        assertDecoded(decode(compressedResponse(packed, GZIP, split), 16, split % 3 + 1), plain);
+    }
+}
+
+void test_truncated_streams() {
+    std::string plain;
+    std::string deflated = mixedBlocks(plain);
+    for (const std::string& packed : {gzip(deflated, plain), zlib(deflated, plain)}) {
+        const char* encoding = packed[0] == '\x1f' ? GZIP : DEFLATE;
+        for (size_t length = 1; length < packed.size(); length++) {
+            Decoded decoded = decode(compressedResponse(packed.substr(0, length), encoding));
+            TEST_ASSERT_TRUE(decoded.failed);
+            TEST_ASSERT_FALSE(decoded.complete);
+            TEST_ASSERT_TRUE(decoded.nextIntact); // stopped at the end of the body
+            TEST_ASSERT_TRUE(plain.compare(0, decoded.text.size(), decoded.text) == 0);
+        }
+    }
+}
+
+void test_corrupt_streams() {
+    std::string plain;
+    std::string deflated = mixedBlocks(plain);
+    std::string packed = gzip(deflated, plain);
+
+    std::string badMagic = packed;
+    badMagic[1] = '\x8c';
+    assertFailed(badMagic, GZIP);
+
+    std::string badMethod = packed;
+    badMethod[2] = 7;
+    assertFailed(badMethod, GZIP);
+
+    std::string badSize = packed;
+    badSize[badSize.size() - 4] ^= 1;
+    assertFailed(badSize, GZIP);
+
+    assertFailed(std::string("\x78\xbb", 2) + deflated, DEFLATE); // preset dictionary
+
+    DeflateWriter reserved;
+    reserved.bits(1, 1);
+    reserved.bits(3, 2);
+    assertFailed(reserved.finish() + std::string(16, '\0'), DEFLATE);
+
+    std::string badComplement = deflated;
+    badComplement[1] ^= 0x40; // LEN of the first stored block
+    assertFailed(badComplement, DEFLATE);
+
+    DeflateWriter beforeStart;
+    beforeStart.beginFixed(true);
+    beforeStart.literal('a');
+    beforeStart.match(3, 2);
+    beforeStart.endBlock();
+    assertFailed(beforeStart.finish(), DEFLATE);
+
+    DeflateWriter badLength;
+    badLength.beginFixed(true);
+    badLength.literal('a');
+    badLength.literal(286); // only in the fixed code to complete it
+    badLength.endBlock();
+    assertFailed(badLength.finish(), DEFLATE);
+
+    DeflateWriter oversubscribed;
+    oversubscribed.bits(1, 1);
+    oversubscribed.bits(2, 2);
+    oversubscribed.bits(0, 5);
+    oversubscribed.bits(0, 5);
+    oversubscribed.bits(15, 4);
+    for (int i = 0; i < 19; i++) {
+        oversubscribed.bits(1, 3); // 19 codes of one bit
+    }
+    assertFailed(oversubscribed.finish() + std::string(16, '\0'), DEFLATE);
+
+    // Whatever damaged codes decode to, decoding ends within the body
+    std::string flipped((const char*)dynamicBlock, sizeof(dynamicBlock));
+    for (size_t i = 3; i < flipped.size(); i += 7) {
+        flipped[i] ^= 0x5a;
+        Decoded decoded = decode(compressedResponse(flipped, DEFLATE));
+        TEST_ASSERT_LESS_OR_EQUAL(flipped.size(), decoded.taken);
+        TEST_ASSERT_TRUE(decoded.failed || decoded.complete);
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_stored_block);
+    RUN_TEST(test_fixed_block);
+    RUN_TEST(test_dynamic_block);
+    RUN_TEST(test_wrappers);
+    RUN_TEST(test_window_back_references);
+    RUN_TEST(test_split_at_every_byte);
+    RUN_TEST(test_truncated_streams);
+    RUN_TEST(test_corrupt_streams);
+    return UNITY_END();
+}